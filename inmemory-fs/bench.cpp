@@ -0,0 +1,90 @@
+/*
+Path lookup benchmark for simplefs.cpp, in process and without FUSE.
+For each depth it builds a chain of directories that deep, with FANOUT
+entries in every directory along it, and then times getattr() on the
+files at the bottom from 1 up to the given number of threads. Each run
+prints one JSON object per line.
+
+# Compile command
+g++ -O2 -Wall bench.cpp `pkg-config fuse3 --cflags --libs` -o simplefs-bench
+
+# run (threads default to the number of CPUs)
+./simplefs-bench [threads]
+*/
+
+#define SIMPLEFS_NO_MAIN
+#include "simplefs.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+static const int FANOUT = 64;
+static const long COMPONENTS = 20000000; // Looked up per thread and run
+
+// Builds /d0/d1/.../d<depth-1> in `fs`, with FANOUT - 1 more directories
+// beside each on the way down and FANOUT files at the bottom. Returns the
+// paths of those files.
+static std::vector<std::string> buildTree(SimpleFS& fs, int depth) {
+    std::string dir;
+    for (int level = 0; level < depth; level++) {
+        for (int i = 0; i < FANOUT; i++) {
+            std::string sibling = dir + "/d" + std::to_string(level) + "_" + std::to_string(i);
+            fs.mkdir(sibling.c_str(), 0755);
+        }
+        dir += "/d" + std::to_string(level) + "_0";
+    }
+
+    std::vector<std::string> files;
+    for (int i = 0; i < FANOUT; i++) {
+        files.push_back(dir + "/file" + std::to_string(i));
+        fs.create(files.back().c_str(), 0644, NULL);
+    }
+    return files;
+}
+
+static double runLookups(SimpleFS& fs, const std::vector<std::string>& files,
+                         long perThread, int threads) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&fs, &files, perThread, t] {
+            std::mt19937 rng(t);
+            struct stat st;
+            for (long i = 0; i < perThread; i++) {
+                if (fs.getattr(files[rng() % files.size()].c_str(), &st, NULL) != 0) {
+                    fprintf(stderr, "lookup failed\n");
+                    exit(1);
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) worker.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+    if (maxThreads < 1) maxThreads = 1;
+
+    for (int depth : {1, 8, 32, 128}) {
+        SimpleFS fs;
+        std::vector<std::string> files = buildTree(fs, depth);
+        for (int threads = 1;; threads = threads * 2 > maxThreads ? maxThreads : threads * 2) {
+            long perThread = COMPONENTS / (depth + 1);
+            double seconds = runLookups(fs, files, perThread, threads);
+            double lookups = (double)perThread * threads;
+            printf("{\"workload\": \"lookup\", \"depth\": %d, \"fanout\": %d, "
+                   "\"threads\": %d, \"lookups\": %.0f, \"seconds\": %.3f, "
+                   "\"lookups_per_sec\": %.0f, \"components_per_sec\": %.0f}\n",
+                   depth, FANOUT, threads, lookups, seconds, lookups / seconds,
+                   lookups * (depth + 1) / seconds);
+            fflush(stdout);
+            if (threads == maxThreads) break;
+        }
+    }
+    return 0;
+}
@@ -31,13 +31,204 @@ fusermount3 -u mnt
 #include <sys/stat.h>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <sys/uio.h>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <functional>
+
+// File content kept in CHUNK_SIZE chunks, keyed by chunk index. A chunk
+// holds only the bytes up to the last one written in it, and a chunk that
+// was never written is missing: both read as zeros, so a write far past
+// the end costs one chunk, not a zero-filled gap. Growing a file touches
+// only its last chunk, and truncating drops whole chunks without copying
+// the rest.
+class ChunkedContent {
+public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    size_t size() const { return length; }
+
+    // Points `iov` at the bytes in [offset, offset + size), clipped to the
+    // end of the file, one entry per chunk or hole; holes point at shared
+    // zeros. The entries are good until the content next changes. Returns
+    // the bytes covered.
+    size_t gather(off_t offset, size_t size, std::vector<struct iovec>& iov) const {
+        static const char zeros[CHUNK_SIZE] = {};
+        iov.clear();
+        if (offset < 0 || (size_t)offset >= length) return 0;
+        size = std::min(size, length - offset);
+
+        size_t pos = offset;
+        size_t end = pos + size;
+        auto it = chunks.lower_bound(pos / CHUNK_SIZE);
+        while (pos < end) {
+            size_t index = pos / CHUNK_SIZE;
+            size_t in_chunk = pos % CHUNK_SIZE;
+            size_t n = std::min(CHUNK_SIZE - in_chunk, end - pos);
+            while (it != chunks.end() && it->first < index) ++it;
+
+            const char* data = zeros;
+            if (it != chunks.end() && it->first == index &&
+                in_chunk < it->second.size()) {
+                n = std::min(n, it->second.size() - in_chunk);
+                data = it->second.data() + in_chunk;
+            }
+            iov.push_back({(void*)data, n});
+            pos += n;
+        }
+        return size;
+    }
+
+    size_t read(char* buf, size_t size, off_t offset) const {
+        std::vector<struct iovec> iov;
+        size_t total = gather(offset, size, iov);
+        for (const struct iovec& v : iov) {
+            memcpy(buf, v.iov_base, v.iov_len);
+            buf += v.iov_len;
+        }
+        return total;
+    }
+
+    void write(const char* buf, size_t size, off_t offset) {
+        size_t pos = offset;
+        size_t end = pos + size;
+        auto it = chunks.end();
+        while (pos < end) {
+            size_t index = pos / CHUNK_SIZE;
+            size_t in_chunk = pos % CHUNK_SIZE;
+            size_t n = std::min(CHUNK_SIZE - in_chunk, end - pos);
+            // Appends add chunks at the end, where the hint makes it O(1).
+            it = chunks.try_emplace(it, index);
+            std::string& chunk = it->second;
+            if (chunk.size() < in_chunk + n) chunk.resize(in_chunk + n);
+            memcpy(&chunk[in_chunk], buf, n);
+            buf += n;
+            pos += n;
+            ++it;
+        }
+        length = std::max(length, end);
+    }
 
+    void truncate(size_t size) {
+        if (size < length) {
+            size_t keep = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            chunks.erase(chunks.lower_bound(keep), chunks.end());
+            // Bytes cut off the last chunk must read as zeros if the file
+            // grows again.
+            auto last = chunks.find(size / CHUNK_SIZE);
+            if (last != chunks.end() && last->second.size() > size % CHUNK_SIZE)
+                last->second.resize(size % CHUNK_SIZE);
+        }
+        length = size;
+    }
+
+private:
+    std::map<size_t, std::string> chunks;
+    size_t length = 0;
+};
+
+struct INode;
+
+// A directory's entries: an open-addressing hash map from names to nodes
+// with linear probing. Lookups take a std::string_view, so resolving a path
+// allocates nothing, and probe one flat array, comparing names only where
+// the stored hashes match. Erasing shifts the entries after the gap back
+// into it, so there are no tombstones.
+class ChildMap {
+public:
+    INode* find(std::string_view name) const {
+        if (count == 0) return nullptr;
+        size_t hash = std::hash<std::string_view>()(name);
+        for (size_t i = hash & mask();; i = (i + 1) & mask()) {
+            const Slot& slot = slots[i];
+            if (!slot.node) return nullptr;
+            if (slot.hash == hash && slot.name == name) return slot.node;
+        }
+    }
+
+    // Adds `name` -> `node` unless the name is taken. Returns whether it did.
+    bool insert(std::string_view name, INode* node) {
+        if (find(name)) return false;
+        if ((count + 1) * 4 > slots.size() * 3) grow();
+        place(Slot{std::string(name), std::hash<std::string_view>()(name), node});
+        count++;
+        return true;
+    }
+
+    bool erase(std::string_view name) {
+        if (count == 0) return false;
+        size_t hash = std::hash<std::string_view>()(name);
+        size_t gap = hash & mask();
+        for (;; gap = (gap + 1) & mask()) {
+            if (!slots[gap].node) return false;
+            if (slots[gap].hash == hash && slots[gap].name == name) break;
+        }
+        // An entry may move back into the gap unless its home slot lies
+        // between the gap and where it is now.
+        for (size_t i = (gap + 1) & mask(); slots[i].node; i = (i + 1) & mask()) {
+            size_t home = slots[i].hash & mask();
+            if (((i - home) & mask()) >= ((i - gap) & mask())) {
+                slots[gap] = std::move(slots[i]);
+                gap = i;
+            }
+        }
+        slots[gap] = Slot();
+        count--;
+        return true;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    template <typename F>
+    void forEach(F f) const {
+        for (const Slot& slot : slots) {
+            if (slot.node) f(slot.name, slot.node);
+        }
+    }
+
+private:
+    struct Slot {
+        std::string name;
+        size_t hash = 0;
+        INode* node = nullptr; // nullptr: empty
+    };
+    std::vector<Slot> slots;
+    size_t count = 0;
+
+    size_t mask() const { return slots.size() - 1; }
+
+    void place(Slot slot) {
+        size_t i = slot.hash & mask();
+        while (slots[i].node) i = (i + 1) & mask();
+        slots[i] = std::move(slot);
+    }
+
+    void grow() {
+        std::vector<Slot> old = std::move(slots);
+        slots = std::vector<Slot>(old.empty() ? 8 : old.size() * 2);
+        for (Slot& slot : old) {
+            if (slot.node) place(std::move(slot));
+        }
+    }
+};
+
+// Every node has a reader/writer lock over its children (directories) or
+// content (files). Lookups go down from the root holding at most two locks
+// at once, the parent's until the child's is taken (lock coupling), so a
+// node cannot be removed while a lookup is on its way to it; each operation
+// then holds the node it works on, shared or exclusive. Locks are only ever
+// taken from a directory down to its entries, never the other way, except
+// across the two branches a rename locks, which rename_lock serializes.
 struct INode {
     std::string name;
-    std::string content; 
+    ChunkedContent content;
     bool is_dir;
     int permissions;
-    std::map<std::string, INode*> children; 
+    ChildMap children;
+    std::shared_mutex lock;
 
     INode(std::string n, bool dir) : name(n), is_dir(dir) {
         if (dir) permissions = 0755 | S_IFDIR;
@@ -48,49 +239,107 @@ struct INode {
 class SimpleFS {
 private:
     INode* root;
-    INode* resolvePath(const char* path) {
-        if (strcmp(path, "/") == 0) return root;
-    
-        std::string pathStr(path);
-        std::stringstream ss(pathStr);
-        std::string token;
-        INode* curr = root;
-    
-        while (std::getline(ss, token, '/')) {
-            if (token.empty()) continue; 
-    
-            if (curr->children.find(token) == curr->children.end()) {
+    std::mutex rename_lock;
+
+    // Takes the next component off the front of `path` into `name`.
+    // Returns false if there is none.
+    static bool nextName(std::string_view& path, std::string_view& name) {
+        size_t start = path.find_first_not_of('/');
+        if (start == std::string_view::npos) {
+            path = {};
+            return false;
+        }
+        path.remove_prefix(start);
+        name = path.substr(0, path.find('/'));
+        path.remove_prefix(name.size());
+        return true;
+    }
+
+    // "/root/first/second" => {"/root/first", "second"}
+    static std::pair<std::string_view, std::string_view> splitLast(std::string_view path) {
+        size_t end = path.find_last_not_of('/');
+        if (end == std::string_view::npos) return {path, {}};
+        path = path.substr(0, end + 1);
+        size_t slash = path.find_last_of('/');
+        if (slash == std::string_view::npos) return {{}, path};
+        return {path.substr(0, slash), path.substr(slash + 1)};
+    }
+
+    // Whether `path` names something below the directory `dir`.
+    static bool isBelow(std::string_view path, std::string_view dir) {
+        std::string_view a, b;
+        while (nextName(dir, b)) {
+            if (!nextName(path, a) || a != b) return false;
+        }
+        return nextName(path, a);
+    }
+
+    // Follows the components of `path` down from `from` and returns the node
+    // they lead to, locked shared or exclusive, or nullptr if there is none.
+    // `from` is locked first unless the caller holds it already, in which
+    // case it stays held.
+    static INode* walk(INode* from, bool held, std::string_view path, bool exclusive) {
+        INode* curr = from;
+        std::string_view name;
+        bool more = nextName(path, name);
+        if (!held) {
+            if (!more && exclusive) curr->lock.lock();
+            else curr->lock.lock_shared();
+        }
+        bool own = !held;
+
+        while (more) {
+            INode* next = curr->is_dir ? curr->children.find(name) : nullptr;
+            if (!next) {
+                if (own) curr->lock.unlock_shared();
                 return nullptr; // Not found
             }
-            
-            curr = curr->children[token];
+            more = nextName(path, name);
+            if (!more && exclusive) next->lock.lock();
+            else next->lock.lock_shared();
+            if (own) curr->lock.unlock_shared();
+            curr = next;
+            own = true;
         }
         return curr;
     }
-    // /root/first/second => {INode* to /root/first, "second"}
-    std::pair<INode*, std::string> getParentAndName(const char* path) {
-        std::string pathStr(path);
-        
-        size_t lastSlash = pathStr.find_last_of('/');
-        
-        std::string parentPath = pathStr.substr(0, lastSlash);
-        std::string name = pathStr.substr(lastSlash + 1);
 
-        if (parentPath.empty()) parentPath = "/";
+    INode* resolvePath(const char* path, bool exclusive) {
+        return walk(root, false, path, exclusive);
+    }
 
-        INode* parentNode = resolvePath(parentPath.c_str());
-        
+    // /root/first/second => {INode* to /root/first, "second"}, the parent
+    // locked exclusive. The name points into `path`.
+    std::pair<INode*, std::string_view> getParentAndName(const char* path) {
+        auto [parentPath, name] = splitLast(path);
+        if (name.empty()) return {nullptr, name};
+
+        INode* parentNode = walk(root, false, parentPath, true);
+        if (parentNode && !parentNode->is_dir) {
+            parentNode->lock.unlock();
+            parentNode = nullptr;
+        }
         return {parentNode, name};
     }
 
+    // Takes `name` out of the directory `parent`, which the caller holds
+    // exclusive, and frees it. Waits for whoever still holds the node; no one
+    // new can get to it through `parent`.
+    static void removeChild(INode* parent, std::string_view name) {
+        INode* target = parent->children.find(name);
+        target->lock.lock();
+        parent->children.erase(name);
+        target->lock.unlock();
+        delete target;
+    }
+
 public:
     SimpleFS() {
         root = new INode("/", true);
-        root->children["."] = root;
-        root->children[".."] = root;
         INode* hello = new INode("hello", false);
-        hello->content = "Hello from Memory!";
-        root->children["hello"] = hello;
+        const char greeting[] = "Hello from Memory!";
+        hello->content.write(greeting, strlen(greeting), 0);
+        root->children.insert("hello", hello);
     }
 
 
@@ -98,8 +347,9 @@ public:
         (void) fi;
         memset(stbuf, 0, sizeof(struct stat));
 
-        INode* node = resolvePath(path);
+        INode* node = resolvePath(path, false);
         if (!node) return -ENOENT;
+        std::shared_lock<std::shared_mutex> guard(node->lock, std::adopt_lock);
 
         stbuf->st_mode = node->permissions;
         stbuf->st_nlink = node->is_dir ? 2 : 1;
@@ -112,15 +362,17 @@ public:
                 off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
         (void) offset; (void) fi; (void) flags;
 
-        INode* node = resolvePath(path);
-        if (!node || !node->is_dir) return -ENOENT;
+        INode* node = resolvePath(path, false);
+        if (!node) return -ENOENT;
+        std::shared_lock<std::shared_mutex> guard(node->lock, std::adopt_lock);
+        if (!node->is_dir) return -ENOENT;
 
         filler(buf, ".", NULL, 0, (fuse_fill_dir_flags)0);
         filler(buf, "..", NULL, 0, (fuse_fill_dir_flags)0);
 
-        for (auto const& [name, child] : node->children) {
+        node->children.forEach([&](const std::string& name, INode*) {
             filler(buf, name.c_str(), NULL, 0, (fuse_fill_dir_flags)0);
-        }
+        });
         return 0;
     }
 
@@ -128,127 +380,178 @@ public:
              struct fuse_file_info *fi) {
         (void) fi;
         
-        INode* node = resolvePath(path);
-        if (!node || node->is_dir) return -ENOENT;
-
-        size_t len = node->content.size();
-        if (offset < (long long)(len)) {
-            if (offset + size > len) size = len - offset;
-            memcpy(buf, node->content.c_str() + offset, size);
-        } else {
-            size = 0;
-        }
-        return size;
+        INode* node = resolvePath(path, false);
+        if (!node) return -ENOENT;
+        std::shared_lock<std::shared_mutex> guard(node->lock, std::adopt_lock);
+        if (node->is_dir) return -ENOENT;
+
+        return node->content.read(buf, size, offset);
     }
     int write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
         (void) fi;
 
-        INode* node = resolvePath(path);
-        if (!node || node->is_dir) return -ENOENT;
+        INode* node = resolvePath(path, true);
+        if (!node) return -ENOENT;
+        std::unique_lock<std::shared_mutex> guard(node->lock, std::adopt_lock);
+        if (node->is_dir) return -ENOENT;
 
-        if (offset + size > node->content.size()) {
-            node->content.resize(offset + size);
-        }
-        memcpy(&node->content[offset], buf, size);
+        node->content.write(buf, size, offset);
         return size;
     }
 
     int truncate(const char *path, off_t size, struct fuse_file_info *fi) {
         (void) fi;
         
-        INode* node = resolvePath(path);
-        if (!node || node->is_dir) return -ENOENT;
+        INode* node = resolvePath(path, true);
+        if (!node) return -ENOENT;
+        std::unique_lock<std::shared_mutex> guard(node->lock, std::adopt_lock);
+        if (node->is_dir) return -ENOENT;
 
-        node->content.resize(size);
+        node->content.truncate(size);
         return 0;
     }
 
     int mkdir(const char *path, mode_t mode) {
         auto [parentNode, name] = getParentAndName(path);
         if (!parentNode) return -ENOENT;
+        std::unique_lock<std::shared_mutex> guard(parentNode->lock, std::adopt_lock);
 
-        if (parentNode->children.find(name) != parentNode->children.end()) {
+        if (parentNode->children.find(name)) {
             return -EEXIST; // Already exists
         }
 
-        INode* newDir = new INode(name, true);
-        parentNode->children[name] = newDir;
-        newDir->children["."] = newDir;
-        newDir->children[".."] = parentNode;
+        INode* newDir = new INode(std::string(name), true);
+        parentNode->children.insert(name, newDir);
         return 0;
     }
 
     int unlink(const char *path) {
         auto [parentNode, name] = getParentAndName(path);
         if (!parentNode) return -ENOENT;
+        std::unique_lock<std::shared_mutex> guard(parentNode->lock, std::adopt_lock);
 
-        if (parentNode->children.find(name) == parentNode->children.end()) {
+        INode* target = parentNode->children.find(name);
+        if (!target) {
             return -ENOENT; // Not found
         }
-
-        INode* target = parentNode->children[name];
         if (target->is_dir) {
             return -EISDIR; // Is a directory
         }
 
-        parentNode->children.erase(name);
-        delete target;
+        removeChild(parentNode, name);
         return 0;
     }
     int rmdir(const char *path) {
         auto [parentNode, name] = getParentAndName(path);
         if (!parentNode) return -ENOENT;
+        std::unique_lock<std::shared_mutex> guard(parentNode->lock, std::adopt_lock);
 
-        if (parentNode->children.find(name) == parentNode->children.end()) {
+        INode* target = parentNode->children.find(name);
+        if (!target) {
             return -ENOENT; // Not found
         }
-
-        INode* target = parentNode->children[name];
         if (!target->is_dir) {
             return -ENOTDIR; // Not a directory
         }
 
-        if (target->children.size() > 2) { // . and ..
-            return -ENOTEMPTY; // Directory not empty
+        // No one gets to `target` past its parent, which we hold, so it
+        // stays empty once checked.
+        {
+            std::shared_lock<std::shared_mutex> target_guard(target->lock);
+            if (!target->children.empty()) {
+                return -ENOTEMPTY; // Directory not empty
+            }
         }
 
-        parentNode->children.erase(name);
-        delete target;
+        removeChild(parentNode, name);
         return 0;
     }
     int create(const char *path, mode_t mode, struct fuse_file_info *fi) {
         auto [parentNode, name] = getParentAndName(path);
         if (!parentNode) return -ENOENT;
+        std::unique_lock<std::shared_mutex> guard(parentNode->lock, std::adopt_lock);
 
-        if (parentNode->children.find(name) != parentNode->children.end()) {
+        if (parentNode->children.find(name)) {
             return -EEXIST;
         }
 
-        INode* newFile = new INode(name, false);
-        parentNode->children[name] = newFile;
+        INode* newFile = new INode(std::string(name), false);
+        parentNode->children.insert(name, newFile);
         return 0;
     }
 
+    // Locks both parents exclusive. Below the deepest directory the two
+    // paths share, their branches are disjoint, so each is locked down its
+    // own branch; rename_lock keeps two renames from doing that in opposite
+    // orders.
     int rename(const char *oldpath, const char *newpath, unsigned int flags) {
-        auto [oldParent, oldName] = getParentAndName(oldpath);
-        auto [newParent, newName] = getParentAndName(newpath);
-
-        if (!oldParent || !newParent) return -ENOENT;
+        auto [oldDir, oldName] = splitLast(oldpath);
+        auto [newDir, newName] = splitLast(newpath);
+        if (oldName.empty() || newName.empty()) return -EBUSY;
+
+        // A directory cannot move below itself.
+        if (isBelow(newpath, oldpath)) return -EINVAL;
+
+        // Splits each parent's path after the directories both share.
+        std::string_view oldRest = oldDir, newRest = newDir;
+        for (std::string_view a = oldRest, b = newRest, x, y;
+             nextName(a, x) && nextName(b, y) && x == y;) {
+            oldRest = a;
+            newRest = b;
+        }
+        std::string_view common = oldDir.substr(0, oldDir.size() - oldRest.size());
+
+        std::lock_guard<std::mutex> renaming(rename_lock);
+        bool shared = oldRest.find_first_not_of('/') != std::string_view::npos &&
+                      newRest.find_first_not_of('/') != std::string_view::npos;
+        INode* top = walk(root, false, common, !shared);
+        if (!top) return -ENOENT;
+        INode* oldParent = walk(top, true, oldRest, true);
+        INode* newParent = oldParent ? walk(top, true, newRest, true) : nullptr;
+
+        int ret = oldParent && newParent
+            ? move(oldParent, oldName, newParent, newName, flags)
+            : -ENOENT;
+
+        if (newParent && newParent != top) newParent->lock.unlock();
+        if (oldParent && oldParent != top) oldParent->lock.unlock();
+        if (shared) top->lock.unlock_shared();
+        else top->lock.unlock();
+        return ret;
+    }
 
-        if (oldParent->children.find(oldName) == oldParent->children.end()) {
+private:
+    // The rest of rename(), with both parents held exclusive.
+    static int move(INode* oldParent, std::string_view oldName,
+                    INode* newParent, std::string_view newName, unsigned int flags) {
+        if (!oldParent->is_dir || !newParent->is_dir) return -ENOENT;
+        INode* target = oldParent->children.find(oldName);
+        if (!target) {
             return -ENOENT; // Old path not found
         }
 
-        if (flags & RENAME_NOREPLACE) {
-            if (newParent->children.find(newName) != newParent->children.end()) {
+        INode* victim = newParent->children.find(newName);
+        if (victim) {
+            if (flags & RENAME_NOREPLACE) {
                 return -EEXIST; // New path exists
             }
+            if (victim == target) return 0;
+            // The new path is above the old one, so not empty.
+            if (victim == oldParent) return -ENOTEMPTY;
+            if (victim->is_dir != target->is_dir) {
+                return victim->is_dir ? -EISDIR : -ENOTDIR;
+            }
+            if (victim->is_dir) {
+                std::shared_lock<std::shared_mutex> victim_guard(victim->lock);
+                if (!victim->children.empty()) return -ENOTEMPTY;
+            }
+            removeChild(newParent, newName);
         }
 
-        INode* target = oldParent->children[oldName];
         oldParent->children.erase(oldName);
-        newParent->children[newName] = target;
-        target->name = newName;
+        newParent->children.insert(newName, target);
+        std::unique_lock<std::shared_mutex> target_guard(target->lock);
+        target->name = std::string(newName);
 
         return 0;
         
@@ -256,6 +559,10 @@ public:
 
 };
 
+// bench.cpp builds this file in with its own main() instead of the FUSE
+// glue below.
+#ifndef SIMPLEFS_NO_MAIN
+
 SimpleFS fs_instance;
 
 
@@ -288,4 +595,6 @@ static struct fuse_operations simplefs_oper = {
 
 int main(int argc, char *argv[]) {
     return fuse_main(argc, argv, &simplefs_oper, NULL);
-}
\ No newline at end of file
+}
+
+#endif // SIMPLEFS_NO_MAIN
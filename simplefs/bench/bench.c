@@ -0,0 +1,378 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "cluster.h"
+#include "def.h"
+#include "format.h"
+#include "helper.h"
+#include "io.h"
+#include "journal.h"
+#include "operator/operator.h"
+#include "orphan.h"
+#include "readahead.h"
+
+// In-process benchmark of the operators. A fresh sparse image is formatted
+// and mounted the way main() does it, minus FUSE, and a fixed sequence of
+// workloads runs against it with a fixed random seed. Each workload prints
+// one JSON object per line on stdout; diagnostics go to stderr.
+//
+// A workload's "seconds" is wall time for all of its operations plus the
+// fsync() that ends it, so buffered work is paid for where it was done.
+// Latencies are per operation and exclude that fsync().
+
+#define FILE_BYTES (64 << 20)
+#define SMALL_FILE_BYTES 1024
+#define CREATE_FILES 5000
+#define LOOKUPS 50000
+#define LOOKUP_DEPTH 32
+#define READDIRS 20
+#define RANDOM_OPS 20000
+#define MAX_IO (1 << 20)
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static const size_t seq_sizes[] = {4096, 65536, MAX_IO};
+static const size_t random_sizes[] = {4096, 65536};
+
+static unsigned scale = 1;
+static const char *only = NULL;
+
+typedef struct {
+  uint64_t *latency;  // Nanoseconds per operation
+  size_t ops;
+  size_t capacity;
+  uint64_t bytes;
+  uint64_t start;
+} Run;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *what, int err) {
+  fprintf(stderr, "bench: %s: %s\n", what, strerror(err < 0 ? -err : err));
+  exit(1);
+}
+
+// Whether the workload called `name` was asked for.
+static int selected(const char *name) { return !only || strstr(name, only); }
+
+static void run_begin(Run *run, size_t ops) {
+  run->latency = malloc(ops * sizeof(uint64_t));
+  if (!run->latency) die("malloc", ENOMEM);
+  run->capacity = ops;
+  run->ops = 0;
+  run->bytes = 0;
+  run->start = now_ns();
+}
+
+static void run_op(Run *run, uint64_t began, size_t bytes) {
+  if (run->ops < run->capacity) run->latency[run->ops++] = now_ns() - began;
+  run->bytes += bytes;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const Run *run, unsigned pct) {
+  if (run->ops == 0) return 0;
+  return run->latency[(run->ops - 1) * pct / 100] / 1e3;
+}
+
+static void run_end(Run *run, const char *workload, size_t io_size) {
+  double seconds = (now_ns() - run->start) / 1e9;
+  qsort(run->latency, run->ops, sizeof(uint64_t), compare_u64);
+  printf(
+      "{\"workload\":\"%s\",\"io_size\":%zu,\"ops\":%zu,\"seconds\":%.6f,"
+      "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%.2f,"
+      "\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+      workload, io_size, run->ops, seconds, run->ops / seconds,
+      run->bytes / seconds / (1 << 20), percentile_us(run, 50),
+      percentile_us(run, 99),
+      run->ops ? run->latency[run->ops - 1] / 1e3 : 0.0);
+  fflush(stdout);
+  free(run->latency);
+}
+
+static void sync_file(const char *path, struct fuse_file_info *fi) {
+  int ret = myfs_fsync(path, 0, fi);
+  if (ret != 0) die("fsync", ret);
+}
+
+static void create_storm(void) {
+  char buf[SMALL_FILE_BYTES];
+  memset(buf, 'c', sizeof(buf));
+  int ret = myfs_mkdir("/create", 0755);
+  if (ret != 0) die("mkdir /create", ret);
+
+  size_t files = (size_t)CREATE_FILES * scale;
+  Run run;
+  run_begin(&run, files);
+  for (size_t i = 0; i < files; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/create/file%zu", i);
+    struct fuse_file_info fi = {0};
+    uint64_t began = now_ns();
+    if ((ret = myfs_create(path, 0644, &fi)) != 0) die("create", ret);
+    ret = myfs_write(path, buf, sizeof(buf), 0, &fi);
+    if (ret != (int)sizeof(buf)) die("write", ret);
+    myfs_release(path, &fi);
+    run_op(&run, began, sizeof(buf));
+  }
+  sync_file("/create", NULL);
+  run_end(&run, "create", sizeof(buf));
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st,
+                       off_t off, enum fuse_fill_dir_flags flags) {
+  (void)name;
+  (void)st;
+  (void)off;
+  (void)flags;
+  (*(size_t *)buf)++;
+  return 0;
+}
+
+// Lists the directory the create storm filled.
+static void large_readdir(void) {
+  Run run;
+  run_begin(&run, READDIRS);
+  for (int i = 0; i < READDIRS; i++) {
+    size_t entries = 0;
+    uint64_t began = now_ns();
+    int ret = myfs_readdir("/create", &entries, count_entry, 0, NULL, 0);
+    if (ret != 0) die("readdir", ret);
+    run_op(&run, began, 0);
+    if (entries < (size_t)CREATE_FILES * scale) die("readdir", EIO);
+  }
+  run_end(&run, "readdir", 0);
+}
+
+static void deep_lookup(void) {
+  char path[LOOKUP_DEPTH * 8 + 16] = "";
+  size_t len = 0;
+  for (int d = 0; d < LOOKUP_DEPTH; d++) {
+    len += snprintf(path + len, sizeof(path) - len, "/d%d", d);
+    int ret = myfs_mkdir(path, 0755);
+    if (ret != 0) die("mkdir", ret);
+  }
+  snprintf(path + len, sizeof(path) - len, "/leaf");
+  int ret = myfs_mknod(path, 0644, 0);
+  if (ret != 0) die("mknod", ret);
+
+  size_t lookups = (size_t)LOOKUPS * scale;
+  Run run;
+  run_begin(&run, lookups);
+  for (size_t i = 0; i < lookups; i++) {
+    struct stat st;
+    uint64_t began = now_ns();
+    if ((ret = myfs_getattr(path, &st, NULL)) != 0) die("getattr", ret);
+    run_op(&run, began, 0);
+  }
+  run_end(&run, "lookup", 0);
+}
+
+static void open_file(const char *path, int create,
+                      struct fuse_file_info *fi) {
+  memset(fi, 0, sizeof(*fi));
+  int ret = create ? myfs_create(path, 0644, fi) : myfs_open(path, fi);
+  if (ret != 0) die(path, ret);
+}
+
+static void sequential(const char *workload, int write, size_t size,
+                       char *buf) {
+  char path[32];
+  snprintf(path, sizeof(path), "/seq%zu", size);
+  struct fuse_file_info fi;
+  open_file(path, write, &fi);
+
+  size_t ops = (size_t)FILE_BYTES * scale / size;
+  Run run;
+  run_begin(&run, ops);
+  for (size_t i = 0; i < ops; i++) {
+    off_t offset = (off_t)i * size;
+    uint64_t began = now_ns();
+    int ret = write ? myfs_write(path, buf, size, offset, &fi)
+                    : myfs_read(path, buf, size, offset, &fi);
+    if (ret != (int)size) die(workload, ret < 0 ? ret : -EIO);
+    run_op(&run, began, size);
+  }
+  sync_file(path, &fi);
+  run_end(&run, workload, size);
+  myfs_release(path, &fi);
+}
+
+// Aligned random I/O within the file the largest sequential write made.
+static void random_io(const char *workload, int write, size_t size,
+                      char *buf) {
+  char path[32];
+  snprintf(path, sizeof(path), "/seq%d", MAX_IO);
+  struct fuse_file_info fi;
+  open_file(path, 0, &fi);
+
+  uint64_t slots = (uint64_t)FILE_BYTES * scale / size;
+  size_t ops = (size_t)RANDOM_OPS * scale;
+  if (ops > slots) ops = slots;
+  unsigned seed = 1;
+  Run run;
+  run_begin(&run, ops);
+  for (size_t i = 0; i < ops; i++) {
+    uint64_t slot = (((uint64_t)rand_r(&seed) << 31) | rand_r(&seed)) % slots;
+    off_t offset = (off_t)(slot * size);
+    uint64_t began = now_ns();
+    int ret = write ? myfs_write(path, buf, size, offset, &fi)
+                    : myfs_read(path, buf, size, offset, &fi);
+    if (ret != (int)size) die(workload, ret < 0 ? ret : -EIO);
+    run_op(&run, began, size);
+  }
+  sync_file(path, &fi);
+  run_end(&run, workload, size);
+  myfs_release(path, &fi);
+}
+
+static int mount_image(const char *image, const char *io_spec,
+                       uint32_t cache_blocks, unsigned commit_ms) {
+  disk_fd = open(image, O_RDWR);
+  if (disk_fd < 0) return -errno;
+  int ret;
+  if ((ret = load_superblock()) != 0) return ret;
+  if ((ret = io_init(io_spec)) != 0) return ret;
+  if ((ret = journal_init(commit_ms)) != 0) return ret;
+  if ((ret = alloc_init()) != 0) return ret;
+  if (io_map(0, BLOCK_SIZE)) cache_blocks = 0;
+  if ((ret = cache_init(cache_blocks, CACHE_DEFAULT_WRITEBACK_SEC)) != 0)
+    return ret;
+  if ((ret = orphan_init()) != 0) return ret;
+  readahead_set_max(READAHEAD_DEFAULT_MAX);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  const char *io_spec = IO_DEFAULT_BACKEND;
+  uint32_t block_size = DEFAULT_BLOCK_SIZE;
+  uint64_t disk_mb = 1024;
+  uint32_t cache_blocks = CACHE_DEFAULT_BLOCKS;
+  unsigned commit_ms = JOURNAL_DEFAULT_COMMIT_MS;
+  int compress = 0;
+  int opt;
+
+  // Getopt: -d <dir> where the temporary image goes
+  //         -I <backend> I/O backend, as for simplefs
+  //         -b <bytes> block size
+  //         -s <MiB> image size
+  //         -c <blocks> block cache size
+  //         -i <ms> journal commit interval
+  //         -z compress file data
+  //         -S <n> multiply every workload's size by n
+  //         -w <name> run only the workloads whose name contains this
+  while ((opt = getopt(argc, argv, "d:I:b:s:c:i:zS:w:")) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 'I':
+        io_spec = optarg;
+        break;
+      case 'b':
+        block_size = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        disk_mb = strtoull(optarg, NULL, 10);
+        break;
+      case 'c':
+        cache_blocks = strtoul(optarg, NULL, 10);
+        break;
+      case 'i':
+        commit_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'z':
+        compress = 1;
+        break;
+      case 'S':
+        scale = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        only = optarg;
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-d dir] [-I backend] [-b block_size] [-s MiB] "
+                "[-c cache_blocks] [-i commit_ms] [-z] [-S scale] [-w workload]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (!valid_block_size(block_size) || scale == 0) {
+    fprintf(stderr, "bench: bad block size or scale\n");
+    return 1;
+  }
+
+  char image[4096];
+  snprintf(image, sizeof(image), "%s/simplefs-bench-XXXXXX", dir);
+  int fd = mkstemp(image);
+  if (fd < 0) die(image, errno);
+  close(fd);
+
+  uint64_t block_count = (disk_mb << 20) / block_size;
+  uint64_t journal_blocks = default_journal_blocks(block_count);
+  format_disk(image, block_size, block_count, journal_blocks, 0);
+  int ret = mount_image(image, io_spec, cache_blocks, commit_ms);
+  if (ret != 0) {
+    unlink(image);
+    die("mount", ret);
+  }
+  cluster_set_compress(compress);
+
+  printf(
+      "{\"bench\":\"simplefs\",\"version\":%d,\"io\":\"%s\","
+      "\"block_size\":%u,\"disk_bytes\":%llu,\"journal_blocks\":%llu,"
+      "\"cache_blocks\":%u,\"commit_ms\":%u,\"compress\":%d,"
+      "\"scale\":%u}\n",
+      SIMPLEFS_VERSION, io_backend_name(), block_size,
+      (unsigned long long)(block_count * block_size),
+      (unsigned long long)journal_blocks, cache_blocks, commit_ms, compress,
+      scale);
+
+  char *buf = malloc(MAX_IO);
+  if (!buf) die("malloc", ENOMEM);
+  for (size_t i = 0; i < MAX_IO; i++) buf[i] = i * 31 + (i >> 12);
+
+  // Later workloads use what earlier ones made, which a filtered run still
+  // has to make (and report).
+  int random = selected("rand_write") || selected("rand_read");
+  if (selected("create") || selected("readdir")) create_storm();
+  if (selected("readdir")) large_readdir();
+  if (selected("lookup")) deep_lookup();
+  for (size_t i = 0; i < COUNT(seq_sizes); i++) {
+    if (selected("seq_write") || selected("seq_read") ||
+        (random && seq_sizes[i] == MAX_IO))
+      sequential("seq_write", 1, seq_sizes[i], buf);
+    if (selected("seq_read")) sequential("seq_read", 0, seq_sizes[i], buf);
+  }
+  for (size_t i = 0; i < COUNT(random_sizes); i++) {
+    if (selected("rand_write"))
+      random_io("rand_write", 1, random_sizes[i], buf);
+    if (selected("rand_read")) random_io("rand_read", 0, random_sizes[i], buf);
+  }
+
+  free(buf);
+  myfs_destroy(NULL);
+  close(disk_fd);
+  unlink(image);
+  return 0;
+}
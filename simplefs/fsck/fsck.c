@@ -0,0 +1,833 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cluster.h"
+#include "def.h"
+#include "dir.h"
+#include "extent.h"
+#include "helper.h"
+#include "io.h"
+#include "journal.h"
+
+// Offline checker for an unmounted image.
+//
+// Pass 1 reads the whole image in FSCK_CHUNK pieces, from several threads,
+// and summarizes each block whose header names the block itself and a node
+// type: its keys, its links, the blocks it maps. It does not go by the
+// bitmap, which may have lost a node's bit. File data has no header and
+// may look like a node too, so a summary only counts once pass 2 reaches
+// it.
+//
+// Pass 2 walks the tree from the root and the orphan list through the
+// summaries alone, a file or directory per task across the threads. It
+// checks key order and ranges, depths, the directory leaf chains and entry
+// counts, extents against the file size, and marks every block it reaches;
+// a block reached twice belongs to two owners.
+//
+// Pass 3 compares the marks with the allocation bitmap: a block in use that
+// nothing reaches is leaked, and a block reached but free would be handed
+// out again. With -r the journal is replayed first, as a mount would, and
+// the bitmap is rewritten from the marks, unless pass 2 found the tree
+// damaged.
+//
+// Exits as fsck(8) does: 0 if the image is clean, 1 if its errors were
+// corrected, 4 if errors are left, 8 if it could not be checked.
+
+#define FSCK_CHUNK (8 << 20)
+#define MAX_REPORTS 100
+#define MAX_TREE_DEPTH 16
+#define WORD_BITS 64
+
+enum Exit { CLEAN = 0, CORRECTED = 1, UNCORRECTED = 4, FAILED = 8 };
+
+enum Problem {
+  FINE,
+  BAD_COUNT,
+  BAD_DEPTH,
+  UNSORTED,
+  BAD_EXTENT,
+  BAD_ENTRY,
+};
+
+static const char *problems[] = {
+    [BAD_COUNT] = "has more entries than fit",
+    [BAD_DEPTH] = "is deeper than any tree grows",
+    [UNSORTED] = "has keys out of order",
+    [BAD_EXTENT] = "has an empty, overflowing or misaligned extent",
+    [BAD_ENTRY] = "has an entry with a bad name, hash or type",
+};
+
+// A block that looks like a node. Its links are `count` entries of `links`
+// from `links_at`: children in inner nodes, named nodes in directory
+// leaves, mapped runs in extent leaves.
+typedef struct {
+  BlockID id;
+  BlockID next_block;
+  int64_t size;
+  uint64_t first_key;  // Of its first entry, and of its last
+  uint64_t last_key;
+  uint64_t end;  // Extent leaves: past the last file block mapped
+  uint64_t links_at;
+  uint16_t count;
+  uint16_t depth;
+  uint8_t type;
+  uint8_t problem;
+} Node;
+
+typedef struct {
+  BlockID to;
+  uint64_t key;    // Inner nodes: lowest key below
+  uint32_t count;  // Extent leaves: disk blocks
+  uint8_t type;    // Directory leaves: what the entry says it names
+} Link;
+
+// What pass 1 found in one chunk, in block order.
+typedef struct {
+  Node *nodes;
+  size_t node_count;
+  size_t node_capacity;
+  Link *links;
+  size_t link_count;
+  size_t link_capacity;
+} Chunk;
+
+// A file or directory for pass 2 to check.
+typedef struct {
+  BlockID id;
+  BlockID parent;  // 0 for the root and removed nodes
+  uint8_t type;    // What the parent says it is, 0 if nothing says
+  uint8_t removed;
+} Task;
+
+static unsigned threads;
+static uint64_t *bitmap;  // As on disk
+static uint64_t *marks;   // Reached by pass 2, as the bitmap should be
+static uint64_t bitmap_words;
+
+static Chunk *chunks;
+static uint64_t chunk_count;
+static uint64_t next_chunk = 0;
+static uint64_t bytes_read = 0;
+static int read_error = 0;
+
+static Node *nodes;
+static size_t node_count;
+static Link *links;
+
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+static Task *tasks;
+static size_t task_count = 0;
+static size_t task_capacity = 0;
+static unsigned busy = 0;
+
+static uint64_t errors = 0;
+static uint64_t shown = 0;
+static uint64_t dirs = 0, files = 0, removed = 0, data_blocks = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void vnote(const char *fmt, va_list ap) {
+  if (__atomic_fetch_add(&shown, 1, __ATOMIC_RELAXED) >= MAX_REPORTS) return;
+  pthread_mutex_lock(&report_lock);
+  vprintf(fmt, ap);
+  putchar('\n');
+  pthread_mutex_unlock(&report_lock);
+}
+
+// A finding that rebuilding the free map takes care of.
+static void note(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vnote(fmt, ap);
+  va_end(ap);
+}
+
+// An error in the structure, which stays.
+static void report(const char *fmt, ...) {
+  __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+  va_list ap;
+  va_start(ap, fmt);
+  vnote(fmt, ap);
+  va_end(ap);
+}
+
+static const char *type_name(int type) {
+  switch (type) {
+    case _DIRECTORY:
+      return "directory";
+    case _FILE:
+      return "file";
+    case _EXTENT_NODE:
+      return "extent node";
+    case _DIR_NODE:
+      return "directory node";
+  }
+  return "block";
+}
+
+// Marks `count` blocks from `start` as reached. Returns how many of them
+// already were.
+static uint64_t mark(BlockID start, uint64_t count) {
+  uint64_t again = 0;
+  while (count > 0) {
+    unsigned shift = start % WORD_BITS;
+    unsigned n = WORD_BITS - shift < count ? WORD_BITS - shift : count;
+    uint64_t mask = (n == WORD_BITS ? ~0ULL : (1ULL << n) - 1) << shift;
+    uint64_t old =
+        __atomic_fetch_or(&marks[start / WORD_BITS], mask, __ATOMIC_RELAXED);
+    again += __builtin_popcountll(old & mask);
+    start += n;
+    count -= n;
+  }
+  return again;
+}
+
+// Pass 1.
+
+static Link *add_link(Chunk *c) {
+  if (c->link_count == c->link_capacity) {
+    size_t capacity = c->link_capacity ? c->link_capacity * 2 : 1024;
+    Link *grown = realloc(c->links, capacity * sizeof(Link));
+    if (!grown) return NULL;
+    c->links = grown;
+    c->link_capacity = capacity;
+  }
+  Link *link = &c->links[c->link_count++];
+  memset(link, 0, sizeof(Link));
+  return link;
+}
+
+static int good_entry(const DirEntry *e) {
+  const char *end = memchr(e->name, '\0', MAX_FILENAME_LEN);
+  return end && end != e->name && !memchr(e->name, '/', end - e->name) &&
+         name_hash(e->name) == e->hash &&
+         (e->type == _FILE || e->type == _DIRECTORY);
+}
+
+static int summarize_dir(const DirNode *dn, Node *n, Chunk *c) {
+  size_t cap = dn->depth ? DIR_INDEXES_PER_NODE : DIRENTS_PER_NODE;
+  if (dn->count > cap) {
+    n->problem = BAD_COUNT;
+    return 0;
+  }
+  int first = dn->depth ? 1 : 0;
+  for (int i = 0; i < dn->count; i++) {
+    Link *link = add_link(c);
+    if (!link) return -ENOMEM;
+    uint64_t key;
+    if (dn->depth) {
+      const DirIndex *index = &NODE_DIR_INDEX(dn)[i];
+      key = ((uint64_t)index->hash << 16) | index->seq;
+      link->to = index->child;
+      link->key = key;
+    } else {
+      const DirEntry *e = &NODE_DIRENTS(dn)[i];
+      key = dir_entry_key(e);
+      if (!good_entry(e) && !n->problem) n->problem = BAD_ENTRY;
+      link->to = e->id;
+      link->type = e->type;
+    }
+    // Inserts below index[0] go to child 0 and leave the key as it was, so
+    // it bounds nothing.
+    if (dn->depth && i == 0) continue;
+    if (i > first && key <= n->last_key && !n->problem) n->problem = UNSORTED;
+    if (i == first) n->first_key = key;
+    n->last_key = key;
+  }
+  n->count = dn->count;
+  return 0;
+}
+
+static int summarize_extents(const ExtentNode *en, Node *n, Chunk *c) {
+  size_t cap = en->depth ? INDEXES_PER_NODE : EXTENTS_PER_NODE;
+  if (en->count > cap) {
+    n->problem = BAD_COUNT;
+    return 0;
+  }
+  for (int i = 0; i < en->count; i++) {
+    Link *link = add_link(c);
+    if (!link) return -ENOMEM;
+    uint64_t key;
+    if (en->depth) {
+      const ExtentIndex *index = &NODE_EXTENT_INDEX(en)[i];
+      key = index->logical;
+      if (i > 0 && key <= n->last_key && !n->problem) n->problem = UNSORTED;
+      link->to = index->child;
+      link->key = key;
+    } else {
+      const Extent *e = &NODE_EXTENTS(en)[i];
+      key = e->logical;
+      uint64_t end = (uint64_t)e->logical + e->length;
+      int bad = e->length == 0 || end > EXTENT_HOLE_MAX;
+      if (e->stored)
+        bad |= e->stored >= CLUSTER_BLOCKS || e->length != CLUSTER_BLOCKS ||
+               e->logical % CLUSTER_BLOCKS != 0;
+      if (bad && !n->problem) n->problem = BAD_EXTENT;
+      if (i > 0 && key < n->end && !n->problem) n->problem = UNSORTED;
+      n->end = end;
+      link->to = e->start;
+      link->key = key;
+      link->count = e->stored ? e->stored : e->length;
+    }
+    if (i == 0) n->first_key = key;
+    n->last_key = key;
+  }
+  n->count = en->count;
+  return 0;
+}
+
+// Adds a summary of `block` to `c` if it looks like the node `id`.
+static int summarize(const Block *block, BlockID id, Chunk *c) {
+  if (block->id != id || block->type < _DIRECTORY ||
+      block->type > _DIR_NODE)
+    return 0;
+  if (c->node_count == c->node_capacity) {
+    size_t capacity = c->node_capacity ? c->node_capacity * 2 : 256;
+    Node *grown = realloc(c->nodes, capacity * sizeof(Node));
+    if (!grown) return -ENOMEM;
+    c->nodes = grown;
+    c->node_capacity = capacity;
+  }
+  Node *n = &c->nodes[c->node_count++];
+  memset(n, 0, sizeof(Node));
+  n->id = id;
+  n->type = block->type;
+  n->next_block = block->next_block;
+  n->size = block->size;
+  n->links_at = c->link_count;
+
+  int dir = block->type == _DIRECTORY || block->type == _DIR_NODE;
+  n->depth = dir ? DIR_NODE(block)->depth : EXTENT_NODE(block)->depth;
+  if (n->depth > MAX_TREE_DEPTH) {
+    n->problem = BAD_DEPTH;
+    return 0;
+  }
+  return dir ? summarize_dir(DIR_NODE(block), n, c)
+             : summarize_extents(EXTENT_NODE(block), n, c);
+}
+
+static void *scan_main(void *arg) {
+  (void)arg;
+  Byte *buf = malloc(FSCK_CHUNK);
+  if (!buf) {
+    __atomic_store_n(&read_error, -ENOMEM, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  uint64_t per_chunk = FSCK_CHUNK / BLOCK_SIZE;
+  for (;;) {
+    uint64_t i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+    if (i >= chunk_count) break;
+    BlockID first = i * per_chunk;
+    BlockID last = first + per_chunk;
+    if ((uint64_t)last > sb.block_count) last = sb.block_count;
+    // Below the root are the superblock, the bitmap and the journal. The
+    // bitmap is not trusted to say where the rest are.
+    if (first <= sb.root) first = sb.root;
+    if (first >= last) continue;
+
+    size_t size = (size_t)(last - first) * BLOCK_SIZE;
+    int ret = io_read(buf, size, (off_t)first * BLOCK_SIZE);
+    for (BlockID id = first; ret == 0 && id < last; id++) {
+      const Block *block = (const Block *)(buf + (id - first) * BLOCK_SIZE);
+      ret = summarize(block, id, &chunks[i]);
+    }
+    if (ret != 0) {
+      __atomic_store_n(&read_error, ret, __ATOMIC_RELAXED);
+      break;
+    }
+    __atomic_add_fetch(&bytes_read, size, __ATOMIC_RELAXED);
+  }
+  free(buf);
+  return NULL;
+}
+
+// Joins the chunks' summaries into `nodes` and `links`, in block order.
+static int merge_chunks(void) {
+  size_t total_links = 0;
+  node_count = 0;
+  for (uint64_t i = 0; i < chunk_count; i++) {
+    node_count += chunks[i].node_count;
+    total_links += chunks[i].link_count;
+  }
+  nodes = malloc((node_count ? node_count : 1) * sizeof(Node));
+  links = malloc((total_links ? total_links : 1) * sizeof(Link));
+  if (!nodes || !links) return -ENOMEM;
+
+  size_t n = 0, l = 0;
+  for (uint64_t i = 0; i < chunk_count; i++) {
+    Chunk *c = &chunks[i];
+    for (size_t j = 0; j < c->node_count; j++) {
+      nodes[n] = c->nodes[j];
+      nodes[n++].links_at += l;
+    }
+    if (c->link_count)
+      memcpy(links + l, c->links, c->link_count * sizeof(Link));
+    l += c->link_count;
+    free(c->nodes);
+    free(c->links);
+  }
+  free(chunks);
+  chunks = NULL;
+  return 0;
+}
+
+// Pass 2.
+
+static const Node *find(BlockID id) {
+  size_t lo = 0, hi = node_count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (nodes[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < node_count && nodes[lo].id == id ? &nodes[lo] : NULL;
+}
+
+static void push_task(BlockID id, BlockID parent, uint8_t type, int orphan) {
+  pthread_mutex_lock(&task_lock);
+  if (task_count == task_capacity) {
+    size_t capacity = task_capacity ? task_capacity * 2 : 1024;
+    Task *grown = realloc(tasks, capacity * sizeof(Task));
+    if (!grown) {
+      pthread_mutex_unlock(&task_lock);
+      report("out of memory: %s %lld left unchecked", type_name(type),
+             (long long)id);
+      return;
+    }
+    tasks = grown;
+    task_capacity = capacity;
+  }
+  tasks[task_count++] = (Task){id, parent, type, orphan};
+  pthread_cond_signal(&task_cond);
+  pthread_mutex_unlock(&task_lock);
+}
+
+// The walk down one file's or directory's tree.
+typedef struct {
+  const Node *head;
+  const Node *last_leaf;  // Directories: to follow the leaf chain
+  uint64_t entries;       // Directories: entries seen
+  uint64_t end;           // Files: past the last file block mapped yet
+  uint64_t last_start;    // Files: where the last extent starts
+  int removed;
+} Walk;
+
+static void walk_leaf(Walk *w, const Node *n) {
+  const Link *l = &links[n->links_at];
+  BlockID head = w->head->id;
+  if (w->head->type == _DIRECTORY) {
+    if (w->last_leaf && w->last_leaf->next_block != n->id)
+      report("directory %lld: leaf %lld links to %lld, not to the next leaf "
+             "%lld",
+             (long long)head, (long long)w->last_leaf->id,
+             (long long)w->last_leaf->next_block, (long long)n->id);
+    w->last_leaf = n;
+    w->entries += n->count;
+    for (int i = 0; !w->removed && i < n->count; i++)
+      push_task(l[i].to, head, l[i].type, 0);
+    return;
+  }
+
+  if (n->count > 0 && n->first_key < w->end)
+    report("file %lld: extents from block %llu overlap those before",
+           (long long)head, (unsigned long long)n->first_key);
+  for (int i = 0; i < n->count; i++) {
+    BlockID start = l[i].to;
+    if (start <= sb.root || (uint64_t)start + l[i].count > sb.block_count) {
+      report("file %lld: block %llu maps to %lld+%u, outside the data area",
+             (long long)head, (unsigned long long)l[i].key,
+             (long long)start, l[i].count);
+      continue;
+    }
+    uint64_t again = mark(start, l[i].count);
+    if (again)
+      report("file %lld: %llu of blocks %lld+%u belong to something else "
+             "too",
+             (long long)head, (unsigned long long)again, (long long)start,
+             l[i].count);
+    __atomic_add_fetch(&data_blocks, l[i].count, __ATOMIC_RELAXED);
+  }
+  if (n->count > 0) {
+    w->end = n->end;
+    w->last_start = n->last_key;
+  }
+}
+
+// Checks the node `n` and what is below it, whose keys should fall within
+// [lo, hi).
+static void walk_node(Walk *w, const Node *n, uint64_t lo, uint64_t hi) {
+  BlockID head = w->head->id;
+  const char *what = type_name(w->head->type);
+  if (n->problem)
+    report("%s %lld: %s %lld %s", what, (long long)head, type_name(n->type),
+           (long long)n->id, problems[n->problem]);
+  // A directory index's first key bounds nothing (see summarize_dir()).
+  int unkeyed = w->head->type == _DIRECTORY && n->depth > 0;
+  if (n->count > unkeyed && (n->first_key < lo || n->last_key >= hi))
+    report("%s %lld: %s %lld has keys outside its parent's range", what,
+           (long long)head, type_name(n->type), (long long)n->id);
+  if (n->depth == 0) {
+    walk_leaf(w, n);
+    return;
+  }
+
+  int node_type = w->head->type == _DIRECTORY ? _DIR_NODE : _EXTENT_NODE;
+  const Link *l = &links[n->links_at];
+  for (int i = 0; i < n->count; i++) {
+    const Node *child = find(l[i].to);
+    if (!child || child->type != node_type) {
+      report("%s %lld: %lld points at block %lld, which is no %s", what,
+             (long long)head, (long long)n->id, (long long)l[i].to,
+             type_name(node_type));
+      continue;
+    }
+    if (mark(child->id, 1)) {
+      report("%s %lld: %s %lld is reached twice", what, (long long)head,
+             type_name(node_type), (long long)child->id);
+      continue;
+    }
+    if (child->depth + 1 != n->depth) {
+      report("%s %lld: %s %lld is at depth %u under depth %u", what,
+             (long long)head, type_name(node_type), (long long)child->id,
+             child->depth, n->depth);
+      continue;
+    }
+    uint64_t child_lo = i == 0 ? lo : l[i].key;
+    uint64_t child_hi = i + 1 < n->count ? l[i + 1].key : hi;
+    walk_node(w, child, child_lo, child_hi);
+  }
+}
+
+static void check_head(const Task *t) {
+  const Node *h = find(t->id);
+  if (!h || (h->type != _FILE && h->type != _DIRECTORY)) {
+    report("directory %lld names block %lld, which is no file or directory",
+           (long long)t->parent, (long long)t->id);
+    return;
+  }
+  // Removed nodes were marked as the orphan list was followed.
+  if (!t->removed && mark(h->id, 1)) {
+    report("%s %lld is named twice, or named and removed",
+           type_name(h->type), (long long)h->id);
+    return;
+  }
+  if (t->type && t->type != h->type)
+    report("directory %lld names %lld as a %s, but it is a %s",
+           (long long)t->parent, (long long)h->id, type_name(t->type),
+           type_name(h->type));
+  if (!t->removed && h->next_block != 0)
+    report("%s %lld links to %lld as if removed", type_name(h->type),
+           (long long)h->id, (long long)h->next_block);
+
+  Walk w = {.head = h, .removed = t->removed};
+  walk_node(&w, h, 0, UINT64_MAX);
+
+  if (h->type == _DIRECTORY) {
+    __atomic_add_fetch(t->removed ? &removed : &dirs, 1, __ATOMIC_RELAXED);
+    if (h->depth > 0 && w.last_leaf && w.last_leaf->next_block != 0)
+      report("directory %lld: last leaf %lld links on to %lld",
+             (long long)h->id, (long long)w.last_leaf->id,
+             (long long)w.last_leaf->next_block);
+    if (w.entries != (uint64_t)h->size)
+      report("directory %lld counts %lld entries but holds %llu",
+             (long long)h->id, (long long)h->size,
+             (unsigned long long)w.entries);
+    if (t->removed && w.entries > 0)
+      report("directory %lld was removed with entries in it",
+             (long long)h->id);
+  } else {
+    __atomic_add_fetch(t->removed ? &removed : &files, 1, __ATOMIC_RELAXED);
+    uint64_t blocks = h->size < 0 ? 0 : (h->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (h->size < 0)
+      report("file %lld has size %lld", (long long)h->id, (long long)h->size);
+    else if (w.end > 0 && w.last_start >= blocks)
+      report("file %lld maps block %llu past its size of %lld bytes",
+             (long long)h->id, (unsigned long long)w.last_start,
+             (long long)h->size);
+  }
+}
+
+static void *walk_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&task_lock);
+  for (;;) {
+    while (task_count == 0 && busy > 0)
+      pthread_cond_wait(&task_cond, &task_lock);
+    if (task_count == 0) break;
+    Task t = tasks[--task_count];
+    busy++;
+    pthread_mutex_unlock(&task_lock);
+    check_head(&t);
+    pthread_mutex_lock(&task_lock);
+    busy--;
+    if (task_count == 0 && busy == 0) pthread_cond_broadcast(&task_cond);
+  }
+  pthread_mutex_unlock(&task_lock);
+  return NULL;
+}
+
+// Queues the removed nodes, which keep their blocks until reclaimed, and
+// the root.
+static void queue_roots(void) {
+  BlockID id = sb.orphans;
+  for (uint64_t n = 0; id != 0; n++) {
+    const Node *h = find(id);
+    if (!h || (h->type != _FILE && h->type != _DIRECTORY)) {
+      report("orphan list: block %lld is no file or directory",
+             (long long)id);
+      break;
+    }
+    if (mark(id, 1)) {
+      report("orphan list: loops back to %lld", (long long)id);
+      break;
+    }
+    push_task(id, 0, 0, 1);
+    id = h->next_block;
+  }
+  push_task(sb.root, 0, _DIRECTORY, 0);
+}
+
+// Pass 3.
+
+typedef struct {
+  uint64_t from, to;  // Bitmap words
+  uint64_t leaked;
+  uint64_t unmarked;  // Reached but free
+} Compare;
+
+static void *compare_main(void *arg) {
+  Compare *c = arg;
+  for (uint64_t w = c->from; w < c->to; w++) {
+    uint64_t leaked = bitmap[w] & ~marks[w];
+    uint64_t unmarked = marks[w] & ~bitmap[w];
+    c->leaked += __builtin_popcountll(leaked);
+    c->unmarked += __builtin_popcountll(unmarked);
+    // A leaked head usually drags its whole tree along; name the head.
+    for (; leaked; leaked &= leaked - 1) {
+      BlockID id = w * WORD_BITS + __builtin_ctzll(leaked);
+      const Node *n = find(id);
+      if (n && (n->type == _FILE || n->type == _DIRECTORY))
+        note("%s %lld is in use but in no directory", type_name(n->type),
+             (long long)id);
+    }
+  }
+  return NULL;
+}
+
+static int run_threads(void *(*fn)(void *), void *args, size_t arg_size) {
+  pthread_t *ids = calloc(threads, sizeof(pthread_t));
+  if (!ids) return -ENOMEM;
+  unsigned started = 0;
+  for (; started < threads; started++) {
+    void *arg = args ? (Byte *)args + started * arg_size : NULL;
+    if (pthread_create(&ids[started], NULL, fn, arg) != 0) break;
+  }
+  // Whatever did start does all the work.
+  if (started == 0) fn(args);
+  for (unsigned i = 0; i < started; i++) pthread_join(ids[i], NULL);
+  free(ids);
+  return 0;
+}
+
+// Whether the log holds a transaction not yet written home.
+static int journal_dirty(void) {
+  if (sb.journal_blocks < 2) return 0;
+  BLOCK_BUFFER(block);
+  if (io_read(block, BLOCK_SIZE, (off_t)sb.journal_start * BLOCK_SIZE) != 0)
+    return 0;
+  JournalHeader header = *(const JournalHeader *)block;
+  if (header.magic != JOURNAL_MAGIC) return 0;
+  off_t at = (off_t)(sb.journal_start + 1) * BLOCK_SIZE;
+  if (io_read(block, BLOCK_SIZE, at) != 0) return 0;
+  const JournalRecord *rec = (const JournalRecord *)block;
+  return rec->magic == JOURNAL_MAGIC && rec->seq == header.seq &&
+         rec->type == JOURNAL_DESCRIPTOR;
+}
+
+static int check_layout(const char *image) {
+  struct stat st;
+  uint64_t bitmap_blocks =
+      (sb.block_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  const char *wrong = NULL;
+  if (sb.bitmap_start != SUPERBLOCK_ID + 1 ||
+      sb.bitmap_blocks != bitmap_blocks)
+    wrong = "bitmap";
+  else if (sb.journal_start != sb.bitmap_start + (BlockID)sb.bitmap_blocks)
+    wrong = "journal";
+  else if (sb.root != sb.journal_start + (BlockID)sb.journal_blocks ||
+           (uint64_t)sb.root >= sb.block_count)
+    wrong = "root";
+  else if (sb.orphans < 0 || (uint64_t)sb.orphans >= sb.block_count)
+    wrong = "orphan list";
+  else if (fstat(disk_fd, &st) != 0 ||
+           (uint64_t)st.st_size < sb.block_count * BLOCK_SIZE)
+    wrong = "image size";
+  if (wrong)
+    fprintf(stderr, "%s: superblock has a bad %s; cannot check further\n",
+            image, wrong);
+  return wrong ? -EINVAL : 0;
+}
+
+int main(int argc, char *argv[]) {
+  int repair = 0;
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  threads = online > 0 ? online : 1;
+  int opt;
+
+  // Getopt: -r replay the journal and rebuild the free map
+  //         -t <threads> threads per pass (default: one per CPU)
+  while ((opt = getopt(argc, argv, "rt:")) != -1) {
+    switch (opt) {
+      case 'r':
+        repair = 1;
+        break;
+      case 't':
+        threads = strtoul(optarg, NULL, 10);
+        if (threads == 0) threads = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-r] [-t threads] disk_image\n", argv[0]);
+        return FAILED;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-r] [-t threads] disk_image\n", argv[0]);
+    return FAILED;
+  }
+  const char *image = argv[optind];
+
+  disk_fd = open(image, repair ? O_RDWR : O_RDONLY);
+  if (disk_fd < 0) {
+    perror(image);
+    return FAILED;
+  }
+  if (load_superblock() != 0) {
+    fprintf(stderr, "%s: not a simplefs v%d image\n", image,
+                    SIMPLEFS_VERSION);
+    return FAILED;
+  }
+  if (check_layout(image) != 0) return UNCORRECTED;
+  if (io_init("pread") != 0) return FAILED;
+  if (repair) {
+    if (journal_init(0) != 0) {
+      fprintf(stderr, "%s: failed to recover journal\n", image);
+      return FAILED;
+    }
+    journal_destroy();
+    // Replay may have moved the orphan list.
+    if (load_superblock() != 0) return FAILED;
+  } else if (journal_dirty()) {
+    printf("%s: the journal holds transactions not yet replayed; the image "
+           "is checked as it is on disk (-r replays them)\n",
+           image);
+  }
+
+  bitmap_words = sb.bitmap_blocks * (BLOCK_SIZE / sizeof(uint64_t));
+  bitmap = malloc(bitmap_words * sizeof(uint64_t));
+  marks = calloc(bitmap_words, sizeof(uint64_t));
+  chunk_count = (sb.block_count * BLOCK_SIZE + FSCK_CHUNK - 1) / FSCK_CHUNK;
+  chunks = calloc(chunk_count, sizeof(Chunk));
+  if (!bitmap || !marks || !chunks) {
+    fprintf(stderr, "%s: out of memory\n", image);
+    return FAILED;
+  }
+  if (io_read(bitmap, bitmap_words * sizeof(uint64_t),
+              (off_t)sb.bitmap_start * BLOCK_SIZE) != 0) {
+    fprintf(stderr, "%s: cannot read the allocation bitmap\n", image);
+    return FAILED;
+  }
+  printf("%s: %u byte blocks, %llu blocks, %u threads\n", image,
+         sb.block_size, (unsigned long long)sb.block_count, threads);
+
+  double start = now();
+  run_threads(scan_main, NULL, 0);
+  double seconds = now() - start;
+  if (read_error != 0 || merge_chunks() != 0) {
+    fprintf(stderr, "%s: pass 1 failed: %s\n", image,
+            strerror(read_error ? -read_error : ENOMEM));
+    return FAILED;
+  }
+  printf("pass 1: read %.1f MiB in %.3f s, %.1f MB/s, %zu nodes\n",
+         bytes_read / 1048576.0, seconds, bytes_read / seconds / 1e6,
+         node_count);
+
+  // Everything below the root is always in use, and so are the bits past
+  // the end of the disk.
+  mark(0, sb.root);
+  mark(sb.block_count, bitmap_words * WORD_BITS - sb.block_count);
+  start = now();
+  queue_roots();
+  run_threads(walk_main, NULL, 0);
+  printf("pass 2: %llu directories, %llu files, %llu removed, %llu data "
+         "blocks in %.3f s\n",
+         (unsigned long long)dirs, (unsigned long long)files,
+         (unsigned long long)removed, (unsigned long long)data_blocks,
+         now() - start);
+
+  start = now();
+  Compare *slices = calloc(threads, sizeof(Compare));
+  if (!slices) return FAILED;
+  uint64_t per_thread = (bitmap_words + threads - 1) / threads;
+  for (unsigned i = 0; i < threads; i++) {
+    slices[i].from = i * per_thread < bitmap_words ? i * per_thread
+                                                   : bitmap_words;
+    slices[i].to = slices[i].from + per_thread < bitmap_words
+                       ? slices[i].from + per_thread
+                       : bitmap_words;
+  }
+  run_threads(compare_main, slices, sizeof(Compare));
+  uint64_t leaked = 0, unmarked = 0;
+  for (unsigned i = 0; i < threads; i++) {
+    leaked += slices[i].leaked;
+    unmarked += slices[i].unmarked;
+  }
+  free(slices);
+  printf("pass 3: %llu blocks leaked, %llu in use but free in %.3f s\n",
+         (unsigned long long)leaked, (unsigned long long)unmarked,
+         now() - start);
+  if (shown > MAX_REPORTS)
+    printf("(%llu more problems not shown)\n",
+           (unsigned long long)(shown - MAX_REPORTS));
+
+  int status = errors ? UNCORRECTED : CLEAN;
+  if (leaked || unmarked) {
+    if (!repair || errors) {
+      // Blocks the damage cut off would look free; leave them allocated.
+      if (repair) printf("free map left alone: the tree is damaged\n");
+      status = UNCORRECTED;
+    } else if (io_write(marks, bitmap_words * sizeof(uint64_t),
+                        (off_t)sb.bitmap_start * BLOCK_SIZE) != 0 ||
+               io_sync() != 0) {
+      fprintf(stderr, "%s: failed to write the free map\n", image);
+      status = FAILED;
+    } else {
+      printf("free map rebuilt\n");
+      if (status == CLEAN) status = CORRECTED;
+    }
+  }
+  printf("%s: %s\n", image,
+         status == CLEAN       ? "clean"
+         : status == CORRECTED ? "corrected"
+                               : "errors left");
+  io_destroy();
+  close(disk_fd);
+  return status;
+}
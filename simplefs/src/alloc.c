@@ -0,0 +1,454 @@
+#include "alloc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "def.h"
+#include "io.h"
+#include "journal.h"
+
+// In-memory copy of the on-disk allocation bitmap. Every change is written
+// through to the bitmap block that holds it, via the journal if there is
+// one, so the image never has a block in use that the bitmap calls free.
+// `lock` guards all of it.
+static uint64_t *bitmap = NULL;
+static uint64_t bitmap_words = 0;
+static uint64_t free_count = 0;
+static BlockID next_fit = 0;  // Where the next search without a goal starts.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Blocks set aside by alloc_reserve(), in total and by this thread. Only
+// the reserving thread may allocate them.
+static uint64_t reserved = 0;
+static __thread uint64_t reserved_here = 0;
+
+// Blocks promised by alloc_claim() to buffered file data that has no
+// blocks yet; only alloc_run_claimed() allocates them.
+static uint64_t claimed = 0;
+
+// Metadata blocks freed while the journal may still hold images of them,
+// one bit each, and which transaction freed them. A checkpoint or a replay
+// would write such an image home over whatever the block held by then, so
+// they are free on disk but not handed out again until
+// alloc_release_held() says their transactions are home.
+typedef struct {
+  BlockID id;
+  uint64_t seq;
+} HeldBlock;
+
+static uint64_t *held = NULL;
+static HeldBlock *held_blocks = NULL;
+static uint64_t held_count = 0;
+static uint64_t held_capacity = 0;
+
+// Blocks unlinked from the tree by a transaction that has not committed
+// yet: file data, and metadata with no image in the log. A crash before
+// the commit links them again, so until alloc_release_freed() says the
+// transaction is durable the blocks must keep their contents: free on
+// disk, but held like the blocks above.
+typedef struct {
+  BlockID start;
+  uint32_t count;
+  uint64_t seq;
+} HeldRun;
+
+static HeldRun *held_runs = NULL;
+static uint64_t held_run_count = 0;
+static uint64_t held_run_capacity = 0;
+
+#define WORD_BITS 64
+#define WORDS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+
+static int test_bit(BlockID id) {
+  return (bitmap[id / WORD_BITS] >> (id % WORD_BITS)) & 1;
+}
+
+// Used, or held: either way not to be allocated.
+static uint64_t taken_word(uint64_t w) {
+  return held ? bitmap[w] | held[w] : bitmap[w];
+}
+
+static int taken(BlockID id) {
+  return (taken_word(id / WORD_BITS) >> (id % WORD_BITS)) & 1;
+}
+
+static void flush_range(BlockID first, BlockID last) {
+  uint64_t from = first / BITS_PER_BLOCK;
+  uint64_t to = last / BITS_PER_BLOCK;
+  for (uint64_t i = from; i <= to; i++) {
+    const uint64_t *words = bitmap + i * WORDS_PER_BLOCK;
+    if (journal_write(sb.bitmap_start + i, words) != 0)
+      io_write(words, BLOCK_SIZE, (off_t)(sb.bitmap_start + i) * BLOCK_SIZE);
+  }
+}
+
+static void set_range(BlockID start, uint32_t count, int used) {
+  for (uint32_t i = 0; i < count; i++) {
+    BlockID id = start + i;
+    uint64_t mask = 1ULL << (id % WORD_BITS);
+    if (used)
+      bitmap[id / WORD_BITS] |= mask;
+    else
+      bitmap[id / WORD_BITS] &= ~mask;
+  }
+  if (used)
+    free_count -= count;
+  else
+    free_count += count;
+  flush_range(start, start + count - 1);
+}
+
+// First clear bit in [from, block_count), or -1.
+static BlockID scan_free(BlockID from) {
+  uint64_t w = from / WORD_BITS;
+  if (w >= bitmap_words) return -1;
+  uint64_t word = ~taken_word(w) & (~0ULL << (from % WORD_BITS));
+  while (!word) {
+    if (++w >= bitmap_words) return -1;
+    word = ~taken_word(w);
+  }
+  BlockID id = w * WORD_BITS + __builtin_ctzll(word);
+  return (uint64_t)id < sb.block_count ? id : -1;
+}
+
+int alloc_init(void) {
+  bitmap_words =
+      sb.bitmap_blocks * WORDS_PER_BLOCK;  // whole blocks, tail bits unused
+  void *p;
+  if (posix_memalign(&p, BLOCK_SIZE, bitmap_words * sizeof(uint64_t)) != 0)
+    return -ENOMEM;
+  bitmap = p;
+
+  size_t bytes = (size_t)sb.bitmap_blocks * BLOCK_SIZE;
+  if (io_read(bitmap, bytes, (off_t)sb.bitmap_start * BLOCK_SIZE) != 0) {
+    free(bitmap);
+    bitmap = NULL;
+    return -EIO;
+  }
+
+  free_count = 0;
+  for (uint64_t w = 0; w < bitmap_words; w++) {
+    free_count += WORD_BITS - __builtin_popcountll(bitmap[w]);
+  }
+  next_fit = sb.root + 1;
+
+  // Without a journal nothing writes a freed block back behind our back.
+  if (journal_enabled()) {
+    held = calloc(bitmap_words, sizeof(uint64_t));
+    if (!held) {
+      free(bitmap);
+      bitmap = NULL;
+      return -ENOMEM;
+    }
+  }
+  return 0;
+}
+
+void alloc_destroy(void) {
+  free(bitmap);
+  bitmap = NULL;
+  free(held);
+  held = NULL;
+  free(held_blocks);
+  held_blocks = NULL;
+  held_count = held_capacity = 0;
+  free(held_runs);
+  held_runs = NULL;
+  held_run_count = held_run_capacity = 0;
+}
+
+// Allocates one block at or after `goal` (next-fit when goal <= 0), wrapping
+// around once. Returns -1 when the disk is full.
+BlockID alloc_block(BlockID goal) {
+  uint32_t got;
+  return alloc_run(goal, 1, &got);
+}
+
+// Takes up to `want` contiguous blocks out of `avail`. Caller holds `lock`.
+static BlockID take_run(BlockID goal, uint32_t want, uint64_t avail,
+                        uint32_t *got) {
+  *got = 0;
+  if (avail < want) want = avail;
+  if (want == 0) return -1;
+  if (goal <= 0 || (uint64_t)goal >= sb.block_count) goal = next_fit;
+
+  BlockID start = scan_free(goal);
+  if (start == -1) start = scan_free(0);
+  if (start == -1) return -1;
+
+  uint32_t len = 1;
+  while (len < want && (uint64_t)(start + len) < sb.block_count &&
+         !taken(start + len)) {
+    len++;
+  }
+
+  set_range(start, len, 1);
+  next_fit = start + len;
+  *got = len;
+  return start;
+}
+
+// Allocates up to `want` contiguous blocks starting at the first free block
+// at or after `goal`. The run ends at the first used block, so *got may be
+// less than `want`; callers loop for the remainder.
+BlockID alloc_run(BlockID goal, uint32_t want, uint32_t *got) {
+  *got = 0;
+  if (want == 0) return -1;
+
+  pthread_mutex_lock(&lock);
+  uint64_t avail = free_count - (reserved - reserved_here) - claimed;
+  BlockID start = take_run(goal, want, avail, got);
+  uint64_t used = *got < reserved_here ? *got : reserved_here;
+  reserved_here -= used;
+  reserved -= used;
+  pthread_mutex_unlock(&lock);
+  return start;
+}
+
+// alloc_run() for data that was claimed with alloc_claim(); the blocks
+// allocated come out of the claim.
+BlockID alloc_run_claimed(BlockID goal, uint32_t want, uint32_t *got) {
+  pthread_mutex_lock(&lock);
+  if (want > claimed) want = claimed;
+  uint64_t avail = free_count - reserved;
+  BlockID start = take_run(goal, want, avail, got);
+  claimed -= *got;
+  pthread_mutex_unlock(&lock);
+  return start;
+}
+
+// First run of `count` free blocks that starts in [from, limit), or -1.
+static BlockID find_run(BlockID from, BlockID limit, uint32_t count) {
+  for (;;) {
+    BlockID start = scan_free(from);
+    if (start == -1 || start >= limit) return -1;
+    uint32_t len = 1;
+    while (len < count && (uint64_t)(start + len) < sb.block_count &&
+           !taken(start + len)) {
+      len++;
+    }
+    if (len == count) return start;
+    from = start + len;
+  }
+}
+
+// Takes `count` contiguous blocks out of `avail`, from the first free run
+// long enough at or after `goal`, wrapping around once. Caller holds
+// `lock`.
+static BlockID take_exact(BlockID goal, uint32_t count, uint64_t avail) {
+  if (count == 0 || avail < count) return -1;
+  if (goal <= 0 || (uint64_t)goal >= sb.block_count) goal = next_fit;
+
+  BlockID start = find_run(goal, sb.block_count, count);
+  if (start == -1) start = find_run(0, goal, count);
+  if (start == -1) return -1;
+  set_range(start, count, 1);
+  return start;
+}
+
+// Allocates exactly `count` contiguous blocks, for data that has to be in
+// one piece. Returns -1 if no free run is that long.
+BlockID alloc_exact(BlockID goal, uint32_t count) {
+  pthread_mutex_lock(&lock);
+  uint64_t avail = free_count - (reserved - reserved_here) - claimed;
+  BlockID start = take_exact(goal, count, avail);
+  if (start != -1) {
+    uint64_t used = count < reserved_here ? count : reserved_here;
+    reserved_here -= used;
+    reserved -= used;
+  }
+  pthread_mutex_unlock(&lock);
+  return start;
+}
+
+// alloc_exact() out of blocks claimed with alloc_claim().
+BlockID alloc_exact_claimed(BlockID goal, uint32_t count) {
+  pthread_mutex_lock(&lock);
+  BlockID start = -1;
+  if (count <= claimed) {
+    start = take_exact(goal, count, free_count - reserved);
+    if (start != -1) claimed -= count;
+  }
+  pthread_mutex_unlock(&lock);
+  return start;
+}
+
+void free_block(BlockID id) { free_run(id, 1); }
+
+void free_run(BlockID start, uint32_t count) {
+  if (start <= sb.root || (uint64_t)start + count > sb.block_count) return;
+  pthread_mutex_lock(&lock);
+  set_range(start, count, 0);
+  pthread_mutex_unlock(&lock);
+}
+
+// Frees a block that held metadata, which goes through the journal: it is
+// free on disk at once but held back from reuse until the transaction
+// freeing it is home, or, if the log has no image of it, committed.
+void free_metadata(BlockID id) {
+  if (id <= sb.root || (uint64_t)id >= sb.block_count) return;
+  // With no image in the log, there is nothing to write back, but the last
+  // committed tree may still point at it. Any transaction with one is this
+  // one or older.
+  if (!held || !journal_has(id)) {
+    free_data(id, 1);
+    return;
+  }
+  uint64_t seq = journal_running_seq();
+  pthread_mutex_lock(&lock);
+  if (held_count == held_capacity) {
+    uint64_t capacity = held_capacity ? held_capacity * 2 : 64;
+    HeldBlock *blocks = realloc(held_blocks, capacity * sizeof(HeldBlock));
+    if (blocks) {
+      held_blocks = blocks;
+      held_capacity = capacity;
+    }
+  }
+  // Out of memory it stays in use, which leaks it rather than risk it.
+  if (held_count == held_capacity) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  set_range(id, 1, 0);
+  held[id / WORD_BITS] |= 1ULL << (id % WORD_BITS);
+  held_blocks[held_count++] = (HeldBlock){id, seq};
+  free_count--;
+  pthread_mutex_unlock(&lock);
+}
+
+// Frees a run that the running operation has just unlinked: file data, or
+// a metadata block from free_metadata(). It is free on disk at once but
+// held back from reuse until the transaction is committed.
+void free_data(BlockID start, uint32_t count) {
+  if (start <= sb.root || (uint64_t)start + count > sb.block_count) return;
+  if (!held) {
+    free_run(start, count);
+    return;
+  }
+  uint64_t seq = journal_running_seq();
+  pthread_mutex_lock(&lock);
+  if (held_run_count == held_run_capacity) {
+    uint64_t capacity = held_run_capacity ? held_run_capacity * 2 : 64;
+    HeldRun *runs = realloc(held_runs, capacity * sizeof(HeldRun));
+    if (runs) {
+      held_runs = runs;
+      held_run_capacity = capacity;
+    }
+  }
+  // Out of memory the run stays in use, as in free_metadata().
+  if (held_run_count == held_run_capacity) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  set_range(start, count, 0);
+  for (uint32_t i = 0; i < count; i++) {
+    BlockID id = start + i;
+    held[id / WORD_BITS] |= 1ULL << (id % WORD_BITS);
+  }
+  held_runs[held_run_count++] = (HeldRun){start, count, seq};
+  free_count -= count;
+  pthread_mutex_unlock(&lock);
+}
+
+// Lets the runs that transactions before `seq` unlinked be allocated
+// again. The journal calls this once those transactions are committed.
+void alloc_release_freed(uint64_t seq) {
+  pthread_mutex_lock(&lock);
+  uint64_t kept = 0;
+  for (uint64_t i = 0; i < held_run_count; i++) {
+    HeldRun r = held_runs[i];
+    if (r.seq >= seq) {
+      held_runs[kept++] = r;
+      continue;
+    }
+    for (uint32_t j = 0; j < r.count; j++) {
+      BlockID id = r.start + j;
+      held[id / WORD_BITS] &= ~(1ULL << (id % WORD_BITS));
+    }
+    free_count += r.count;
+  }
+  held_run_count = kept;
+  pthread_mutex_unlock(&lock);
+}
+
+// Lets the blocks that transactions before `seq` freed be allocated again.
+// The journal calls this once those transactions are home and out of the
+// log.
+void alloc_release_held(uint64_t seq) {
+  pthread_mutex_lock(&lock);
+  uint64_t kept = 0;
+  for (uint64_t i = 0; i < held_count; i++) {
+    HeldBlock b = held_blocks[i];
+    if (b.seq >= seq) {
+      held_blocks[kept++] = b;
+      continue;
+    }
+    held[b.id / WORD_BITS] &= ~(1ULL << (b.id % WORD_BITS));
+    free_count++;
+  }
+  held_count = kept;
+  pthread_mutex_unlock(&lock);
+}
+
+// Sets `count` free blocks aside for the calling thread, so a multi-block
+// update such as a tree split cannot run out halfway through when other
+// threads allocate concurrently. Returns -ENOSPC if there are not enough.
+int alloc_reserve(uint64_t count) {
+  pthread_mutex_lock(&lock);
+  int ret = 0;
+  if (free_count - reserved - claimed < count) {
+    ret = -ENOSPC;
+  } else {
+    reserved += count;
+    reserved_here += count;
+  }
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+// Promises `count` blocks to file data that is buffered now and allocated
+// later, so that the later allocation cannot fail for lack of space.
+int alloc_claim(uint64_t count) {
+  pthread_mutex_lock(&lock);
+  int ret = 0;
+  if (free_count - reserved - claimed < count)
+    ret = -ENOSPC;
+  else
+    claimed += count;
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+void alloc_unclaim(uint64_t count) {
+  pthread_mutex_lock(&lock);
+  claimed -= count < claimed ? count : claimed;
+  pthread_mutex_unlock(&lock);
+}
+
+// Returns whatever is left of the calling thread's reservation.
+void alloc_unreserve(void) {
+  pthread_mutex_lock(&lock);
+  reserved -= reserved_here;
+  reserved_here = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+int block_in_use(BlockID id) {
+  pthread_mutex_lock(&lock);
+  int used = test_bit(id);
+  pthread_mutex_unlock(&lock);
+  return used;
+}
+
+uint64_t free_block_count(void) {
+  pthread_mutex_lock(&lock);
+  uint64_t count = free_count - reserved - claimed;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
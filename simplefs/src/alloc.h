@@ -0,0 +1,28 @@
+#ifndef SIMPLEFS_ALLOC_H
+#define SIMPLEFS_ALLOC_H
+
+#include <stdint.h>
+
+#include "def.h"
+
+int alloc_init(void);
+void alloc_destroy(void);
+BlockID alloc_block(BlockID goal);
+BlockID alloc_run(BlockID goal, uint32_t want, uint32_t *got);
+BlockID alloc_run_claimed(BlockID goal, uint32_t want, uint32_t *got);
+BlockID alloc_exact(BlockID goal, uint32_t count);
+BlockID alloc_exact_claimed(BlockID goal, uint32_t count);
+void free_block(BlockID id);
+void free_run(BlockID start, uint32_t count);
+void free_metadata(BlockID id);
+void alloc_release_held(uint64_t seq);
+void free_data(BlockID start, uint32_t count);
+void alloc_release_freed(uint64_t seq);
+int alloc_reserve(uint64_t count);
+void alloc_unreserve(void);
+int alloc_claim(uint64_t count);
+void alloc_unclaim(uint64_t count);
+int block_in_use(BlockID id);
+uint64_t free_block_count(void);
+
+#endif  // SIMPLEFS_ALLOC_H
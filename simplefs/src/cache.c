@@ -0,0 +1,351 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "def.h"
+#include "io.h"
+
+// Write-back block cache with CLOCK eviction. The cache is split into
+// shards, each with its own entries, hash chains, clock hand and mutex, so
+// threads working on different blocks rarely contend. A shard covers
+// SHARD_RUN adjacent blocks at a time, which keeps short runs in one shard.
+typedef struct {
+  BlockID id;    // -1 when the slot is empty
+  int32_t next;  // Next entry in the same hash bucket, or -1
+  uint8_t dirty;
+  uint8_t referenced;
+  Block *data;  // BLOCK_SIZE bytes in `arena`
+} CacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  CacheEntry *entries;
+  int32_t *buckets;
+  uint32_t capacity;
+  uint32_t bucket_mask;
+  uint32_t clock_hand;
+  CacheStats stats;
+} CacheShard;
+
+static CacheShard *shards = NULL;
+static uint32_t nshards = 0;
+static Byte *arena = NULL;
+static uint32_t capacity = 0;
+
+static pthread_t writeback_thread;
+static int writeback_running = 0;
+static unsigned writeback_interval = 0;
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+
+#define MAX_SHARDS 16
+#define MIN_SHARD_ENTRIES 32  // Smaller shards make CLOCK thrash
+#define SHARD_RUN 8
+
+static CacheShard *shard_of(BlockID id) {
+  return &shards[(uint64_t)id / SHARD_RUN % nshards];
+}
+
+static uint32_t hash(const CacheShard *shard, BlockID id) {
+  return ((uint64_t)id * 0x9e3779b97f4a7c15ULL) >> 32 & shard->bucket_mask;
+}
+
+static void disk_read(BlockID id, Block *block) {
+  if (io_read(block, BLOCK_SIZE, (off_t)id * BLOCK_SIZE) != 0)
+    memset(block, 0, BLOCK_SIZE);
+}
+
+static CacheEntry *lookup(CacheShard *shard, BlockID id) {
+  CacheEntry *entries = shard->entries;
+  for (int32_t i = shard->buckets[hash(shard, id)]; i != -1;
+       i = entries[i].next) {
+    if (entries[i].id == id) return &entries[i];
+  }
+  return NULL;
+}
+
+static void unlink_entry(CacheShard *shard, CacheEntry *e) {
+  int32_t *link = &shard->buckets[hash(shard, e->id)];
+  while (*link != e - shard->entries) link = &shard->entries[*link].next;
+  *link = e->next;
+}
+
+static void writeback(CacheShard *shard, CacheEntry *e) {
+  io_write(e->data, BLOCK_SIZE, (off_t)e->id * BLOCK_SIZE);
+  e->dirty = 0;
+  shard->stats.dirty--;
+  shard->stats.writebacks++;
+}
+
+// Sweeps the clock hand until it finds an entry that was not referenced
+// since the last pass, writing it back if dirty.
+static CacheEntry *evict(CacheShard *shard) {
+  for (;;) {
+    CacheEntry *e = &shard->entries[shard->clock_hand];
+    shard->clock_hand = (shard->clock_hand + 1) % shard->capacity;
+    if (e->id == -1) return e;
+    if (e->referenced) {
+      e->referenced = 0;
+      continue;
+    }
+    if (e->dirty) writeback(shard, e);
+    unlink_entry(shard, e);
+    e->id = -1;
+    shard->stats.evictions++;
+    return e;
+  }
+}
+
+static CacheEntry *insert(CacheShard *shard, BlockID id) {
+  CacheEntry *e = evict(shard);
+  uint32_t h = hash(shard, id);
+  e->id = id;
+  e->next = shard->buckets[h];
+  e->dirty = 0;
+  e->referenced = 1;
+  shard->buckets[h] = e - shard->entries;
+  return e;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  BlockID x = (*(CacheEntry *const *)a)->id;
+  BlockID y = (*(CacheEntry *const *)b)->id;
+  return (x > y) - (x < y);
+}
+
+// Writes every dirty entry in block order as one batch, in which runs of
+// adjacent blocks merge. Runs span shards, so all shard locks are held
+// throughout; they are always taken in index order.
+static int flush_all(void) {
+  uint32_t ndirty = 0;
+  for (uint32_t s = 0; s < nshards; s++) {
+    pthread_mutex_lock(&shards[s].lock);
+    ndirty += shards[s].stats.dirty;
+  }
+
+  int ret = 0;
+  CacheEntry **dirty = ndirty ? malloc(ndirty * sizeof(CacheEntry *)) : NULL;
+  if (ndirty && !dirty) ret = -ENOMEM;
+
+  uint32_t n = 0;
+  for (uint32_t s = 0; dirty && s < nshards; s++) {
+    CacheShard *shard = &shards[s];
+    for (uint32_t i = 0; i < shard->capacity; i++) {
+      CacheEntry *e = &shard->entries[i];
+      if (e->id != -1 && e->dirty) dirty[n++] = e;
+    }
+  }
+  if (n) qsort(dirty, n, sizeof(CacheEntry *), compare_entries);
+
+  IoBatch batch = {.nreqs = 0, .niov = 0, .err = 0};
+  for (uint32_t i = 0; i < n; i++) {
+    CacheShard *shard = shard_of(dirty[i]->id);
+    io_batch_write(&batch, dirty[i]->data, BLOCK_SIZE,
+                   (off_t)dirty[i]->id * BLOCK_SIZE);
+    dirty[i]->dirty = 0;
+    shard->stats.dirty--;
+    shard->stats.writebacks++;
+  }
+  if (io_batch_submit(&batch) != 0 && ret == 0) ret = -EIO;
+  free(dirty);
+
+  for (uint32_t s = nshards; s-- > 0;) pthread_mutex_unlock(&shards[s].lock);
+  return ret;
+}
+
+static void *writeback_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&writeback_lock);
+  while (writeback_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += writeback_interval;
+    pthread_cond_timedwait(&writeback_cond, &writeback_lock, &deadline);
+    flush_all();
+  }
+  pthread_mutex_unlock(&writeback_lock);
+  return NULL;
+}
+
+static void free_shards(void) {
+  for (uint32_t s = 0; shards && s < nshards; s++) {
+    pthread_mutex_destroy(&shards[s].lock);
+    free(shards[s].entries);
+    free(shards[s].buckets);
+  }
+  free(shards);
+  free(arena);
+  shards = NULL;
+  arena = NULL;
+  nshards = 0;
+  capacity = 0;
+}
+
+// A capacity of 0 disables caching: reads and writes go straight to disk.
+// A non-zero writeback_sec starts a thread that flushes dirty blocks on
+// that interval.
+int cache_init(uint32_t cap, unsigned writeback_sec) {
+  capacity = cap;
+  if (capacity == 0) return 0;
+
+  nshards = 1;
+  while (nshards < MAX_SHARDS && nshards * 2 * MIN_SHARD_ENTRIES <= capacity)
+    nshards <<= 1;
+  shards = calloc(nshards, sizeof(CacheShard));
+  // Aligned, so that O_DIRECT writeback needs no staging.
+  void *p = NULL;
+  if (posix_memalign(&p, BLOCK_SIZE, (size_t)capacity * BLOCK_SIZE) == 0)
+    arena = p;
+  if (!shards || !arena) {
+    free_shards();
+    return -ENOMEM;
+  }
+
+  Byte *data = arena;
+  for (uint32_t s = 0; s < nshards; s++) {
+    CacheShard *shard = &shards[s];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->capacity = capacity / nshards + (s < capacity % nshards);
+    shard->stats.capacity = shard->capacity;
+
+    uint32_t nbuckets = 1;
+    while (nbuckets < shard->capacity * 2) nbuckets <<= 1;
+    shard->bucket_mask = nbuckets - 1;
+    shard->entries = calloc(shard->capacity, sizeof(CacheEntry));
+    shard->buckets = malloc(nbuckets * sizeof(int32_t));
+    if (!shard->entries || !shard->buckets) {
+      nshards = s + 1;
+      free_shards();
+      return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < shard->capacity; i++) {
+      shard->entries[i].id = -1;
+      shard->entries[i].data = (Block *)data;
+      data += BLOCK_SIZE;
+    }
+    memset(shard->buckets, 0xff, nbuckets * sizeof(int32_t));
+  }
+
+  if (writeback_sec > 0) {
+    writeback_interval = writeback_sec;
+    writeback_running = 1;
+    if (pthread_create(&writeback_thread, NULL, writeback_main, NULL) != 0)
+      writeback_running = 0;
+  }
+  return 0;
+}
+
+void cache_destroy(void) {
+  if (writeback_running) {
+    pthread_mutex_lock(&writeback_lock);
+    writeback_running = 0;
+    pthread_cond_signal(&writeback_cond);
+    pthread_mutex_unlock(&writeback_lock);
+    pthread_join(writeback_thread, NULL);
+  }
+  cache_flush();
+  free_shards();
+}
+
+void cache_read(BlockID id, Block *block) {
+  if (capacity == 0) {
+    disk_read(id, block);
+    return;
+  }
+
+  CacheShard *shard = shard_of(id);
+  pthread_mutex_lock(&shard->lock);
+  CacheEntry *e = lookup(shard, id);
+  if (e) {
+    shard->stats.hits++;
+    e->referenced = 1;
+  } else {
+    shard->stats.misses++;
+    e = insert(shard, id);
+    disk_read(id, e->data);
+  }
+  memcpy(block, e->data, BLOCK_SIZE);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_write(BlockID id, const Block *block) {
+  if (capacity == 0) {
+    io_write(block, BLOCK_SIZE, (off_t)id * BLOCK_SIZE);
+    return;
+  }
+
+  CacheShard *shard = shard_of(id);
+  pthread_mutex_lock(&shard->lock);
+  CacheEntry *e = lookup(shard, id);
+  if (e)
+    e->referenced = 1;
+  else
+    e = insert(shard, id);
+  memcpy(e->data, block, BLOCK_SIZE);
+  if (!e->dirty) {
+    e->dirty = 1;
+    shard->stats.dirty++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Caches `block` as the current contents of `id` without marking it dirty,
+// for blocks that someone else writes home.
+void cache_fill(BlockID id, const Block *block) {
+  if (capacity == 0) return;
+
+  CacheShard *shard = shard_of(id);
+  pthread_mutex_lock(&shard->lock);
+  CacheEntry *e = lookup(shard, id);
+  if (e)
+    e->referenced = 1;
+  else
+    e = insert(shard, id);
+  memcpy(e->data, block, BLOCK_SIZE);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Drops any cached copy of [start, start + count) without writing it back,
+// for blocks that are about to be overwritten on disk directly.
+void cache_invalidate(BlockID start, uint32_t count) {
+  if (capacity == 0) return;
+
+  for (uint32_t i = 0; i < count; i++) {
+    CacheShard *shard = shard_of(start + i);
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *e = lookup(shard, start + i);
+    if (e) {
+      if (e->dirty) shard->stats.dirty--;
+      unlink_entry(shard, e);
+      e->id = -1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+int cache_flush(void) {
+  if (capacity == 0) return 0;
+  return flush_all();
+}
+
+void cache_get_stats(CacheStats *out) {
+  memset(out, 0, sizeof(CacheStats));
+  for (uint32_t s = 0; s < nshards; s++) {
+    CacheShard *shard = &shards[s];
+    pthread_mutex_lock(&shard->lock);
+    out->hits += shard->stats.hits;
+    out->misses += shard->stats.misses;
+    out->evictions += shard->stats.evictions;
+    out->writebacks += shard->stats.writebacks;
+    out->capacity += shard->stats.capacity;
+    out->dirty += shard->stats.dirty;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef SIMPLEFS_CACHE_H
+#define SIMPLEFS_CACHE_H
+
+#include <stdint.h>
+
+#include "def.h"
+
+#define CACHE_DEFAULT_BLOCKS 256
+#define CACHE_DEFAULT_WRITEBACK_SEC 5
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;  // Blocks written to disk, on eviction or flush.
+  uint32_t capacity;
+  uint32_t dirty;
+} CacheStats;
+
+int cache_init(uint32_t capacity, unsigned writeback_sec);
+void cache_destroy(void);
+void cache_read(BlockID id, Block *block);
+void cache_write(BlockID id, const Block *block);
+void cache_fill(BlockID id, const Block *block);
+void cache_invalidate(BlockID start, uint32_t count);
+int cache_flush(void);
+void cache_get_stats(CacheStats *stats);
+
+#endif  // SIMPLEFS_CACHE_H
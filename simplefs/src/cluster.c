@@ -0,0 +1,175 @@
+#include "cluster.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "def.h"
+#include "extent.h"
+#include "io.h"
+#include "lz4.h"
+#include "stats.h"
+
+// Compressed clusters. With compression on, delayed allocation stores each
+// aligned CLUSTER_SIZE of a file whose blocks are all buffered as an extent
+// of its own, compressed, if that saves at least a block. The extent tree
+// is then the cluster index: a read finds the clusters it touches and
+// decompresses only those. Compressed blocks are never written in place; a
+// write into a cluster stores the whole cluster anew and frees the old
+// blocks, so a crash leaves either version whole.
+//
+// Each thread keeps the last cluster it decompressed. Clusters do not
+// change once stored, so the copy is good until the blocks it came from
+// are freed and perhaps reused, which bumps `generation`.
+
+typedef struct {
+  BlockID start;  // Of the cluster in `raw`, -1 if none
+  uint64_t generation;
+  Byte *raw;     // CLUSTER_SIZE bytes, decompressed
+  Byte *packed;  // CLUSTER_SIZE bytes, as stored
+} Scratch;
+
+static int compress = 0;
+static uint64_t generation = 0;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+void cluster_set_compress(int on) { compress = on; }
+
+// Whether new data is compressed. A single-block cluster cannot shrink.
+int cluster_compressing(void) { return compress && CLUSTER_BLOCKS > 1; }
+
+static void free_scratch(void *p) {
+  Scratch *s = p;
+  free(s->raw);
+  free(s);
+}
+
+static void make_key(void) { pthread_key_create(&scratch_key, free_scratch); }
+
+static Scratch *scratch(void) {
+  pthread_once(&scratch_once, make_key);
+  Scratch *s = pthread_getspecific(scratch_key);
+  if (s) return s;
+  s = malloc(sizeof(Scratch));
+  void *p;
+  // Block aligned, so O_DIRECT transfers need no staging.
+  if (!s || posix_memalign(&p, BLOCK_SIZE, 2 * CLUSTER_SIZE) != 0) {
+    free(s);
+    return NULL;
+  }
+  *s = (Scratch){-1, 0, p, (Byte *)p + CLUSTER_SIZE};
+  pthread_setspecific(scratch_key, s);
+  return s;
+}
+
+// Compresses the CLUSTER_SIZE bytes at `raw` into `packed`, which holds as
+// many, as they would be stored. Returns the blocks that takes, or 0 if
+// that would not save a block.
+uint32_t cluster_pack(const Byte *raw, Byte *packed) {
+  uint64_t start = stats_now();
+  size_t room = CLUSTER_SIZE - BLOCK_SIZE - sizeof(ClusterHeader);
+  size_t size =
+      lz4_compress(raw, CLUSTER_SIZE, packed + sizeof(ClusterHeader), room);
+  stats_record(STAT_COMPRESS, start, CLUSTER_SIZE);
+
+  uint32_t stored = 0;
+  if (size > 0) {
+    ClusterHeader header = {size, 0};
+    memcpy(packed, &header, sizeof(header));
+    size += sizeof(header);
+    stored = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset(packed + size, 0, (size_t)stored * BLOCK_SIZE - size);
+  }
+  stats_compressed(CLUSTER_SIZE,
+                   (uint64_t)(stored ? stored : CLUSTER_BLOCKS) * BLOCK_SIZE);
+  return stored;
+}
+
+// The decompressed contents of the cluster `ext`, in this thread's scratch
+// space, or NULL if they cannot be read.
+static Byte *unpack(const Extent *ext) {
+  Scratch *s = scratch();
+  if (!s) return NULL;
+  uint64_t now = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+  if (s->start == ext->start && s->generation == now) return s->raw;
+
+  s->start = -1;
+  size_t stored = (size_t)ext->stored * BLOCK_SIZE;
+  if (ext->length != CLUSTER_BLOCKS || stored >= CLUSTER_SIZE) return NULL;
+  if (io_read(s->packed, stored, (off_t)ext->start * BLOCK_SIZE) != 0)
+    return NULL;
+
+  ClusterHeader header;
+  memcpy(&header, s->packed, sizeof(header));
+  if (header.size > stored - sizeof(header)) return NULL;
+  uint64_t start = stats_now();
+  ssize_t size = lz4_decompress(s->packed + sizeof(header), header.size,
+                                s->raw, CLUSTER_SIZE);
+  stats_record(STAT_DECOMPRESS, start, size);
+  if (size != CLUSTER_SIZE) return NULL;
+
+  s->start = ext->start;
+  s->generation = now;
+  return s->raw;
+}
+
+// Copies up to `size` bytes from `offset` bytes into file block `logical`
+// of the compressed cluster `ext` to `buf`. Returns the bytes copied, at
+// most to the end of the cluster, or -EIO.
+ssize_t cluster_read(const Extent *ext, uint32_t logical, uint32_t offset,
+                     char *buf, size_t size) {
+  const Byte *raw = unpack(ext);
+  if (!raw) return -EIO;
+  size_t pos = (size_t)(logical - ext->logical) * BLOCK_SIZE + offset;
+  if (size > CLUSTER_SIZE - pos) size = CLUSTER_SIZE - pos;
+  memcpy(buf, raw + pos, size);
+  return size;
+}
+
+// Writes up to `size` bytes from `buf` at `offset` bytes into file block
+// `logical` of the compressed cluster `ext`, by storing the changed cluster
+// in new blocks, compressed if it still saves space, and remapping `ext`
+// there. Returns the bytes written, at most to the end of the cluster, or
+// -errno. The caller writes the head block back.
+ssize_t cluster_write(Block *head, const Extent *ext, uint32_t logical,
+                      uint32_t offset, const char *buf, size_t size) {
+  Byte *raw = unpack(ext);
+  if (!raw) return -EIO;
+  Scratch *s = scratch();
+  // The copy stops matching the stored cluster here.
+  s->start = -1;
+
+  size_t pos = (size_t)(logical - ext->logical) * BLOCK_SIZE + offset;
+  if (size > CLUSTER_SIZE - pos) size = CLUSTER_SIZE - pos;
+  memcpy(raw + pos, buf, size);
+
+  uint32_t stored = cluster_pack(raw, s->packed);
+  uint32_t want = stored ? stored : CLUSTER_BLOCKS;
+  BlockID start = alloc_exact(ext->start, want);
+  if (start == -1) return -ENOSPC;
+
+  Extent moved = {ext->logical, ext->length, start, stored};
+  cache_invalidate(start, want);
+  int err = io_write(stored ? s->packed : raw, (size_t)want * BLOCK_SIZE,
+                     (off_t)start * BLOCK_SIZE);
+  if (err == 0) err = extent_remap(head, &moved);
+  if (err != 0) {
+    free_run(start, want);
+    return err;
+  }
+  cluster_free(ext);
+  return size;
+}
+
+// Frees the blocks of the compressed cluster `ext`, which the running
+// operation has unmapped. They are not reused before it commits, so a crash
+// that maps them again still finds the cluster there.
+void cluster_free(const Extent *ext) {
+  __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+  free_data(ext->start, ext->stored);
+}
@@ -0,0 +1,21 @@
+#ifndef SIMPLEFS_CLUSTER_H
+#define SIMPLEFS_CLUSTER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "def.h"
+
+// File blocks per cluster.
+#define CLUSTER_BLOCKS ((uint32_t)(CLUSTER_SIZE / BLOCK_SIZE))
+
+void cluster_set_compress(int on);
+int cluster_compressing(void);
+uint32_t cluster_pack(const Byte *raw, Byte *packed);
+ssize_t cluster_read(const Extent *ext, uint32_t logical, uint32_t offset,
+                     char *buf, size_t size);
+ssize_t cluster_write(Block *head, const Extent *ext, uint32_t logical,
+                      uint32_t offset, const char *buf, size_t size);
+void cluster_free(const Extent *ext);
+
+#endif  // SIMPLEFS_CLUSTER_H
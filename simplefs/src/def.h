@@ -3,45 +3,186 @@
 
 #include <stdint.h>
 
-#define BLOCK_SIZE 512
-#define MAX_BLOCKS 1024
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_DISK_SIZE (64ULL << 20)
 #define MAX_PATH_LEN 256
 #define MAX_FILENAME_LEN 32
-#define HEADER_SIZE \
-  (MAX_FILENAME_LEN + sizeof(enum Type) + sizeof(int32_t) + sizeof(BlockID))
-#define MAX_CHILDREN ((BLOCK_SIZE - HEADER_SIZE) / sizeof(BlockID))
-#define MAX_FILE_DATA_SIZE (BLOCK_SIZE - HEADER_SIZE)
+#define CLUSTER_SIZE 65536  // Unit of compression
 
-extern int disk_fd;
+// The geometry is chosen at format time and read from the superblock, so
+// everything sized by the block size is computed at runtime.
+#define BLOCK_SIZE ((size_t)sb.block_size)
+#define BLOCK_CONTENT_SIZE (BLOCK_SIZE - sizeof(Block))
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+
+#define SIMPLEFS_MAGIC 0x53465331  // "SFS1"
+#define SIMPLEFS_VERSION 9
+#define SUPERBLOCK_ID 0
+#define SUPERBLOCK_SIZE 512
+#define JOURNAL_MAGIC 0x534a4e4c  // "SJNL"
+
+#define EXTENTS_PER_NODE \
+  ((BLOCK_CONTENT_SIZE - sizeof(ExtentNode)) / sizeof(Extent))
+#define INDEXES_PER_NODE \
+  ((BLOCK_CONTENT_SIZE - sizeof(ExtentNode)) / sizeof(ExtentIndex))
+#define DIRENTS_PER_NODE \
+  ((BLOCK_CONTENT_SIZE - sizeof(DirNode)) / sizeof(DirEntry))
+#define DIR_INDEXES_PER_NODE \
+  ((BLOCK_CONTENT_SIZE - sizeof(DirNode)) / sizeof(DirIndex))
 
 typedef uint8_t Byte;
-typedef int32_t BlockID;
+typedef int64_t BlockID;
 
 #pragma pack(push, 1)
 
-enum Type { _FREE = 0, _DIRECTORY = 1, _FILE = 2, _DATA_BLOCK = 99 };
+enum Type {
+  _FREE = 0,
+  _DIRECTORY = 1,
+  _FILE = 2,
+  _EXTENT_NODE = 3,
+  _DIR_NODE = 4
+};
+
+// Maps `length` file blocks starting at file block `logical` to the disk
+// blocks starting at `start`. File blocks and disk blocks are the same size,
+// unless the extent is a compressed cluster: then `stored` blocks from
+// `start` hold a ClusterHeader and the LZ4-compressed file blocks.
+typedef struct {
+  uint32_t logical;
+  uint32_t length;
+  BlockID start;
+  uint32_t stored;  // 0: not compressed
+} Extent;
+
+typedef struct {
+  uint32_t size;  // Of the compressed data that follows
+  uint32_t reserved;
+} ClusterHeader;
+
+typedef struct {
+  uint32_t logical;  // Lowest file block reachable through `child`
+  BlockID child;
+} ExtentIndex;
 
-typedef struct {  // size: 512 bytes
+// A node of a file's extent tree. The root lives in the file's head block;
+// deeper nodes get an _EXTENT_NODE block each. Leaves (depth 0) hold
+// extents sorted by `logical`, inner nodes hold index entries.
+typedef struct {
+  uint16_t count;
+  uint16_t depth;
+  Byte entries[];  // Extent[] in leaves, ExtentIndex[] in inner nodes
+} ExtentNode;
+
+// A directory entry, keyed by (hash, seq). `seq` tells apart names whose
+// hashes collide and never changes, so the key doubles as a stable readdir
+// cookie.
+typedef struct {
+  BlockID id;
+  uint32_t hash;
+  uint16_t seq;
+  uint8_t type;  // enum Type of the child
+  char name[MAX_FILENAME_LEN];
+} DirEntry;
+
+typedef struct {
+  uint32_t hash;  // Lowest key reachable through `child`
+  uint16_t seq;
+  BlockID child;
+} DirIndex;
+
+// A node of a directory's B+tree. The root lives in the directory's head
+// block, deeper nodes get a _DIR_NODE block each. Leaves (depth 0) hold
+// entries sorted by key and are chained left to right through next_block;
+// a root leaf has no siblings, so a head's next_block is free for the
+// orphan list.
+typedef struct {
+  uint16_t count;
+  uint16_t depth;
+  Byte entries[];  // DirEntry[] in leaves, DirIndex[] in inner nodes
+} DirNode;
+
+// Header of every metadata block; the rest of the block is `content`, which
+// holds
+//   _FILE, _EXTENT_NODE     an ExtentNode (the root, in a file's head)
+//   _DIRECTORY, _DIR_NODE   a DirNode (the root, in a directory's head)
+// File data blocks have no header: all BLOCK_SIZE bytes are payload, and
+// the extent tree is the only record of whom they belong to. The head of a
+// file or directory that was removed links to the next one on the orphan
+// list through next_block.
+typedef struct {
   BlockID id;
   enum Type type;
-  int32_t size;
+  int64_t size;
   char name[MAX_FILENAME_LEN];
-  union {
-    struct {  // _FILE
-      Byte data[MAX_FILE_DATA_SIZE];
-    } file;
-
-    struct {  // _DIRECTORY
-      BlockID children[MAX_CHILDREN];
-    } dir;
-
-    struct {  // _DATA_BLOCK
-      Byte raw_data[MAX_FILE_DATA_SIZE];
-    } raw;
-  } content;
   BlockID next_block;
+  Byte content[];
 } Block;
 
+// Block 0. Followed by `bitmap_blocks` blocks of allocation bitmap (one bit
+// per block, 1 = in use), `journal_blocks` blocks of metadata journal (none
+// if 0), then the root directory. Only the first SUPERBLOCK_SIZE bytes are
+// used, so it can be read before the block size is known. `orphans` starts
+// the list of removed files and directories whose blocks are yet to be
+// freed.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t reserved0;
+  uint64_t block_count;
+  BlockID bitmap_start;
+  uint64_t bitmap_blocks;
+  BlockID journal_start;
+  uint64_t journal_blocks;
+  BlockID root;
+  BlockID orphans;  // 0 if none
+  Byte reserved[SUPERBLOCK_SIZE - 4 * sizeof(uint32_t) - 7 * sizeof(uint64_t)];
+} SuperBlock;
+
+// The first journal block; the rest is the log. Replay starts at the top of
+// the log with transaction `seq`.
+typedef struct {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t seq;
+} JournalHeader;
+
+enum JournalRecordType { JOURNAL_DESCRIPTOR = 1, JOURNAL_COMMIT = 2 };
+
+// A transaction in the log is one or more descriptor blocks, each followed
+// by the images of the `count` blocks it lists, then a commit block whose
+// checksum covers every id and image of the transaction. Transactions
+// without a valid commit block are ignored by replay.
+typedef struct {
+  uint32_t magic;
+  uint32_t type;  // enum JournalRecordType
+  uint64_t seq;
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t checksum;  // Commit blocks only
+  BlockID ids[];      // Descriptor blocks only
+} JournalRecord;
+
 #pragma pack(pop)
 
-#endif  // SIMPLEFS_DEF_H
\ No newline at end of file
+_Static_assert(sizeof(SuperBlock) == SUPERBLOCK_SIZE,
+               "SuperBlock must fill SUPERBLOCK_SIZE bytes");
+
+#define EXTENT_NODE(block) ((ExtentNode *)(block)->content)
+#define DIR_NODE(block) ((DirNode *)(block)->content)
+#define NODE_EXTENTS(node) ((Extent *)(node)->entries)
+#define NODE_EXTENT_INDEX(node) ((ExtentIndex *)(node)->entries)
+#define NODE_DIRENTS(node) ((DirEntry *)(node)->entries)
+#define NODE_DIR_INDEX(node) ((DirIndex *)(node)->entries)
+
+// Declares `name` as a Block backed by a block-sized buffer on the stack.
+#define BLOCK_BUFFER(name)                                  \
+  uint64_t name##_storage[sb.block_size / sizeof(uint64_t)]; \
+  Block *name = (Block *)name##_storage
+
+extern int disk_fd;
+extern SuperBlock sb;
+
+#endif  // SIMPLEFS_DEF_H
@@ -0,0 +1,376 @@
+#include "delalloc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "cluster.h"
+#include "def.h"
+#include "extent.h"
+#include "helper.h"
+#include "io.h"
+#include "journal.h"
+#include "lock.h"
+
+// Delayed allocation. Data written where a file has no blocks yet is kept
+// in memory, one zero-filled buffer per file block, and only gets blocks
+// when the file is flushed: consecutive buffered blocks are allocated as
+// one run, go out with one vectored write and are mapped by one extent,
+// and the head is written once with the new extents and size. Space is
+// claimed from the allocator when a block is first buffered, along with
+// META_CLAIM blocks per file for the extent tree to grow into, so the
+// flush does not run out of space. With compression on, runs are cut at
+// cluster boundaries and each whole cluster is stored compressed if that
+// saves space.
+//
+// The table is guarded by table_lock, each file's entry by the file's
+// inode lock: shared to read it, exclusive to change or remove it.
+
+#define BUCKETS 256
+#define RUN_MAX IO_BATCH_IOV
+#define META_CLAIM 4
+
+typedef struct {
+  uint32_t logical;
+  Byte *data;
+} DirtyBlock;
+
+typedef struct DelayedFile {
+  BlockID head;
+  off_t size;          // File size counting the buffered data
+  DirtyBlock *blocks;  // Sorted by logical block
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t meta;  // Blocks claimed for the extent tree
+  struct DelayedFile *next;
+} DelayedFile;
+
+static DelayedFile *table[BUCKETS];
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t buffered = 0;  // Blocks buffered by all files
+
+static DelayedFile **bucket(BlockID head) {
+  return &table[((uint64_t)head * 0x9e3779b97f4a7c15ULL) >> 56];
+}
+
+static DelayedFile *find(BlockID head) {
+  pthread_rwlock_rdlock(&table_lock);
+  DelayedFile *f = *bucket(head);
+  while (f && f->head != head) f = f->next;
+  pthread_rwlock_unlock(&table_lock);
+  return f;
+}
+
+static DelayedFile *find_or_add(BlockID head) {
+  DelayedFile *f = find(head);
+  if (f) return f;
+  f = calloc(1, sizeof(DelayedFile));
+  if (!f) return NULL;
+  if (alloc_claim(META_CLAIM) == 0) f->meta = META_CLAIM;
+  f->head = head;
+  pthread_rwlock_wrlock(&table_lock);
+  f->next = *bucket(head);
+  *bucket(head) = f;
+  pthread_rwlock_unlock(&table_lock);
+  return f;
+}
+
+static void drop(DelayedFile *f) {
+  pthread_rwlock_wrlock(&table_lock);
+  DelayedFile **p = bucket(f->head);
+  while (*p != f) p = &(*p)->next;
+  *p = f->next;
+  pthread_rwlock_unlock(&table_lock);
+  alloc_unclaim(f->meta);
+  free(f->blocks);
+  free(f);
+}
+
+// Index of the first buffered block at or after `logical`.
+static uint32_t search(const DelayedFile *f, uint32_t logical) {
+  uint32_t lo = 0, hi = f->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (f->blocks[mid].logical < logical)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Adds a zero-filled buffer for `logical` at index `i`. Buffers are block
+// aligned so that O_DIRECT writes need no staging.
+static int add_block(DelayedFile *f, uint32_t i, uint32_t logical) {
+  if (f->count == f->capacity) {
+    uint32_t capacity = f->capacity ? f->capacity * 2 : 16;
+    DirtyBlock *blocks = realloc(f->blocks, capacity * sizeof(DirtyBlock));
+    if (!blocks) return -ENOMEM;
+    f->blocks = blocks;
+    f->capacity = capacity;
+  }
+  void *data;
+  if (posix_memalign(&data, BLOCK_SIZE, BLOCK_SIZE) != 0) return -ENOMEM;
+  memset(data, 0, BLOCK_SIZE);
+  if (alloc_claim(1) != 0) {
+    free(data);
+    return -ENOSPC;
+  }
+  memmove(&f->blocks[i + 1], &f->blocks[i],
+          (f->count - i) * sizeof(DirtyBlock));
+  f->blocks[i] = (DirtyBlock){logical, data};
+  f->count++;
+  __atomic_add_fetch(&buffered, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Buffers up to `size` bytes for file block `logical`, which has no block
+// on disk, starting `offset` bytes into it. Returns the bytes taken, at
+// most the rest of the block. Caller holds the file exclusive.
+ssize_t delalloc_write(BlockID head, uint32_t logical, uint32_t offset,
+                       const char *buf, size_t size) {
+  DelayedFile *f = find_or_add(head);
+  if (!f) return -ENOMEM;
+
+  uint32_t i = search(f, logical);
+  if (i == f->count || f->blocks[i].logical != logical) {
+    int err = add_block(f, i, logical);
+    if (err != 0) return err;
+  }
+
+  size_t n = BLOCK_SIZE - offset;
+  if (n > size) n = size;
+  memcpy(f->blocks[i].data + offset, buf, n);
+  off_t end = (off_t)logical * BLOCK_SIZE + offset + n;
+  if (end > f->size) f->size = end;
+  return n;
+}
+
+// The buffered contents of file block `logical`, or NULL. Valid while the
+// caller holds the file.
+const Byte *delalloc_block(BlockID head, uint32_t logical) {
+  DelayedFile *f = find(head);
+  if (!f) return NULL;
+  uint32_t i = search(f, logical);
+  if (i == f->count || f->blocks[i].logical != logical) return NULL;
+  return f->blocks[i].data;
+}
+
+// The file's size as its buffered data has it, 0 if there is none; the
+// real size is the larger of this and the head's.
+off_t delalloc_size(BlockID head) {
+  DelayedFile *f = find(head);
+  return f ? f->size : 0;
+}
+
+// Forgets what is buffered past `size` bytes, zeroes the rest of the block
+// `size` ends in and hands back the claims of what went; size 0 forgets
+// the file. Caller holds the file exclusive.
+void delalloc_truncate(BlockID head, off_t size) {
+  DelayedFile *f = find(head);
+  if (!f) return;
+
+  uint32_t i = search(f, ((uint64_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+  uint32_t gone = f->count - i;
+  for (uint32_t j = i; j < f->count; j++) free(f->blocks[j].data);
+  f->count = i;
+  alloc_unclaim(gone);
+  __atomic_sub_fetch(&buffered, gone, __ATOMIC_RELAXED);
+
+  uint32_t offset = size % BLOCK_SIZE;
+  if (offset && i > 0 && f->blocks[i - 1].logical == size / BLOCK_SIZE)
+    memset(f->blocks[i - 1].data + offset, 0, BLOCK_SIZE - offset);
+  if (f->size > size) f->size = size;
+  if (f->count == 0) drop(f);
+}
+
+// Whether the file should be flushed now.
+int delalloc_full(BlockID head) {
+  DelayedFile *f = find(head);
+  if (!f) return 0;
+  uint64_t total = __atomic_load_n(&buffered, __ATOMIC_RELAXED);
+  return (uint64_t)f->count * BLOCK_SIZE >= DELALLOC_FILE_MAX ||
+         total * BLOCK_SIZE >= DELALLOC_MAX;
+}
+
+// Right after the block holding the previous file block, so files that
+// grow sequentially stay in one extent.
+static BlockID goal(const Block *head, uint32_t logical) {
+  Extent prev;
+  if (logical > 0 && extent_lookup(head, logical - 1, &prev)) {
+    if (prev.stored) return prev.start + prev.stored;
+    return prev.start + (logical - 1 - prev.logical) + 1;
+  }
+  return head->id + 1;
+}
+
+// Stores the cluster at the start of `run` compressed, using `scratch`
+// (2 * CLUSTER_SIZE bytes). Returns CLUSTER_BLOCKS, 0 if it is better
+// stored as it is, or -errno.
+static int flush_cluster(Block *head, const DirtyBlock *run, Byte *scratch) {
+  uint32_t blocks = CLUSTER_BLOCKS;
+  for (uint32_t i = 0; i < blocks; i++)
+    memcpy(scratch + (size_t)i * BLOCK_SIZE, run[i].data, BLOCK_SIZE);
+  Byte *packed = scratch + CLUSTER_SIZE;
+  uint32_t stored = cluster_pack(scratch, packed);
+  if (stored == 0) return 0;
+
+  BlockID start = alloc_exact_claimed(goal(head, run[0].logical), stored);
+  // Without room in one piece, the cluster goes out as it is.
+  if (start == -1) return 0;
+
+  Extent ext = {run[0].logical, blocks, start, stored};
+  cache_invalidate(start, stored);
+  int err = io_write(packed, (size_t)stored * BLOCK_SIZE,
+                     (off_t)start * BLOCK_SIZE);
+  if (err == 0) err = extent_insert(head, &ext);
+  if (err != 0) {
+    free_run(start, stored);
+    alloc_claim(stored);
+    return err;
+  }
+  // The blocks compression saved were claimed too.
+  alloc_unclaim(blocks - stored);
+  return blocks;
+}
+
+// Writes a run of buffered blocks out to newly allocated blocks and maps
+// them. Returns how many blocks went out, or -errno. Given `scratch`, it
+// compresses: a run starting a cluster stores that one cluster, any other
+// stops at the next cluster boundary.
+static int flush_run(Block *head, const DirtyBlock *run, uint32_t count,
+                     Byte *scratch) {
+  if (scratch) {
+    uint32_t blocks = CLUSTER_BLOCKS;
+    uint32_t into = run[0].logical % blocks;
+    if (into == 0 && count >= blocks) {
+      int n = flush_cluster(head, run, scratch);
+      if (n != 0) return n;
+      count = blocks;
+    } else if (into != 0 && count > blocks - into) {
+      count = blocks - into;
+    }
+  }
+
+  uint32_t got;
+  BlockID start = alloc_run_claimed(goal(head, run[0].logical), count, &got);
+  if (start == -1) return -ENOSPC;
+
+  struct iovec iov[RUN_MAX];
+  for (uint32_t i = 0; i < got; i++)
+    iov[i] = (struct iovec){run[i].data, BLOCK_SIZE};
+  cache_invalidate(start, got);
+  int err = io_writev(iov, got, (off_t)start * BLOCK_SIZE);
+  Extent ext = {run[0].logical, got, start, 0};
+  if (err == 0) err = extent_insert(head, &ext);
+  if (err != 0) {
+    free_run(start, got);
+    alloc_claim(got);
+    return err;
+  }
+  return got;
+}
+
+// Writes the file's buffered data to newly allocated blocks and updates
+// `head` to match, leaving the caller to write it. Returns 1 if `head`
+// changed, 0 if not, or -errno, in which case whatever did not go out stays
+// buffered. Caller holds the file exclusive, inside a journal operation.
+int delalloc_flush(Block *head) {
+  DelayedFile *f = find(head->id);
+  if (!f) return 0;
+
+  // The tree's share is handed back for extent_insert() to reserve.
+  alloc_unclaim(f->meta);
+  f->meta = 0;
+
+  void *scratch = NULL;
+  if (cluster_compressing() &&
+      posix_memalign(&scratch, BLOCK_SIZE, 2 * CLUSTER_SIZE) != 0)
+    scratch = NULL;
+
+  int err = 0;
+  uint32_t done = 0;
+  while (done < f->count) {
+    const DirtyBlock *run = &f->blocks[done];
+    uint32_t count = 1;
+    while (done + count < f->count && count < RUN_MAX &&
+           run[count].logical == run[0].logical + count) {
+      count++;
+    }
+    int n = flush_run(head, run, count, scratch);
+    if (n < 0) {
+      err = n;
+      break;
+    }
+    for (int i = 0; i < n; i++) free(run[i].data);
+    done += n;
+  }
+
+  free(scratch);
+
+  f->count -= done;
+  memmove(f->blocks, &f->blocks[done], f->count * sizeof(DirtyBlock));
+  __atomic_sub_fetch(&buffered, done, __ATOMIC_RELAXED);
+
+  int changed = done > 0;
+  if (f->count == 0) {
+    if (f->size > head->size) {
+      head->size = f->size;
+      changed = 1;
+    }
+    drop(f);
+  } else if (alloc_claim(META_CLAIM) == 0) {
+    f->meta = META_CLAIM;
+  }
+  return err ? err : changed;
+}
+
+// delalloc_flush() for a file the caller does not hold.
+int delalloc_flush_file(BlockID head_id) {
+  if (!find(head_id)) return 0;
+
+  journal_begin();
+  inode_lock_exclusive(head_id);
+  BLOCK_BUFFER(head);
+  read_block(head_id, head);
+  int ret = delalloc_flush(head);
+  if (ret > 0) write_block(head_id, head);
+  inode_unlock(head_id);
+  journal_end();
+  return ret < 0 ? ret : 0;
+}
+
+int delalloc_flush_all(void) {
+  BlockID *heads = NULL;
+  size_t count = 0, capacity = 0;
+  int ret = 0;
+  pthread_rwlock_rdlock(&table_lock);
+  for (int b = 0; b < BUCKETS && ret == 0; b++) {
+    for (DelayedFile *f = table[b]; f; f = f->next) {
+      if (count == capacity) {
+        size_t grown = capacity ? capacity * 2 : 64;
+        BlockID *p = realloc(heads, grown * sizeof(BlockID));
+        if (!p) {
+          ret = -ENOMEM;
+          break;
+        }
+        heads = p;
+        capacity = grown;
+      }
+      heads[count++] = f->head;
+    }
+  }
+  pthread_rwlock_unlock(&table_lock);
+
+  for (size_t i = 0; i < count; i++) {
+    int err = delalloc_flush_file(heads[i]);
+    if (err != 0 && ret == 0) ret = err;
+  }
+  free(heads);
+  return ret;
+}
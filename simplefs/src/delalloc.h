@@ -0,0 +1,25 @@
+#ifndef SIMPLEFS_DELALLOC_H
+#define SIMPLEFS_DELALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "def.h"
+
+// A file is flushed once it buffers this much, or all files together
+// buffer DELALLOC_MAX.
+#define DELALLOC_FILE_MAX (4 << 20)
+#define DELALLOC_MAX (64 << 20)
+
+ssize_t delalloc_write(BlockID head, uint32_t logical, uint32_t offset,
+                       const char *buf, size_t size);
+const Byte *delalloc_block(BlockID head, uint32_t logical);
+off_t delalloc_size(BlockID head);
+void delalloc_truncate(BlockID head, off_t size);
+int delalloc_full(BlockID head);
+int delalloc_flush(Block *head);
+int delalloc_flush_file(BlockID head);
+int delalloc_flush_all(void);
+
+#endif  // SIMPLEFS_DELALLOC_H
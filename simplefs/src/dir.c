@@ -0,0 +1,309 @@
+#include "dir.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "def.h"
+#include "helper.h"
+
+// FNV-1a.
+uint32_t name_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h ^= (uint8_t)*name;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint64_t make_key(uint32_t hash, uint16_t seq) {
+  return ((uint64_t)hash << 16) | seq;
+}
+
+uint64_t dir_entry_key(const DirEntry *entry) {
+  return make_key(entry->hash, entry->seq);
+}
+
+static uint64_t node_key(const DirNode *node, int i) {
+  if (node->depth) {
+    const DirIndex *index = NODE_DIR_INDEX(node);
+    return make_key(index[i].hash, index[i].seq);
+  }
+  return dir_entry_key(&NODE_DIRENTS(node)[i]);
+}
+
+// First entry whose key is >= `key` (node->count if none).
+static int lower_bound(const DirNode *node, uint64_t key) {
+  int lo = 0, hi = node->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (node_key(node, mid) < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Child of an inner node whose subtree covers `key`.
+static int find_child(const DirNode *node, uint64_t key) {
+  int i = lower_bound(node, key);
+  if (i < node->count && node_key(node, i) == key) return i;
+  return i > 0 ? i - 1 : 0;
+}
+
+// Finds the leaf covering `key`, starting from the root in `head`. Returns
+// a view of it (see view_block()): `head` itself, `buf` or the block in
+// place.
+static const Block *find_leaf(const Block *head, uint64_t key, Block *buf) {
+  const Block *leaf = head;
+  while (DIR_NODE(leaf)->depth > 0) {
+    const DirNode *node = DIR_NODE(leaf);
+    leaf = view_block(NODE_DIR_INDEX(node)[find_child(node, key)].child, buf);
+  }
+  return leaf;
+}
+
+// Looks for `name` among the entries sharing its hash, which may span
+// several leaves. On a hit, points *leaf at a view of the leaf, as
+// find_leaf() does, and returns the slot. Either way *next_seq ends up
+// above every seq in use for the hash.
+static int scan(const Block *head, const char *name, uint32_t hash,
+                Block *buf, const Block **leaf, uint16_t *next_seq) {
+  uint64_t key = make_key(hash, 0);
+  const Block *cur = find_leaf(head, key, buf);
+  int i = lower_bound(DIR_NODE(cur), key);
+  *next_seq = 0;
+
+  for (;;) {
+    const DirNode *node = DIR_NODE(cur);
+    for (; i < node->count; i++) {
+      const DirEntry *e = &NODE_DIRENTS(node)[i];
+      if (e->hash != hash) return -1;
+      if (strcmp(e->name, name) == 0) {
+        *leaf = cur;
+        return i;
+      }
+      if (e->seq >= *next_seq) *next_seq = e->seq + 1;
+    }
+    if (cur == head || cur->next_block == 0) return -1;
+    cur = view_block(cur->next_block, buf);
+    i = 0;
+  }
+}
+
+BlockID dir_lookup(BlockID dir_id, const char *name, DirEntry *out) {
+  BLOCK_BUFFER(head_buf);
+  BLOCK_BUFFER(buf);
+  const Block *head = view_block(dir_id, head_buf);
+  if (head->type != _DIRECTORY) return -1;
+
+  const Block *leaf;
+  uint16_t next_seq;
+  int slot = scan(head, name, name_hash(name), buf, &leaf, &next_seq);
+  if (slot < 0) return -1;
+
+  const DirEntry *e = &NODE_DIRENTS(DIR_NODE(leaf))[slot];
+  if (out) *out = *e;
+  return e->id;
+}
+
+// Puts `entry` at position `pos` of the node in `block`. A full node is
+// split: the upper half moves to a new block, described by *split, and 1 is
+// returned. Split leaves stay linked in key order.
+static int add_entry(Block *block, int pos, const void *entry,
+                     DirIndex *split) {
+  DirNode *node = DIR_NODE(block);
+  size_t esize = node->depth ? sizeof(DirIndex) : sizeof(DirEntry);
+  int cap = node->depth ? DIR_INDEXES_PER_NODE : DIRENTS_PER_NODE;
+  Byte *base = (Byte *)node->entries;
+
+  if (node->count < cap) {
+    memmove(base + (pos + 1) * esize, base + pos * esize,
+            (node->count - pos) * esize);
+    memcpy(base + pos * esize, entry, esize);
+    node->count++;
+    return 0;
+  }
+
+  BlockID sibling_id = alloc_block(block->id + 1);
+  if (sibling_id == -1) return -ENOSPC;
+
+  Byte merged[BLOCK_CONTENT_SIZE + sizeof(DirEntry)];
+  memcpy(merged, base, pos * esize);
+  memcpy(merged + pos * esize, entry, esize);
+  memcpy(merged + (pos + 1) * esize, base + pos * esize,
+         (node->count - pos) * esize);
+
+  int total = cap + 1;
+  int left = total / 2;
+
+  BLOCK_BUFFER(sibling);
+  memset(sibling, 0, BLOCK_SIZE);
+  sibling->id = sibling_id;
+  sibling->type = _DIR_NODE;
+  DirNode *right = DIR_NODE(sibling);
+  right->depth = node->depth;
+  right->count = total - left;
+  memcpy(right->entries, merged + left * esize, right->count * esize);
+  if (node->depth == 0) {
+    sibling->next_block = block->next_block;
+    block->next_block = sibling_id;
+  }
+  write_block(sibling_id, sibling);
+
+  memcpy(base, merged, left * esize);
+  node->count = left;
+
+  uint64_t key = node_key(right, 0);
+  split->hash = key >> 16;
+  split->seq = key & 0xffff;
+  split->child = sibling_id;
+  return 1;
+}
+
+static int insert_node(Block *block, const DirEntry *entry, DirIndex *split) {
+  DirNode *node = DIR_NODE(block);
+  uint64_t key = dir_entry_key(entry);
+
+  if (node->depth == 0)
+    return add_entry(block, lower_bound(node, key), entry, split);
+
+  int i = find_child(node, key);
+  BLOCK_BUFFER(child);
+  read_block(NODE_DIR_INDEX(node)[i].child, child);
+
+  DirIndex child_split;
+  int ret = insert_node(child, entry, &child_split);
+  if (ret < 0) return ret;
+  write_block(child->id, child);
+  if (ret == 0) return 0;
+  return add_entry(block, i + 1, &child_split, split);
+}
+
+// Inserts `name` -> `child`. The head's `size` counts the entries.
+int dir_add(BlockID dir_id, const char *name, BlockID child, enum Type type) {
+  BLOCK_BUFFER(head);
+  BLOCK_BUFFER(leaf);
+  read_block(dir_id, head);
+  if (head->type != _DIRECTORY) return -ENOTDIR;
+
+  DirEntry entry = {0};
+  entry.id = child;
+  entry.hash = name_hash(name);
+  entry.type = type;
+  strncpy(entry.name, name, MAX_FILENAME_LEN - 1);
+  const Block *found;
+  if (scan(head, entry.name, entry.hash, leaf, &found, &entry.seq) >= 0)
+    return -EEXIST;
+
+  // Worst case every level splits and the root grows by one.
+  DirNode *root = DIR_NODE(head);
+  if (alloc_reserve(root->depth + 2) != 0) return -ENOSPC;
+
+  DirIndex split;
+  int ret = insert_node(head, &entry, &split);
+  if (ret == 1) {
+    // The root split: push its left half down into a new block and turn the
+    // root into an index over both halves.
+    Block *left = leaf;
+    memset(left, 0, BLOCK_SIZE);
+    left->id = alloc_block(dir_id + 1);
+    left->type = _DIR_NODE;
+    memcpy(DIR_NODE(left), root, BLOCK_CONTENT_SIZE);
+    left->next_block = head->next_block;
+    write_block(left->id, left);
+
+    uint64_t first = node_key(root, 0);
+    DirIndex *index = NODE_DIR_INDEX(root);
+    head->next_block = 0;
+    root->depth++;
+    root->count = 2;
+    index[0].hash = first >> 16;
+    index[0].seq = first & 0xffff;
+    index[0].child = left->id;
+    index[1] = split;
+    ret = 0;
+  }
+  alloc_unreserve();
+  if (ret < 0) return ret;
+
+  head->size++;
+  write_block(dir_id, head);
+  return 0;
+}
+
+// Removes `name`. Leaves are not merged when they run low; an emptied leaf
+// stays linked and takes later inserts for its key range.
+int dir_remove(BlockID dir_id, const char *name) {
+  BLOCK_BUFFER(head);
+  BLOCK_BUFFER(leaf);
+  read_block(dir_id, head);
+  if (head->type != _DIRECTORY) return -ENOTDIR;
+
+  const Block *found;
+  uint16_t next_seq;
+  int slot = scan(head, name, name_hash(name), leaf, &found, &next_seq);
+  if (slot < 0) return -ENOENT;
+
+  // The leaf is changed and written back, so it needs a copy of its own.
+  Block *target = found == head ? head : leaf;
+  if (target == leaf && found != leaf) memcpy(leaf, found, BLOCK_SIZE);
+  DirNode *node = DIR_NODE(target);
+  DirEntry *entries = NODE_DIRENTS(node);
+  memmove(&entries[slot], &entries[slot + 1],
+          (node->count - slot - 1) * sizeof(DirEntry));
+  node->count--;
+  if (target != head) write_block(leaf->id, leaf);
+
+  head->size--;
+  write_block(dir_id, head);
+  return 0;
+}
+
+// Calls `fn` for every entry whose key is >= `start`, in key order, until
+// it returns non-zero, which is passed on. Returns -ENOTDIR if `dir_id` is
+// not a directory.
+int dir_iterate(BlockID dir_id, uint64_t start, dir_iter_fn fn, void *arg) {
+  BLOCK_BUFFER(head_buf);
+  BLOCK_BUFFER(buf);
+  const Block *head = view_block(dir_id, head_buf);
+  if (head->type != _DIRECTORY) return -ENOTDIR;
+
+  const Block *leaf = find_leaf(head, start, buf);
+  int i = lower_bound(DIR_NODE(leaf), start);
+
+  for (;;) {
+    const DirNode *node = DIR_NODE(leaf);
+    for (; i < node->count; i++) {
+      int ret = fn(&NODE_DIRENTS(node)[i], arg);
+      if (ret != 0) return ret;
+    }
+    if (leaf == head || leaf->next_block == 0) return 0;
+    leaf = view_block(leaf->next_block, buf);
+    i = 0;
+  }
+}
+
+static void free_subtree(BlockID id) {
+  BLOCK_BUFFER(block);
+  read_block(id, block);
+  const DirNode *node = DIR_NODE(block);
+  for (int i = 0; node->depth > 0 && i < node->count; i++)
+    free_subtree(NODE_DIR_INDEX(node)[i].child);
+  free_metadata(id);
+}
+
+// Frees every block of the directory's tree but the head, leaving it an
+// empty root leaf. Entries still in the tree are dropped, not their nodes.
+// The caller writes `head` back.
+void dir_release(Block *head) {
+  DirNode *root = DIR_NODE(head);
+  for (int i = 0; root->depth > 0 && i < root->count; i++)
+    free_subtree(NODE_DIR_INDEX(root)[i].child);
+  root->depth = 0;
+  root->count = 0;
+  head->size = 0;
+}
@@ -0,0 +1,18 @@
+#ifndef SIMPLEFS_DIR_H
+#define SIMPLEFS_DIR_H
+
+#include <stdint.h>
+
+#include "def.h"
+
+typedef int (*dir_iter_fn)(const DirEntry *entry, void *arg);
+
+uint32_t name_hash(const char *name);
+uint64_t dir_entry_key(const DirEntry *entry);
+BlockID dir_lookup(BlockID dir_id, const char *name, DirEntry *out);
+int dir_add(BlockID dir_id, const char *name, BlockID child, enum Type type);
+int dir_remove(BlockID dir_id, const char *name);
+int dir_iterate(BlockID dir_id, uint64_t start, dir_iter_fn fn, void *arg);
+void dir_release(Block *head);
+
+#endif  // SIMPLEFS_DIR_H
@@ -0,0 +1,347 @@
+#include "extent.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "cluster.h"
+#include "def.h"
+#include "helper.h"
+#include "io.h"
+
+static uint32_t entry_key(const ExtentNode *node, int i) {
+  return node->depth ? NODE_EXTENT_INDEX(node)[i].logical
+                     : NODE_EXTENTS(node)[i].logical;
+}
+
+// Index of the last entry starting at or before `logical`, or -1.
+static int find_entry(const ExtentNode *node, uint32_t logical) {
+  int lo = 0, hi = node->count - 1, found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (entry_key(node, mid) <= logical) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return found;
+}
+
+static int find_child(const ExtentNode *node, uint32_t logical) {
+  int i = find_entry(node, logical);
+  return i < 0 ? 0 : i;
+}
+
+// Finds the extent that maps file block `logical` and returns 1. For a hole,
+// returns 0 and sets out->length to the number of unmapped blocks that
+// follow (EXTENT_HOLE_MAX past the last extent).
+int extent_lookup(const Block *head, uint32_t logical, Extent *out) {
+  const ExtentNode *node = EXTENT_NODE(head);
+  uint32_t limit = EXTENT_HOLE_MAX;  // First block past the current subtree
+  BLOCK_BUFFER(buf);
+
+  while (node->depth > 0) {
+    const ExtentIndex *index = NODE_EXTENT_INDEX(node);
+    int i = find_child(node, logical);
+    if (i + 1 < node->count) limit = index[i + 1].logical;
+    node = EXTENT_NODE(view_block(index[i].child, buf));
+  }
+
+  const Extent *extents = NODE_EXTENTS(node);
+  int i = find_entry(node, logical);
+  if (i >= 0) {
+    const Extent *ext = &extents[i];
+    if (logical - ext->logical < ext->length) {
+      *out = *ext;
+      return 1;
+    }
+  }
+  if (i + 1 < node->count) limit = extents[i + 1].logical;
+
+  out->logical = logical;
+  out->length = limit - logical;
+  out->start = 0;
+  out->stored = 0;
+  return 0;
+}
+
+// Puts `entry` at position `pos` of `node`. A full node is split: the upper
+// half moves to a new block near `goal`, described by *split, and 1 is
+// returned.
+static int add_entry(ExtentNode *node, int pos, const void *entry,
+                     BlockID goal, ExtentIndex *split) {
+  size_t esize = node->depth ? sizeof(ExtentIndex) : sizeof(Extent);
+  int cap = node->depth ? INDEXES_PER_NODE : EXTENTS_PER_NODE;
+  Byte *base = node->entries;
+
+  if (node->count < cap) {
+    memmove(base + (pos + 1) * esize, base + pos * esize,
+            (node->count - pos) * esize);
+    memcpy(base + pos * esize, entry, esize);
+    node->count++;
+    return 0;
+  }
+
+  BlockID sibling_id = alloc_block(goal);
+  if (sibling_id == -1) return -ENOSPC;
+
+  Byte merged[BLOCK_CONTENT_SIZE + sizeof(Extent)];
+  memcpy(merged, base, pos * esize);
+  memcpy(merged + pos * esize, entry, esize);
+  memcpy(merged + (pos + 1) * esize, base + pos * esize,
+         (node->count - pos) * esize);
+
+  // Appends leave the left node full; files mostly grow at the end.
+  int total = cap + 1;
+  int left = (pos == cap) ? cap : total / 2;
+
+  BLOCK_BUFFER(sibling);
+  memset(sibling, 0, BLOCK_SIZE);
+  sibling->id = sibling_id;
+  sibling->type = _EXTENT_NODE;
+  ExtentNode *right = EXTENT_NODE(sibling);
+  right->depth = node->depth;
+  right->count = total - left;
+  memcpy(right->entries, merged + left * esize, right->count * esize);
+  write_block(sibling_id, sibling);
+
+  memcpy(base, merged, left * esize);
+  node->count = left;
+
+  split->logical = entry_key(right, 0);
+  split->child = sibling_id;
+  return 1;
+}
+
+// Compressed clusters stay extents of their own.
+static int extends(const Extent *a, const Extent *b) {
+  if (a->stored || b->stored) return 0;
+  return a->logical + a->length == b->logical &&
+         a->start + (BlockID)a->length == b->start;
+}
+
+static int insert_node(ExtentNode *node, BlockID goal, const Extent *ext,
+                       ExtentIndex *split) {
+  if (node->depth > 0) {
+    ExtentIndex *index = NODE_EXTENT_INDEX(node);
+    int i = find_child(node, ext->logical);
+    BLOCK_BUFFER(child);
+    read_block(index[i].child, child);
+
+    ExtentIndex child_split;
+    int ret = insert_node(EXTENT_NODE(child), child->id, ext, &child_split);
+    if (ret < 0) return ret;
+    write_block(child->id, child);
+
+    if (ext->logical < index[i].logical) index[i].logical = ext->logical;
+    if (ret == 0) return 0;
+    return add_entry(node, i + 1, &child_split, goal, split);
+  }
+
+  int i = find_entry(node, ext->logical);
+  Extent *left = i >= 0 ? &NODE_EXTENTS(node)[i] : NULL;
+  Extent *right = i + 1 < node->count ? &NODE_EXTENTS(node)[i + 1] : NULL;
+
+  if (left && extends(left, ext)) {
+    left->length += ext->length;
+    if (right && extends(left, right)) {
+      left->length += right->length;
+      memmove(right, right + 1, (node->count - i - 2) * sizeof(Extent));
+      node->count--;
+    }
+    return 0;
+  }
+  if (right && extends(ext, right)) {
+    right->logical = ext->logical;
+    right->start = ext->start;
+    right->length += ext->length;
+    return 0;
+  }
+  return add_entry(node, i + 1, ext, goal, split);
+}
+
+// The root split: push its left half down into a new block and turn the
+// root into an index over both halves.
+static void grow_root(Block *head, const ExtentIndex *split) {
+  ExtentNode *root = EXTENT_NODE(head);
+  BLOCK_BUFFER(left);
+  memset(left, 0, BLOCK_SIZE);
+  left->id = alloc_block(head->id + 1);
+  left->type = _EXTENT_NODE;
+  memcpy(EXTENT_NODE(left), root, BLOCK_CONTENT_SIZE);
+  write_block(left->id, left);
+
+  ExtentIndex *index = NODE_EXTENT_INDEX(root);
+  root->depth++;
+  root->count = 2;
+  index[0].logical = entry_key(EXTENT_NODE(left), 0);
+  index[0].child = left->id;
+  index[1] = *split;
+}
+
+// Adds the mapping `ext`, whose file blocks must currently be a hole.
+// Updates the root in `head`; the caller writes the head block back.
+int extent_insert(Block *head, const Extent *ext) {
+  ExtentNode *root = EXTENT_NODE(head);
+
+  // Worst case every level splits and the root grows by one.
+  if (alloc_reserve(root->depth + 2) != 0) return -ENOSPC;
+
+  ExtentIndex split;
+  int ret = insert_node(root, head->id + 1, ext, &split);
+  if (ret > 0) {
+    grow_root(head, &split);
+    ret = 0;
+  }
+  alloc_unreserve();
+  return ret;
+}
+
+// Moves the extent that starts at ext->logical, which must span the same
+// file blocks, to ext->start and ext->stored. Updates the root in `head`
+// or writes the leaf that holds the extent; the caller writes the head
+// block back.
+int extent_remap(Block *head, const Extent *ext) {
+  ExtentNode *node = EXTENT_NODE(head);
+  BLOCK_BUFFER(leaf);
+  while (node->depth > 0) {
+    int i = find_child(node, ext->logical);
+    read_block(NODE_EXTENT_INDEX(node)[i].child, leaf);
+    node = EXTENT_NODE(leaf);
+  }
+
+  int i = find_entry(node, ext->logical);
+  Extent *found = i >= 0 ? &NODE_EXTENTS(node)[i] : NULL;
+  if (!found || found->logical != ext->logical ||
+      found->length != ext->length)
+    return -EIO;
+  found->start = ext->start;
+  found->stored = ext->stored;
+  if (node != EXTENT_NODE(head)) write_block(leaf->id, leaf);
+  return 0;
+}
+
+// The first file block past the last extent, 0 for an empty tree.
+uint32_t extent_end(const Block *head) {
+  const ExtentNode *node = EXTENT_NODE(head);
+  BLOCK_BUFFER(buf);
+  while (node->depth > 0 && node->count > 0) {
+    const ExtentIndex *index = NODE_EXTENT_INDEX(node);
+    node = EXTENT_NODE(view_block(index[node->count - 1].child, buf));
+  }
+  if (node->count == 0) return 0;
+  const Extent *last = &NODE_EXTENTS(node)[node->count - 1];
+  return last->logical + last->length;
+}
+
+// Frees the blocks of `ext`, which the running operation has unmapped.
+// They are not reused before it commits: until then a crash maps them
+// again.
+static void free_extent(const Extent *ext) {
+  if (ext->stored)
+    cluster_free(ext);
+  else
+    free_data(ext->start, ext->length);
+}
+
+// Frees the extent node `id` with everything below it.
+static void free_subtree(BlockID id) {
+  BLOCK_BUFFER(block);
+  read_block(id, block);
+  const ExtentNode *node = EXTENT_NODE(block);
+  for (int i = 0; i < node->count; i++) {
+    if (node->depth > 0)
+      free_subtree(NODE_EXTENT_INDEX(node)[i].child);
+    else
+      free_extent(&NODE_EXTENTS(node)[i]);
+  }
+  free_metadata(id);
+}
+
+// Unmaps file blocks from `from` on in the subtree under `node`, freeing
+// their blocks and the nodes left empty. Every key of child i is at least
+// index[i].logical, so only the last child kept can straddle `from`.
+// Returns whether `node` changed.
+static int truncate_node(ExtentNode *node, uint32_t from) {
+  int keep = from > 0 ? find_entry(node, from - 1) + 1 : 0;
+  if (node->depth == 0) {
+    Extent *extents = NODE_EXTENTS(node);
+    int changed = keep < node->count;
+    for (int i = keep; i < node->count; i++) free_extent(&extents[i]);
+    node->count = keep;
+
+    // A compressed cluster is stored whole, so it stays mapped whole.
+    Extent *last = keep > 0 ? &extents[keep - 1] : NULL;
+    if (last && !last->stored && last->logical + last->length > from) {
+      uint32_t cut = from - last->logical;
+      free_data(last->start + cut, last->length - cut);
+      last->length = cut;
+      changed = 1;
+    }
+    return changed;
+  }
+
+  ExtentIndex *index = NODE_EXTENT_INDEX(node);
+  if (keep == 0) keep = 1;
+  int changed = keep < node->count;
+  for (int i = keep; i < node->count; i++) free_subtree(index[i].child);
+  node->count = keep;
+
+  BLOCK_BUFFER(child);
+  read_block(index[keep - 1].child, child);
+  if (truncate_node(EXTENT_NODE(child), from)) {
+    if (EXTENT_NODE(child)->count > 0) {
+      write_block(child->id, child);
+    } else {
+      free_metadata(child->id);
+      node->count--;
+    }
+    changed = 1;
+  }
+  return changed;
+}
+
+// Unmaps file blocks from `from` on and frees their blocks, except that a
+// compressed cluster straddling `from` is kept whole. Updates the root in
+// `head`; the caller writes the head block back.
+void extent_truncate(Block *head, uint32_t from) {
+  ExtentNode *root = EXTENT_NODE(head);
+  truncate_node(root, from);
+  if (root->count == 0) root->depth = 0;
+}
+
+// Queues a read of up to `size` bytes from the contiguous data blocks
+// [start, start + count), beginning `offset` bytes into the first one, on
+// `batch`. Data blocks are raw payload, so the whole range is one request
+// straight into `buf`. Returns the number of bytes queued; callers loop for
+// the rest and submit the batch.
+size_t extent_read(IoBatch *batch, BlockID start, uint32_t count,
+                   uint32_t offset, char *buf, size_t size) {
+  uint64_t avail = (uint64_t)count * BLOCK_SIZE - offset;
+  if (size > avail) size = avail;
+
+  io_batch_read(batch, buf, size, (off_t)start * BLOCK_SIZE + offset);
+  return size;
+}
+
+// Writes up to `size` bytes into the contiguous data blocks [start,
+// start + count), beginning `offset` bytes into the first one. Data blocks
+// bypass the block cache.
+ssize_t extent_write(BlockID start, uint32_t count, uint32_t offset,
+                     const char *buf, size_t size) {
+  uint64_t avail = (uint64_t)count * BLOCK_SIZE - offset;
+  if (size > avail) size = avail;
+
+  uint64_t blocks = ((uint64_t)offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  cache_invalidate(start, blocks);
+
+  if (io_write(buf, size, (off_t)start * BLOCK_SIZE + offset) != 0)
+    return -EIO;
+  return size;
+}
@@ -0,0 +1,22 @@
+#ifndef SIMPLEFS_EXTENT_H
+#define SIMPLEFS_EXTENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "def.h"
+#include "io.h"
+
+#define EXTENT_HOLE_MAX UINT32_MAX
+
+int extent_lookup(const Block *head, uint32_t logical, Extent *out);
+int extent_insert(Block *head, const Extent *ext);
+int extent_remap(Block *head, const Extent *ext);
+uint32_t extent_end(const Block *head);
+void extent_truncate(Block *head, uint32_t from);
+size_t extent_read(IoBatch *batch, BlockID start, uint32_t count,
+                   uint32_t offset, char *buf, size_t size);
+ssize_t extent_write(BlockID start, uint32_t count, uint32_t offset,
+                     const char *buf, size_t size);
+
+#endif  // SIMPLEFS_EXTENT_H
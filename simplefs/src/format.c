@@ -0,0 +1,96 @@
+#define _GNU_SOURCE  // fallocate()
+#include "format.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "def.h"
+
+// Marks blocks [first, last) used in the bitmap on disk, touching only the
+// bitmap blocks that hold those bits.
+static void mark_used(int fd, uint64_t first, uint64_t last) {
+  BLOCK_BUFFER(block);
+  Byte *bits = (Byte *)block;
+  while (first < last) {
+    uint64_t index = first / BITS_PER_BLOCK;
+    uint64_t base = index * BITS_PER_BLOCK;
+    uint64_t end = base + BITS_PER_BLOCK < last ? base + BITS_PER_BLOCK : last;
+    off_t at = (off_t)(sb.bitmap_start + index) * BLOCK_SIZE;
+    pread(fd, bits, BLOCK_SIZE, at);
+    for (uint64_t i = first - base; i < end - base; i++)
+      bits[i / 8] |= 1 << (i % 8);
+    pwrite(fd, bits, BLOCK_SIZE, at);
+    first = end;
+  }
+}
+
+// Formats `filename` as an image of `block_count` blocks of `block_size`
+// bytes with a `journal_blocks` block journal (0 for none). Sets the global
+// superblock as a side effect.
+//
+// Only the superblock, the journal header, the root and the bitmap blocks
+// with bits set are written; the rest of the image is a hole that reads as
+// zeros, which everywhere means empty: free in the bitmap, unused in the
+// journal. Nothing reads a block before writing all of it, so data blocks
+// need no zeroing either. With `preallocate` the image's space is
+// allocated up front, still without writing it.
+void format_disk(const char *filename, uint32_t block_size,
+                 uint64_t block_count, uint64_t journal_blocks,
+                 int preallocate) {
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("Open failed");
+    exit(1);
+  }
+  off_t image_size = (off_t)block_count * block_size;
+  if (ftruncate(fd, image_size) != 0) {
+    perror("Resize failed");
+    exit(1);
+  }
+  if (preallocate && fallocate(fd, 0, 0, image_size) != 0)
+    perror("Preallocation failed, image left sparse");
+
+  memset(&sb, 0, sizeof(SuperBlock));
+  sb.magic = SIMPLEFS_MAGIC;
+  sb.version = SIMPLEFS_VERSION;
+  sb.block_size = block_size;
+  sb.block_count = block_count;
+  sb.bitmap_start = SUPERBLOCK_ID + 1;
+  sb.bitmap_blocks = (block_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  sb.journal_start = sb.bitmap_start + sb.bitmap_blocks;
+  sb.journal_blocks = journal_blocks;
+  sb.root = sb.journal_start + sb.journal_blocks;
+
+  pwrite(fd, &sb, sizeof(SuperBlock), 0);
+
+  if (journal_blocks > 0) {
+    JournalHeader header = {.magic = JOURNAL_MAGIC, .seq = 1};
+    off_t at = (off_t)sb.journal_start * BLOCK_SIZE;
+    pwrite(fd, &header, sizeof(header), at);
+  }
+
+  // Superblock, bitmap, journal and root are in use; so are the bits past
+  // the end of the disk, so the allocator never hands them out.
+  mark_used(fd, 0, sb.root + 1);
+  mark_used(fd, sb.block_count, sb.bitmap_blocks * BITS_PER_BLOCK);
+
+  BLOCK_BUFFER(block);
+  memset(block, 0, BLOCK_SIZE);
+  block->id = sb.root;
+  block->type = _DIRECTORY;
+  strcpy(block->name, "/");
+  pwrite(fd, block, BLOCK_SIZE, (off_t)sb.root * BLOCK_SIZE);
+  close(fd);
+}
+
+// A 64th of the disk, within [64, 1024] blocks, if the disk can spare it.
+uint64_t default_journal_blocks(uint64_t block_count) {
+  uint64_t blocks = block_count / 64;
+  if (blocks < 64) blocks = 64;
+  if (blocks > 1024) blocks = 1024;
+  return blocks * 4 <= block_count ? blocks : 0;
+}
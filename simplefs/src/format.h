@@ -0,0 +1,11 @@
+#ifndef SIMPLEFS_FORMAT_H
+#define SIMPLEFS_FORMAT_H
+
+#include <stdint.h>
+
+void format_disk(const char *filename, uint32_t block_size,
+                 uint64_t block_count, uint64_t journal_blocks,
+                 int preallocate);
+uint64_t default_journal_blocks(uint64_t block_count);
+
+#endif  // SIMPLEFS_FORMAT_H
@@ -0,0 +1,114 @@
+#include "handle.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "def.h"
+#include "extent.h"
+#include "helper.h"
+#include "orphan.h"
+
+// Bumped whenever a file loses blocks, which may leave the extent cached in
+// any handle pointing at blocks that are no longer the file's.
+static uint64_t unmapped = 0;
+
+// An open file is pinned, so its blocks outlive its removal until the
+// last handle closes.
+int handle_open(BlockID head, struct fuse_file_info *fi) {
+  FileHandle *handle = calloc(1, sizeof(FileHandle));
+  if (!handle) return -ENOMEM;
+  if (orphan_pin(head) != 0) {
+    free(handle);
+    return -ENOMEM;
+  }
+  handle->head = head;
+  pthread_mutex_init(&handle->lock, NULL);
+  fi->fh = (uint64_t)(uintptr_t)handle;
+  return 0;
+}
+
+// NULL when the caller has no open handle, e.g. a path-only getattr.
+FileHandle *handle_get(struct fuse_file_info *fi) {
+  if (!fi || !fi->fh) return NULL;
+  return (FileHandle *)(uintptr_t)fi->fh;
+}
+
+void handle_close(struct fuse_file_info *fi) {
+  FileHandle *handle = handle_get(fi);
+  if (!handle) return;
+  orphan_unpin(handle->head, 1);
+  pthread_mutex_destroy(&handle->lock);
+  free(handle);
+  fi->fh = 0;
+}
+
+// The head block behind `fi` if it is open, else the one `path` names,
+// pinned like an open one so it is not reclaimed under the caller. Pair
+// with handle_unresolve().
+BlockID handle_resolve(const char *path, struct fuse_file_info *fi) {
+  FileHandle *handle = handle_get(fi);
+  return handle ? handle->head : resolve_pinned(path);
+}
+
+// Drops the pin handle_resolve() took for `id`, if it took one.
+void handle_unresolve(BlockID id, struct fuse_file_info *fi) {
+  if (!handle_get(fi)) orphan_unpin(id, 1);
+}
+
+// extent_lookup() that answers from, and refills, the extent cached in
+// `handle`. Mapped extents only ever grow until some file is truncated,
+// which handle_invalidate() records, so until then the cached one stays
+// valid; compressed clusters move when written, so they are not cached.
+// `handle` may be NULL.
+int handle_map(FileHandle *handle, const Block *head, uint32_t logical,
+               Extent *out) {
+  if (!handle) return extent_lookup(head, logical, out);
+
+  uint64_t now = __atomic_load_n(&unmapped, __ATOMIC_ACQUIRE);
+  pthread_mutex_lock(&handle->lock);
+  Extent cached = handle->extent;
+  int current = handle->generation == now;
+  pthread_mutex_unlock(&handle->lock);
+  if (current && logical - cached.logical < cached.length) {
+    *out = cached;
+    return 1;
+  }
+
+  int mapped = extent_lookup(head, logical, out);
+  if (mapped && !out->stored) handle_cache_extent(handle, out);
+  return mapped;
+}
+
+void handle_cache_extent(FileHandle *handle, const Extent *extent) {
+  if (!handle) return;
+  uint64_t now = __atomic_load_n(&unmapped, __ATOMIC_ACQUIRE);
+  pthread_mutex_lock(&handle->lock);
+  handle->extent = *extent;
+  handle->generation = now;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+// Drops every handle's cached extent. Called with the file that lost
+// blocks held exclusive, so no handle maps it again before this.
+void handle_invalidate(void) {
+  __atomic_add_fetch(&unmapped, 1, __ATOMIC_RELEASE);
+}
+
+void handle_set_offset(FileHandle *handle, off_t offset) {
+  if (!handle) return;
+  pthread_mutex_lock(&handle->lock);
+  handle->next_offset = offset;
+  pthread_mutex_unlock(&handle->lock);
+}
+
+// readahead_plan() for the stream read through `handle`, which may be NULL.
+int handle_readahead(FileHandle *handle, off_t offset, size_t size,
+                     off_t *from, size_t *len) {
+  if (!handle) return 0;
+  pthread_mutex_lock(&handle->lock);
+  int ret = readahead_plan(&handle->readahead, offset, size, from, len);
+  pthread_mutex_unlock(&handle->lock);
+  return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef SIMPLEFS_HANDLE_H
+#define SIMPLEFS_HANDLE_H
+
+#include <fuse.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "def.h"
+#include "readahead.h"
+
+// State of an open file, kept in fi->fh. Reads and writes through it skip
+// path resolution, sequential access keeps hitting the cached extent
+// instead of walking the extent tree, and sequential reads are prefetched.
+typedef struct {
+  BlockID head;          // The file's head block
+  pthread_mutex_t lock;  // Guards the rest; readers share the file lock
+  Extent extent;         // Last mapped extent used (length 0: none yet)
+  uint64_t generation;   // Of the unmappings `extent` is current with
+  off_t next_offset;     // Where the last read or write ended
+  Readahead readahead;
+} FileHandle;
+
+int handle_open(BlockID head, struct fuse_file_info *fi);
+FileHandle *handle_get(struct fuse_file_info *fi);
+void handle_close(struct fuse_file_info *fi);
+BlockID handle_resolve(const char *path, struct fuse_file_info *fi);
+void handle_unresolve(BlockID id, struct fuse_file_info *fi);
+int handle_map(FileHandle *handle, const Block *head, uint32_t logical,
+               Extent *out);
+void handle_cache_extent(FileHandle *handle, const Extent *extent);
+void handle_invalidate(void);
+void handle_set_offset(FileHandle *handle, off_t offset);
+int handle_readahead(FileHandle *handle, off_t offset, size_t size,
+                     off_t *from, size_t *len);
+
+#endif  // SIMPLEFS_HANDLE_H
@@ -7,40 +7,74 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "alloc.h"
+#include "cache.h"
 #include "def.h"
+#include "dir.h"
+#include "io.h"
+#include "journal.h"
+#include "lock.h"
+#include "orphan.h"
+#include "stats.h"
 
-Byte *get_data_ptr(Block *block) {
-  if (block->type == _FILE) return block->content.file.data;
-  if (block->type == _DATA_BLOCK) return block->content.raw.raw_data;
-  return NULL;
-}
+int disk_fd = -1;
+SuperBlock sb;
 
+// Metadata not yet checkpointed is newest in the journal.
 void read_block(BlockID id, Block *block) {
-  if (pread(disk_fd, block, sizeof(Block), id * BLOCK_SIZE) != sizeof(Block)) {
-    memset(block, 0, sizeof(Block));
-  }
+  uint64_t start = stats_now();
+  if (!journal_read(id, block)) cache_read(id, block);
+  stats_record(STAT_READ_BLOCK, start, BLOCK_SIZE);
 }
 
+// A read-only view of block `id`. With the image mapped, and nothing newer
+// pending in the journal, that is the block in place in the mapping and
+// nothing is copied; otherwise the block is read into `buf`. The view
+// stays current while the caller holds the lock that guards the block.
+const Block *view_block(BlockID id, Block *buf) {
+  const Block *mapped = io_map((off_t)id * BLOCK_SIZE, BLOCK_SIZE);
+  if (mapped && !journal_has(id)) return mapped;
+  read_block(id, buf);
+  return buf;
+}
+
+// With the journal on, the journal owns getting the block home and the
+// cache only keeps a clean copy.
 void write_block(BlockID id, Block *block) {
-  pwrite(disk_fd, block, sizeof(Block), id * BLOCK_SIZE);
+  uint64_t start = stats_now();
+  if (journal_write(id, block) == 0)
+    cache_fill(id, block);
+  else
+    cache_write(id, block);
+  stats_record(STAT_WRITE_BLOCK, start, BLOCK_SIZE);
 }
 
-BlockID find_free_block() {
-  Block block;
-  for (BlockID i = 0; i < MAX_BLOCKS; i++) {
-    read_block(i, &block);
-    if (block.type == _FREE) {
-      return i;
-    }
-  }
-  return -1;  // No free block found
+int valid_block_size(uint64_t size) {
+  return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE &&
+         (size & (size - 1)) == 0;
 }
 
-BlockID resolve_path(const char *path) {
-  if (strcmp(path, "/") == 0) return 0;
+// Reads the superblock, which also sets the geometry (BLOCK_SIZE and
+// friends) for everything else.
+int load_superblock(void) {
+  if (io_read(&sb, sizeof(SuperBlock), 0) != 0) return -EIO;
+  if (sb.magic != SIMPLEFS_MAGIC || sb.version != SIMPLEFS_VERSION ||
+      !valid_block_size(sb.block_size) || sb.block_count == 0)
+    return -EINVAL;
+  return 0;
+}
+
+int write_superblock(void) {
+  return io_write(&sb, sizeof(SuperBlock), 0) == 0 ? 0 : -EIO;
+}
 
-  Block current_dir;
-  read_block(0, &current_dir);
+// Walks the path through the directory entries alone; only directory blocks
+// are read, never the nodes along the way. Each directory is locked shared
+// only while it is searched. The node found is pinned before the directory
+// naming it is unlocked, so it cannot be removed and reclaimed, and its
+// head reused, while the caller works on it. Unpin with orphan_unpin().
+BlockID resolve_pinned(const char *path) {
+  if (strcmp(path, "/") == 0) return orphan_pin(sb.root) == 0 ? sb.root : -1;
 
   if (strlen(path) > MAX_PATH_LEN - 1) return -1;
   char path_copy[MAX_PATH_LEN];
@@ -48,35 +82,62 @@ BlockID resolve_path(const char *path) {
   strncpy(path_copy, path, MAX_PATH_LEN - 1);
   path_copy[MAX_PATH_LEN - 1] = '\0';
 
-  char *token = strtok(path_copy, "/");
+  BlockID current = sb.root;
+  enum Type type = _DIRECTORY;
+  char *save;
+  char *token = strtok_r(path_copy, "/", &save);
 
   while (token != NULL) {
-    if (current_dir.type != _DIRECTORY) {
+    if (type != _DIRECTORY) {
       return -1;
     }
-    int found = 0;
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-      BlockID child_id = current_dir.content.dir.children[i];
-      if (child_id != 0) {
-        Block child;
-        read_block(child_id, &child);
-        if (strcmp(child.name, token) == 0) {
-          current_dir = child;
-          token = strtok(NULL, "/");
-          found = 1;
-          break;
-        }
-      }
-    }
-    if (!found) return -1;
+    DirEntry entry;
+    inode_lock_shared(current);
+    BlockID next = dir_lookup(current, token, &entry);
+    token = strtok_r(NULL, "/", &save);
+    if (next != -1 && !token && orphan_pin(next) != 0) next = -1;
+    inode_unlock(current);
+    if (next == -1) return -1;
+    current = next;
+    type = entry.type;
   }
-  return current_dir.id;
+  return current;
 }
 
-int create_node(const char *path, mode_t mode) {
-  char parent_path[MAX_PATH_LEN];
-  char filename[MAX_FILENAME_LEN];
+// Creates `filename` in the directory `parent_id`, which the caller holds
+// exclusive.
+static int add_node(BlockID parent_id, const char *filename, mode_t mode,
+                    BlockID *out) {
+  BLOCK_BUFFER(parent);
+  read_block(parent_id, parent);
+  if (parent->type != _DIRECTORY) return -ENOTDIR;
+  // A removed directory takes no new entries; the reclaimer would not
+  // find them.
+  if (orphan_unlinked(parent_id)) return -ENOENT;
+  if (dir_lookup(parent_id, filename, NULL) != -1) return -EEXIST;
+
+  BlockID new_id = alloc_block(parent_id + 1);
+  if (new_id == -1) return -ENOSPC;
+
+  BLOCK_BUFFER(new_block);
+  memset(new_block, 0, BLOCK_SIZE);
+  new_block->id = new_id;
+  strcpy(new_block->name, filename);
+  new_block->type = (mode & S_IFDIR) ? _DIRECTORY : _FILE;
+  write_block(new_id, new_block);
+
+  int ret = dir_add(parent_id, filename, new_id, new_block->type);
+  if (ret != 0) {
+    free_metadata(new_id);
+    return ret;
+  }
+
+  if (out) *out = new_id;
+  return 0;
+}
 
+// Splits `path` into the directory it is in and its last component.
+static int split_path(const char *path, char *parent_path, char *filename) {
   if (strlen(path) >= MAX_PATH_LEN) return -ENAMETOOLONG;
 
   char *last_slash = strrchr(path, '/');
@@ -92,32 +153,99 @@ int create_node(const char *path, mode_t mode) {
 
   strncpy(filename, last_slash + 1, MAX_FILENAME_LEN - 1);
   filename[MAX_FILENAME_LEN - 1] = '\0';
+  return 0;
+}
+
+// Creates the file or directory `path` and stores its head block in *out
+// unless `out` is NULL.
+int create_node(const char *path, mode_t mode, BlockID *out) {
+  char parent_path[MAX_PATH_LEN];
+  char filename[MAX_FILENAME_LEN];
+  int ret = split_path(path, parent_path, filename);
+  if (ret != 0) return ret;
 
-  BlockID parent_id = resolve_path(parent_path);
+  BlockID parent_id = resolve_pinned(parent_path);
   if (parent_id == -1) return -ENOENT;
+  ret = create_at(parent_id, filename, mode, out);
+  orphan_unpin(parent_id, 1);
+  return ret;
+}
 
-  Block parent;
-  read_block(parent_id, &parent);
+// Creates the file or directory `name` in the directory `parent_id` and
+// stores its head block in *out unless `out` is NULL.
+int create_at(BlockID parent_id, const char *name, mode_t mode,
+              BlockID *out) {
+  if (strlen(name) >= MAX_FILENAME_LEN) return -ENAMETOOLONG;
+
+  journal_begin();
+  inode_lock_exclusive(parent_id);
+  int ret = add_node(parent_id, name, mode, out);
+  inode_unlock(parent_id);
+  journal_end();
+  return ret;
+}
 
-  BlockID new_id = find_free_block();
-  if (new_id == -1) return -ENOSPC;
+// Removes the file `path`, or the empty directory if `is_dir`.
+int remove_node(const char *path, int is_dir) {
+  char parent_path[MAX_PATH_LEN];
+  char filename[MAX_FILENAME_LEN];
+  int ret = split_path(path, parent_path, filename);
+  if (ret != 0) return ret;
 
-  int added = 0;
-  for (int i = 0; i < MAX_CHILDREN; i++) {
-    if (parent.content.dir.children[i] == 0) {
-      parent.content.dir.children[i] = new_id;
-      added = 1;
-      break;
-    }
-  }
-  if (!added) return -ENOSPC;
-  write_block(parent_id, &parent);
+  BlockID parent_id = resolve_pinned(parent_path);
+  if (parent_id == -1) return -ENOENT;
+  ret = remove_at(parent_id, filename, is_dir);
+  orphan_unpin(parent_id, 1);
+  return ret;
+}
 
-  Block new_block = {0};
-  new_block.id = new_id;
-  strcpy(new_block.name, filename);
-  new_block.type = (mode & S_IFDIR) ? _DIRECTORY : _FILE;
-  write_block(new_id, &new_block);
+// Checks that `id`, named in a directory as `entry`, may be removed as a
+// file, or as a directory if `is_dir`.
+static int removable(BlockID id, const DirEntry *entry, int is_dir) {
+  if (!is_dir) return entry->type == _DIRECTORY ? -EISDIR : 0;
+  if (entry->type != _DIRECTORY) return -ENOTDIR;
+
+  BLOCK_BUFFER(buf);
+  inode_lock_shared(id);
+  int64_t entries = view_block(id, buf)->size;
+  inode_unlock(id);
+  return entries == 0 ? 0 : -ENOTEMPTY;
+}
 
-  return 0;
-}
\ No newline at end of file
+// Removes `name` from the directory `parent_id`: the file it names, or the
+// empty directory if `is_dir`. Only the entry goes now; the node goes on
+// the orphan list, in the same journal operation, and its blocks are freed
+// in the background, so this takes as long for a huge file as for an
+// empty one. The kernel holds a directory being removed against creation
+// in it, so checking that it is empty before taking the entry out is
+// enough.
+int remove_at(BlockID parent_id, const char *name, int is_dir) {
+  if (strlen(name) >= MAX_FILENAME_LEN) return -ENAMETOOLONG;
+
+  journal_begin();
+  DirEntry entry;
+  inode_lock_shared(parent_id);
+  BlockID id = dir_lookup(parent_id, name, &entry);
+  inode_unlock(parent_id);
+  int ret = id == -1 ? -ENOENT : removable(id, &entry, is_dir);
+
+  if (ret == 0) {
+    inode_lock_exclusive(parent_id);
+    // Raced with another remove of the same name.
+    if (dir_lookup(parent_id, name, NULL) != id)
+      ret = -ENOENT;
+    else
+      ret = dir_remove(parent_id, name);
+    inode_unlock(parent_id);
+  }
+  if (ret == 0) {
+    BLOCK_BUFFER(head);
+    inode_lock_exclusive(id);
+    read_block(id, head);
+    orphan_add(head);
+    write_block(id, head);
+    inode_unlock(id);
+  }
+  journal_end();
+  return ret;
+}
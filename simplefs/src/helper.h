@@ -9,11 +9,17 @@
 
 #include "def.h"
 
-Byte *get_data_ptr(Block *block);
 void read_block(BlockID id, Block *block);
+const Block *view_block(BlockID id, Block *buf);
 void write_block(BlockID id, Block *block);
-BlockID find_free_block();
-BlockID resolve_path(const char *path);
-int create_node(const char *path, mode_t mode);
+int valid_block_size(uint64_t size);
+int load_superblock(void);
+int write_superblock(void);
+BlockID resolve_pinned(const char *path);
+int create_node(const char *path, mode_t mode, BlockID *out);
+int create_at(BlockID parent_id, const char *name, mode_t mode,
+              BlockID *out);
+int remove_node(const char *path, int is_dir);
+int remove_at(BlockID parent_id, const char *name, int is_dir);
 
 #endif  // SIMPLEFS_HELPER_H
\ No newline at end of file
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE  // O_DIRECT
+#include "io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "def.h"
+
+// Block I/O front end. Every read and write of disk_fd goes through here to
+// the selected backend. Until io_init() that is the pread backend without
+// O_DIRECT, which is enough to load the superblock.
+//
+// O_DIRECT wants block-aligned offsets, lengths and buffers. Requests that
+// are not are staged through an aligned buffer covering the blocks they
+// touch, taken from a per-thread arena that the uring backend can register
+// with the kernel. A write that covers part of a block reads the block
+// first; callers already hold the lock that makes that safe, since data
+// blocks are only written under their file's exclusive lock.
+
+#define ARENA_BYTES (1 << 20)
+
+static const IoBackend *backend = &pread_backend;
+static unsigned io_flags = 0;
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static __thread Byte *arena = NULL;
+static __thread size_t arena_used = 0;
+
+static size_t request_size(const IoRequest *req) {
+  size_t size = 0;
+  for (int i = 0; i < req->iovcnt; i++) size += req->iov[i].iov_len;
+  return size;
+}
+
+static int pread_submit(const IoRequest *reqs, unsigned count) {
+  int ret = 0;
+  for (unsigned i = 0; i < count; i++) {
+    const IoRequest *req = &reqs[i];
+    ssize_t want = request_size(req);
+    ssize_t n = req->write
+                    ? pwritev(disk_fd, req->iov, req->iovcnt, req->offset)
+                    : preadv(disk_fd, req->iov, req->iovcnt, req->offset);
+    if (n != want) ret = -EIO;
+  }
+  return ret;
+}
+
+static int pread_init(unsigned flags) {
+  (void)flags;
+  return 0;
+}
+
+static void pread_destroy(void) {}
+
+// Also the uring backend's: a sync is rare enough not to need the ring.
+int pread_sync(void) { return fdatasync(disk_fd) == 0 ? 0 : -errno; }
+
+// Readahead into the page cache, which pread reads are then served from.
+void pread_prefetch(off_t offset, size_t size) {
+  posix_fadvise(disk_fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+const IoBackend pread_backend = {
+    .name = "pread",
+    .init = pread_init,
+    .destroy = pread_destroy,
+    .submit = pread_submit,
+    .sync = pread_sync,
+    .prefetch = pread_prefetch,
+};
+
+static void arena_free(void *p) { free(p); }
+
+static void arena_key_create(void) {
+  pthread_key_create(&arena_key, arena_free);
+}
+
+// This thread's staging arena, allocated on first use.
+void *io_arena(size_t *size) {
+  if (!arena) {
+    pthread_once(&arena_once, arena_key_create);
+    void *p;
+    if (posix_memalign(&p, BLOCK_SIZE, ARENA_BYTES) != 0) return NULL;
+    arena = p;
+    pthread_setspecific(arena_key, arena);
+  }
+  *size = ARENA_BYTES;
+  return arena;
+}
+
+// Aligned staging memory for `size` bytes. Sets *temp if it did not fit in
+// the arena and has to be freed.
+static Byte *stage_alloc(size_t size, int *temp) {
+  size_t arena_size;
+  *temp = 0;
+  if (io_arena(&arena_size) && arena_used + size <= arena_size) {
+    Byte *buf = arena + arena_used;
+    arena_used += size;
+    return buf;
+  }
+  void *p;
+  if (posix_memalign(&p, BLOCK_SIZE, size) != 0) return NULL;
+  *temp = 1;
+  return p;
+}
+
+static int aligned(const IoRequest *req) {
+  if (req->offset % BLOCK_SIZE != 0) return 0;
+  for (int i = 0; i < req->iovcnt; i++) {
+    if ((uintptr_t)req->iov[i].iov_base % BLOCK_SIZE != 0 ||
+        req->iov[i].iov_len % BLOCK_SIZE != 0)
+      return 0;
+  }
+  return 1;
+}
+
+static void gather(Byte *dst, const IoRequest *req) {
+  for (int i = 0; i < req->iovcnt; i++) {
+    memcpy(dst, req->iov[i].iov_base, req->iov[i].iov_len);
+    dst += req->iov[i].iov_len;
+  }
+}
+
+static void scatter(const IoRequest *req, const Byte *src) {
+  for (int i = 0; i < req->iovcnt; i++) {
+    memcpy(req->iov[i].iov_base, src, req->iov[i].iov_len);
+    src += req->iov[i].iov_len;
+  }
+}
+
+typedef struct {
+  Byte *buf;  // Aligned copy of the blocks touched, or NULL if not staged
+  int temp;
+  off_t start;
+} Stage;
+
+// Submits up to IO_BATCH_REQS requests under O_DIRECT.
+static int submit_direct(const IoRequest *reqs, unsigned count) {
+  IoRequest staged[IO_BATCH_REQS], edges[2 * IO_BATCH_REQS];
+  struct iovec staged_iov[IO_BATCH_REQS], edge_iov[2 * IO_BATCH_REQS];
+  Stage stages[IO_BATCH_REQS];
+  unsigned nedges = 0;
+  int ret = 0;
+
+  arena_used = 0;
+  for (unsigned i = 0; i < count; i++) {
+    const IoRequest *req = &reqs[i];
+    Stage *st = &stages[i];
+    st->buf = NULL;
+    if (aligned(req)) {
+      staged[i] = *req;
+      continue;
+    }
+
+    off_t end = req->offset + request_size(req);
+    st->start = req->offset / BLOCK_SIZE * BLOCK_SIZE;
+    end = (end + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    size_t len = end - st->start;
+    st->buf = stage_alloc(len, &st->temp);
+    if (!st->buf) {
+      ret = -ENOMEM;
+      count = i;
+      break;
+    }
+    staged_iov[i] = (struct iovec){st->buf, len};
+    staged[i] = (IoRequest){req->write, 1, &staged_iov[i], st->start};
+    if (!req->write) continue;
+
+    // Partial blocks at either end keep the rest of their contents.
+    off_t last = end - BLOCK_SIZE;
+    if (req->offset != st->start) {
+      edge_iov[nedges] = (struct iovec){st->buf, BLOCK_SIZE};
+      edges[nedges] = (IoRequest){0, 1, &edge_iov[nedges], st->start};
+      nedges++;
+    }
+    if (req->offset + (off_t)request_size(req) != end &&
+        (last != st->start || req->offset == st->start)) {
+      edge_iov[nedges] = (struct iovec){st->buf + (last - st->start),
+                                        BLOCK_SIZE};
+      edges[nedges] = (IoRequest){0, 1, &edge_iov[nedges], last};
+      nedges++;
+    }
+  }
+
+  if (ret == 0 && nedges > 0) ret = backend->submit(edges, nedges);
+  if (ret == 0) {
+    for (unsigned i = 0; i < count; i++) {
+      if (stages[i].buf && reqs[i].write)
+        gather(stages[i].buf + (reqs[i].offset - stages[i].start), &reqs[i]);
+    }
+    ret = backend->submit(staged, count);
+    for (unsigned i = 0; ret == 0 && i < count; i++) {
+      if (stages[i].buf && !reqs[i].write)
+        scatter(&reqs[i], stages[i].buf + (reqs[i].offset - stages[i].start));
+    }
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    if (stages[i].buf && stages[i].temp) free(stages[i].buf);
+  }
+  return ret;
+}
+
+// Carries out `count` requests, as one submission where the backend allows.
+// Returns 0, or a negative errno if any request failed or came up short.
+int io_submit(const IoRequest *reqs, unsigned count) {
+  int ret = 0;
+  while (count > 0) {
+    unsigned n = count < IO_BATCH_REQS ? count : IO_BATCH_REQS;
+    int err = io_flags & IO_DIRECT ? submit_direct(reqs, n)
+                                   : backend->submit(reqs, n);
+    if (err != 0 && ret == 0) ret = err;
+    reqs += n;
+    count -= n;
+  }
+  return ret;
+}
+
+int io_sync(void) { return backend->sync(); }
+
+// The image's bytes at `offset`, in place, if the backend maps the image;
+// otherwise NULL.
+void *io_map(off_t offset, size_t size) {
+  return backend->map ? backend->map(offset, size) : NULL;
+}
+
+// Asks the backend to start reading [offset, offset + size) ahead of use.
+// O_DIRECT reads bypass the page cache, so there is nothing to fill.
+void io_prefetch(off_t offset, size_t size) {
+  if (backend->prefetch && !(io_flags & IO_DIRECT))
+    backend->prefetch(offset, size);
+}
+
+int io_read(void *buf, size_t size, off_t offset) {
+  struct iovec iov = {buf, size};
+  IoRequest req = {0, 1, &iov, offset};
+  return io_submit(&req, 1);
+}
+
+int io_write(const void *buf, size_t size, off_t offset) {
+  struct iovec iov = {(void *)buf, size};
+  IoRequest req = {1, 1, &iov, offset};
+  return io_submit(&req, 1);
+}
+
+int io_writev(const struct iovec *iov, int iovcnt, off_t offset) {
+  IoRequest req = {1, iovcnt, iov, offset};
+  return io_submit(&req, 1);
+}
+
+static void batch_add(IoBatch *batch, int write, const void *buf, size_t size,
+                      off_t offset) {
+  IoRequest *last = batch->nreqs ? &batch->reqs[batch->nreqs - 1] : NULL;
+  int merge = last && last->write == write &&
+              last->offset + (off_t)request_size(last) == offset;
+  if (batch->niov == IO_BATCH_IOV ||
+      (!merge && batch->nreqs == IO_BATCH_REQS)) {
+    io_batch_submit(batch);
+    merge = 0;
+  }
+
+  struct iovec *iov = &batch->iov[batch->niov++];
+  *iov = (struct iovec){(void *)buf, size};
+  if (merge)
+    last->iovcnt++;
+  else
+    batch->reqs[batch->nreqs++] = (IoRequest){write, 1, iov, offset};
+}
+
+void io_batch_read(IoBatch *batch, void *buf, size_t size, off_t offset) {
+  batch_add(batch, 0, buf, size, offset);
+}
+
+void io_batch_write(IoBatch *batch, const void *buf, size_t size,
+                    off_t offset) {
+  batch_add(batch, 1, buf, size, offset);
+}
+
+// Submits what is queued. Returns the first error seen by the batch.
+int io_batch_submit(IoBatch *batch) {
+  if (batch->nreqs > 0) {
+    int ret = io_submit(batch->reqs, batch->nreqs);
+    if (ret != 0 && batch->err == 0) batch->err = ret;
+  }
+  batch->nreqs = 0;
+  batch->niov = 0;
+  return batch->err;
+}
+
+// Switches disk_fd to O_DIRECT and checks the device takes block-sized
+// transfers.
+static int enable_direct(void) {
+  int flags = fcntl(disk_fd, F_GETFL);
+  if (flags < 0 || fcntl(disk_fd, F_SETFL, flags | O_DIRECT) != 0)
+    return -errno;
+
+  void *probe;
+  if (posix_memalign(&probe, BLOCK_SIZE, BLOCK_SIZE) != 0) return -ENOMEM;
+  int ret = pread(disk_fd, probe, BLOCK_SIZE, 0) == (ssize_t)BLOCK_SIZE
+                ? 0
+                : -EINVAL;
+  free(probe);
+  if (ret != 0) fcntl(disk_fd, F_SETFL, flags);
+  return ret;
+}
+
+// Selects the backend from `spec`: "pread", "uring" or "mmap", optionally
+// followed by ",direct" for O_DIRECT and ",fixed" for registered staging
+// buffers (which implies direct). Falls back to pread if the chosen backend
+// cannot start, say for a kernel without io_uring. Must run after the
+// superblock is loaded.
+int io_init(const char *spec) {
+  char copy[64];
+  if (strlen(spec) >= sizeof(copy)) return -EINVAL;
+  strcpy(copy, spec);
+
+  char *save;
+  char *name = strtok_r(copy, ",", &save);
+  static const IoBackend *const backends[] = {&pread_backend, &uring_backend,
+                                              &mmap_backend};
+  const IoBackend *chosen = NULL;
+  for (size_t i = 0; name && i < sizeof(backends) / sizeof(*backends); i++) {
+    if (strcmp(name, backends[i]->name) == 0) chosen = backends[i];
+  }
+  if (!chosen) return -EINVAL;
+
+  unsigned flags = 0;
+  for (char *opt; (opt = strtok_r(NULL, ",", &save));) {
+    if (strcmp(opt, "direct") == 0)
+      flags |= IO_DIRECT;
+    else if (strcmp(opt, "fixed") == 0)
+      flags |= IO_DIRECT | IO_FIXED;
+    else
+      return -EINVAL;
+  }
+
+  if (flags & IO_DIRECT) {
+    int ret = enable_direct();
+    if (ret != 0) return ret;
+  }
+
+  int ret = chosen->init(flags);
+  if (ret != 0 && chosen != &pread_backend) {
+    fprintf(stderr, "io: %s unavailable (%s), falling back to pread\n",
+            chosen->name, strerror(-ret));
+    chosen = &pread_backend;
+    ret = chosen->init(flags);
+  }
+  if (ret != 0) return ret;
+  backend = chosen;
+  io_flags = flags;
+  return 0;
+}
+
+void io_destroy(void) {
+  backend->destroy();
+  backend = &pread_backend;
+  io_flags = 0;
+  if (arena) {
+    pthread_setspecific(arena_key, NULL);
+    free(arena);
+    arena = NULL;
+  }
+}
+
+const char *io_backend_name(void) { return backend->name; }
@@ -0,0 +1,74 @@
+#ifndef SIMPLEFS_IO_H
+#define SIMPLEFS_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define IO_DEFAULT_BACKEND "uring"
+#define IO_BATCH_REQS 32
+#define IO_BATCH_IOV 256
+
+enum IoFlags {
+  IO_DIRECT = 1,  // O_DIRECT; transfers are staged through aligned buffers
+  IO_FIXED = 2,   // Stage through buffers registered with the kernel
+};
+
+typedef struct {
+  int write;
+  int iovcnt;
+  const struct iovec *iov;
+  off_t offset;
+} IoRequest;
+
+// A way of getting requests to and from disk_fd. submit() carries out
+// every request and returns once all are complete: 0, or -EIO if any
+// failed or came up short. sync() makes everything written durable. map(),
+// if the backend has it, returns the image's bytes at `offset` in place.
+// prefetch() starts bringing a range into memory and returns at once.
+typedef struct {
+  const char *name;
+  int (*init)(unsigned flags);
+  void (*destroy)(void);
+  int (*submit)(const IoRequest *reqs, unsigned count);
+  int (*sync)(void);
+  void *(*map)(off_t offset, size_t size);
+  void (*prefetch)(off_t offset, size_t size);
+} IoBackend;
+
+extern const IoBackend pread_backend;
+extern const IoBackend uring_backend;
+extern const IoBackend mmap_backend;
+
+int pread_sync(void);
+void pread_prefetch(off_t offset, size_t size);
+
+// Requests queued for one submission. A request that continues the
+// previous one on disk is merged into it.
+typedef struct {
+  IoRequest reqs[IO_BATCH_REQS];
+  struct iovec iov[IO_BATCH_IOV];
+  unsigned nreqs;
+  unsigned niov;
+  int err;
+} IoBatch;
+
+int io_init(const char *spec);
+void io_destroy(void);
+const char *io_backend_name(void);
+void *io_arena(size_t *size);
+
+int io_submit(const IoRequest *reqs, unsigned count);
+int io_sync(void);
+void *io_map(off_t offset, size_t size);
+void io_prefetch(off_t offset, size_t size);
+int io_read(void *buf, size_t size, off_t offset);
+int io_write(const void *buf, size_t size, off_t offset);
+int io_writev(const struct iovec *iov, int iovcnt, off_t offset);
+
+void io_batch_read(IoBatch *batch, void *buf, size_t size, off_t offset);
+void io_batch_write(IoBatch *batch, const void *buf, size_t size,
+                    off_t offset);
+int io_batch_submit(IoBatch *batch);
+
+#endif  // SIMPLEFS_IO_H
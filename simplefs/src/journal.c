@@ -0,0 +1,548 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "def.h"
+#include "io.h"
+
+// Write-ahead journal for metadata blocks, with group commit.
+//
+// Metadata writes join the running transaction instead of going home.
+// Operations bracket their writes with journal_begin()/journal_end(), so a
+// transaction only ever holds whole operations. A commit closes the running
+// transaction, waits for the operations inside it to finish and appends it
+// to the log with one sequential write and one sync; operations that
+// start meanwhile go into the next transaction. Committed blocks go home
+// only at checkpoint, when the log is full or at unmount, so a home block
+// never holds uncommitted metadata. Until then reads are served from the
+// journal's copies.
+
+typedef struct {
+  BlockID *ids;
+  Byte *images;    // `count` images of BLOCK_SIZE bytes, in insertion order
+  int32_t *slots;  // Open addressing on the id; index into `ids`, or -1
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t nslots;
+} BlockSet;
+
+typedef struct {
+  uint64_t seq;
+  BlockSet blocks;
+  uint32_t active;  // Operations inside the transaction
+  int closed;       // Being committed; new operations wait for the next one
+} Transaction;
+
+static int enabled = 0;
+static unsigned commit_interval = 0;  // ms; 0 commits after every operation
+static BlockID log_start = 0;         // First log block, after the header
+static uint64_t log_blocks = 0;
+static uint64_t log_head = 0;  // Next free log block, relative to log_start
+
+// `running` takes new writes, `committing` is being written to the log and
+// `committed` holds the latest committed image of every block not yet home.
+static Transaction txns[2];
+static Transaction *running = NULL;
+static Transaction *committing = NULL;
+static BlockSet committed;
+
+// state_lock guards `active` and `closed`; sets_lock guards the block sets
+// and the two transaction pointers; commit_lock serialises commits and with
+// them the log and `committed` writers.
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static pthread_rwlock_t sets_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int depth = 0;  // Nesting of journal_begin() in this thread
+
+static pthread_t commit_thread;
+static int commit_running = 0;
+static pthread_mutex_t commit_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_thread_cond = PTHREAD_COND_INITIALIZER;
+
+#define RECORD_IDS ((BLOCK_SIZE - sizeof(JournalRecord)) / sizeof(BlockID))
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+// FNV-1a, continued from `h`.
+static uint64_t checksum(uint64_t h, const void *data, size_t len) {
+  const Byte *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint32_t slot_of(const BlockSet *set, BlockID id) {
+  return ((uint64_t)id * 0x9e3779b97f4a7c15ULL) >> 32 & (set->nslots - 1);
+}
+
+static Byte *set_find(const BlockSet *set, BlockID id) {
+  if (set->count == 0) return NULL;
+  for (uint32_t s = slot_of(set, id);; s = (s + 1) & (set->nslots - 1)) {
+    int32_t i = set->slots[s];
+    if (i == -1) return NULL;
+    if (set->ids[i] == id) return set->images + (size_t)i * BLOCK_SIZE;
+  }
+}
+
+static void set_index(BlockSet *set, uint32_t i) {
+  uint32_t s = slot_of(set, set->ids[i]);
+  while (set->slots[s] != -1) s = (s + 1) & (set->nslots - 1);
+  set->slots[s] = i;
+}
+
+static int set_grow(BlockSet *set) {
+  uint32_t capacity = set->capacity ? set->capacity * 2 : 16;
+  BlockID *ids = realloc(set->ids, capacity * sizeof(BlockID));
+  if (!ids) return -ENOMEM;
+  set->ids = ids;
+  Byte *images = realloc(set->images, (size_t)capacity * BLOCK_SIZE);
+  if (!images) return -ENOMEM;
+  set->images = images;
+  int32_t *slots = malloc(capacity * 2 * sizeof(int32_t));
+  if (!slots) return -ENOMEM;
+
+  free(set->slots);
+  set->slots = slots;
+  set->nslots = capacity * 2;
+  set->capacity = capacity;
+  memset(slots, 0xff, set->nslots * sizeof(int32_t));
+  for (uint32_t i = 0; i < set->count; i++) set_index(set, i);
+  return 0;
+}
+
+static int set_put(BlockSet *set, BlockID id, const void *data) {
+  Byte *image = set_find(set, id);
+  if (!image) {
+    if (set->count == set->capacity && set_grow(set) != 0) return -ENOMEM;
+    set->ids[set->count] = id;
+    set_index(set, set->count);
+    image = set->images + (size_t)set->count++ * BLOCK_SIZE;
+  }
+  memcpy(image, data, BLOCK_SIZE);
+  return 0;
+}
+
+static void set_clear(BlockSet *set) {
+  if (set->count) memset(set->slots, 0xff, set->nslots * sizeof(int32_t));
+  set->count = 0;
+}
+
+static void set_free(BlockSet *set) {
+  free(set->ids);
+  free(set->images);
+  free(set->slots);
+  memset(set, 0, sizeof(BlockSet));
+}
+
+typedef struct {
+  BlockID id;
+  const Byte *image;
+} HomeWrite;
+
+static int compare_home(const void *a, const void *b) {
+  BlockID x = ((const HomeWrite *)a)->id;
+  BlockID y = ((const HomeWrite *)b)->id;
+  return (x > y) - (x < y);
+}
+
+// Writes every block of `set` to its home location as one batch, in block
+// order so that runs of adjacent blocks merge.
+static int write_home(const BlockSet *set) {
+  if (set->count == 0) return 0;
+  HomeWrite *writes = malloc(set->count * sizeof(HomeWrite));
+  if (!writes) return -ENOMEM;
+  for (uint32_t i = 0; i < set->count; i++) {
+    writes[i].id = set->ids[i];
+    writes[i].image = set->images + (size_t)i * BLOCK_SIZE;
+  }
+  qsort(writes, set->count, sizeof(HomeWrite), compare_home);
+
+  IoBatch batch = {.nreqs = 0, .niov = 0, .err = 0};
+  for (uint32_t i = 0; i < set->count; i++) {
+    io_batch_write(&batch, writes[i].image, BLOCK_SIZE,
+                   (off_t)writes[i].id * BLOCK_SIZE);
+  }
+  int ret = io_batch_submit(&batch);
+  free(writes);
+  return ret;
+}
+
+static int write_header(uint64_t seq) {
+  BLOCK_BUFFER(block);
+  memset(block, 0, BLOCK_SIZE);
+  JournalHeader *header = (JournalHeader *)block;
+  header->magic = JOURNAL_MAGIC;
+  header->seq = seq;
+  if (io_write(block, BLOCK_SIZE, (off_t)sb.journal_start * BLOCK_SIZE) != 0)
+    return -EIO;
+  return io_sync();
+}
+
+// Writes every committed block home and empties the log, which restarts
+// with transaction `next_seq`. Metadata blocks freed before the transaction
+// being committed can then be reused. Caller holds commit_lock.
+static int checkpoint(uint64_t next_seq) {
+  int ret = write_home(&committed);
+  if (ret == 0) ret = io_sync();
+  if (ret == 0) ret = write_header(next_seq);
+  if (ret != 0) return ret;
+
+  log_head = 0;
+  pthread_rwlock_wrlock(&sets_lock);
+  set_clear(&committed);
+  pthread_rwlock_unlock(&sets_lock);
+  alloc_release_held(committing ? committing->seq : next_seq);
+  return 0;
+}
+
+// Appends `txn` to the log and syncs it, checkpointing first if it does not
+// fit. Returns 1 if the transaction is too large for the log at all and was
+// written home instead, without atomicity. Caller holds commit_lock.
+static int log_transaction(Transaction *txn) {
+  const BlockSet *set = &txn->blocks;
+  uint64_t records = (set->count + RECORD_IDS - 1) / RECORD_IDS;
+  uint64_t need = set->count + records + 1;
+
+  if (need > log_blocks) {
+    fprintf(stderr, "journal: %u block transaction exceeds the log\n",
+            set->count);
+    int ret = checkpoint(txn->seq + 1);
+    if (ret == 0) ret = write_home(set);
+    if (ret == 0) ret = io_sync();
+    return ret < 0 ? ret : 1;
+  }
+  if (log_head + need > log_blocks) {
+    int ret = checkpoint(txn->seq);
+    if (ret != 0) return ret;
+  }
+
+  Byte *headers = calloc(records + 1, BLOCK_SIZE);
+  if (!headers) return -ENOMEM;
+
+  // The whole transaction is one sequential run, so the batch merges it
+  // into as few requests as its iovec limit allows.
+  IoBatch batch = {.nreqs = 0, .niov = 0, .err = 0};
+  off_t pos = (off_t)(log_start + log_head) * BLOCK_SIZE;
+  uint64_t sum = CHECKSUM_INIT;
+  for (uint64_t r = 0; r < records; r++) {
+    JournalRecord *rec = (JournalRecord *)(headers + r * BLOCK_SIZE);
+    uint32_t first = r * RECORD_IDS;
+    rec->magic = JOURNAL_MAGIC;
+    rec->type = JOURNAL_DESCRIPTOR;
+    rec->seq = txn->seq;
+    rec->count = set->count - first < RECORD_IDS ? set->count - first
+                                                 : RECORD_IDS;
+    memcpy(rec->ids, set->ids + first, rec->count * sizeof(BlockID));
+    sum = checksum(sum, rec->ids, rec->count * sizeof(BlockID));
+    io_batch_write(&batch, rec, BLOCK_SIZE, pos);
+    pos += BLOCK_SIZE;
+    for (uint32_t j = 0; j < rec->count; j++) {
+      const Byte *image = set->images + (size_t)(first + j) * BLOCK_SIZE;
+      sum = checksum(sum, image, BLOCK_SIZE);
+      io_batch_write(&batch, image, BLOCK_SIZE, pos);
+      pos += BLOCK_SIZE;
+    }
+  }
+
+  JournalRecord *commit = (JournalRecord *)(headers + records * BLOCK_SIZE);
+  commit->magic = JOURNAL_MAGIC;
+  commit->type = JOURNAL_COMMIT;
+  commit->seq = txn->seq;
+  commit->count = set->count;
+  commit->checksum = sum;
+  io_batch_write(&batch, commit, BLOCK_SIZE, pos);
+  int ret = io_batch_submit(&batch);
+  free(headers);
+
+  if (ret != 0) return ret;
+  ret = io_sync();
+  if (ret != 0) return ret;
+  log_head += need;
+  return 0;
+}
+
+// Commits the running transaction, if it holds anything, and returns once
+// it is durable. Operations already inside it are waited for.
+int journal_commit(void) {
+  if (!enabled) return 0;
+
+  pthread_mutex_lock(&commit_lock);
+  pthread_mutex_lock(&state_lock);
+  Transaction *txn = running;
+  pthread_rwlock_rdlock(&sets_lock);
+  uint32_t pending = txn->blocks.count;
+  pthread_rwlock_unlock(&sets_lock);
+  if (pending == 0) {
+    pthread_mutex_unlock(&state_lock);
+    pthread_mutex_unlock(&commit_lock);
+    return 0;
+  }
+  txn->closed = 1;
+  while (txn->active > 0) pthread_cond_wait(&state_cond, &state_lock);
+
+  Transaction *next = txn == &txns[0] ? &txns[1] : &txns[0];
+  next->seq = txn->seq + 1;
+  next->active = 0;
+  next->closed = 0;
+  pthread_rwlock_wrlock(&sets_lock);
+  running = next;
+  committing = txn;
+  pthread_rwlock_unlock(&sets_lock);
+  pthread_cond_broadcast(&state_cond);
+  pthread_mutex_unlock(&state_lock);
+
+  int ret = log_transaction(txn);
+  // Replay can no longer map back the data this transaction unmapped.
+  if (ret >= 0) alloc_release_freed(txn->seq + 1);
+
+  pthread_rwlock_wrlock(&sets_lock);
+  const BlockSet *set = &txn->blocks;
+  for (uint32_t i = 0; ret != 1 && i < set->count; i++) {
+    const Byte *image = set->images + (size_t)i * BLOCK_SIZE;
+    // Out of memory: the block is committed, so it may go home now.
+    if (set_put(&committed, set->ids[i], image) != 0)
+      io_write(image, BLOCK_SIZE, (off_t)set->ids[i] * BLOCK_SIZE);
+  }
+  set_clear(&txn->blocks);
+  committing = NULL;
+  pthread_rwlock_unlock(&sets_lock);
+  pthread_mutex_unlock(&commit_lock);
+  return ret < 0 ? ret : 0;
+}
+
+// The running transaction cannot be swapped out while an operation is
+// active in it, so leave() finds the one join() picked.
+static void join(void) {
+  pthread_mutex_lock(&state_lock);
+  running->active++;
+  pthread_mutex_unlock(&state_lock);
+}
+
+static void leave(void) {
+  pthread_mutex_lock(&state_lock);
+  if (--running->active == 0) pthread_cond_broadcast(&state_cond);
+  pthread_mutex_unlock(&state_lock);
+}
+
+// Starts an operation: every metadata write until the matching
+// journal_end() lands in the same transaction. Must be called before
+// taking any inode lock, since it may wait for a commit. Nests.
+void journal_begin(void) {
+  if (!enabled || depth++ > 0) return;
+  pthread_mutex_lock(&state_lock);
+  while (running->closed) pthread_cond_wait(&state_cond, &state_lock);
+  running->active++;
+  pthread_mutex_unlock(&state_lock);
+}
+
+void journal_end(void) {
+  if (!enabled || --depth > 0) return;
+  leave();
+
+  pthread_rwlock_rdlock(&sets_lock);
+  uint64_t pending = running->blocks.count;
+  pthread_rwlock_unlock(&sets_lock);
+  if (commit_interval == 0 || pending >= log_blocks / 4) journal_commit();
+}
+
+// Records the new contents of metadata block `id` in the running
+// transaction. Returns -1 if the journal is off and the caller has to write
+// the block itself. A write outside journal_begin() is an operation of its
+// own; it joins even a closing transaction rather than wait, since the
+// caller may hold locks a committing operation needs.
+int journal_write(BlockID id, const void *data) {
+  if (!enabled) return -1;
+
+  int own = depth == 0;
+  if (own) join();
+
+  pthread_rwlock_wrlock(&sets_lock);
+  int ret = set_put(&running->blocks, id, data);
+  pthread_rwlock_unlock(&sets_lock);
+  // Out of memory: give up on ordering rather than lose the write.
+  if (ret != 0) io_write(data, BLOCK_SIZE, (off_t)id * BLOCK_SIZE);
+
+  if (own) leave();
+  return 0;
+}
+
+// Copies the journal's latest image of block `id` into `data` and returns
+// 1, or returns 0 if the home block is current.
+int journal_read(BlockID id, void *data) {
+  if (!enabled) return 0;
+
+  pthread_rwlock_rdlock(&sets_lock);
+  const Byte *image = set_find(&running->blocks, id);
+  if (!image && committing) image = set_find(&committing->blocks, id);
+  if (!image) image = set_find(&committed, id);
+  if (image) memcpy(data, image, BLOCK_SIZE);
+  pthread_rwlock_unlock(&sets_lock);
+  return image != NULL;
+}
+
+// Whether the journal holds an image of block `id` newer than its home.
+int journal_has(BlockID id) {
+  if (!enabled) return 0;
+
+  pthread_rwlock_rdlock(&sets_lock);
+  int found = set_find(&running->blocks, id) ||
+              (committing && set_find(&committing->blocks, id)) ||
+              set_find(&committed, id);
+  pthread_rwlock_unlock(&sets_lock);
+  return found;
+}
+
+int journal_enabled(void) { return enabled; }
+
+// The transaction that writes made now join.
+uint64_t journal_running_seq(void) {
+  if (!enabled) return 0;
+  pthread_mutex_lock(&state_lock);
+  uint64_t seq = running->seq;
+  pthread_mutex_unlock(&state_lock);
+  return seq;
+}
+
+// Applies every complete transaction in the log to the home blocks, in
+// order, and sets *next_seq past the last one. Returns how many were
+// replayed.
+static int replay(uint64_t *next_seq) {
+  BLOCK_BUFFER(block);
+  if (io_read(block, BLOCK_SIZE, (off_t)sb.journal_start * BLOCK_SIZE) != 0)
+    return -EIO;
+  const JournalHeader *header = (const JournalHeader *)block;
+  uint64_t seq = header->magic == JOURNAL_MAGIC ? header->seq : 1;
+
+  BlockID *ids = malloc(RECORD_IDS * sizeof(BlockID));
+  if (!ids) return -ENOMEM;
+  BlockSet txn = {0};
+  uint64_t pos = 0;
+  int replayed = 0, ret = 0;
+
+  for (;;) {
+    const JournalRecord *rec = (const JournalRecord *)block;
+    uint64_t sum = CHECKSUM_INIT;
+    int complete = 0, valid = 1;
+    set_clear(&txn);
+
+    while (valid && pos < log_blocks) {
+      off_t at = (off_t)(log_start + pos++) * BLOCK_SIZE;
+      if (io_read(block, BLOCK_SIZE, at) != 0 || rec->magic != JOURNAL_MAGIC ||
+          rec->seq != seq)
+        break;
+      if (rec->type == JOURNAL_COMMIT) {
+        complete = rec->checksum == sum && rec->count == txn.count;
+        break;
+      }
+      if (rec->type != JOURNAL_DESCRIPTOR || rec->count > RECORD_IDS ||
+          pos + rec->count > log_blocks)
+        break;
+
+      uint32_t count = rec->count;
+      memcpy(ids, rec->ids, count * sizeof(BlockID));
+      sum = checksum(sum, ids, count * sizeof(BlockID));
+      for (uint32_t j = 0; valid && j < count; j++) {
+        at = (off_t)(log_start + pos++) * BLOCK_SIZE;
+        valid = io_read(block, BLOCK_SIZE, at) == 0 && ids[j] >= 0 &&
+                (uint64_t)ids[j] < sb.block_count &&
+                set_put(&txn, ids[j], block) == 0;
+        sum = checksum(sum, block, BLOCK_SIZE);
+      }
+    }
+    if (!complete) break;
+
+    ret = write_home(&txn);
+    if (ret != 0) break;
+    replayed++;
+    seq++;
+  }
+
+  set_free(&txn);
+  free(ids);
+  if (ret == 0 && replayed > 0) ret = io_sync();
+  *next_seq = seq;
+  return ret < 0 ? ret : replayed;
+}
+
+static void *commit_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&commit_thread_lock);
+  while (commit_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t nsec = deadline.tv_nsec + (commit_interval % 1000) * 1000000ULL;
+    deadline.tv_sec += commit_interval / 1000 + nsec / 1000000000ULL;
+    deadline.tv_nsec = nsec % 1000000000ULL;
+    pthread_cond_timedwait(&commit_thread_cond, &commit_thread_lock, &deadline);
+
+    pthread_mutex_unlock(&commit_thread_lock);
+    journal_commit();
+    pthread_mutex_lock(&commit_thread_lock);
+  }
+  pthread_mutex_unlock(&commit_thread_lock);
+  return NULL;
+}
+
+// Replays the log if the image has a journal and starts journaling.
+// Transactions are committed every `commit_ms` milliseconds, or after every
+// operation if 0. Must run before anything reads metadata.
+int journal_init(unsigned commit_ms) {
+  if (sb.journal_blocks < 2) return 0;
+  log_start = sb.journal_start + 1;
+  log_blocks = sb.journal_blocks - 1;
+
+  uint64_t seq;
+  int replayed = replay(&seq);
+  if (replayed < 0) return replayed;
+  if (replayed > 0)
+    fprintf(stderr, "journal: replayed %d transactions\n", replayed);
+  int ret = write_header(seq);
+  if (ret != 0) return ret;
+
+  log_head = 0;
+  memset(txns, 0, sizeof(txns));
+  txns[0].seq = seq;
+  running = &txns[0];
+  committing = NULL;
+  commit_interval = commit_ms;
+  enabled = 1;
+
+  if (commit_ms > 0) {
+    commit_running = 1;
+    if (pthread_create(&commit_thread, NULL, commit_main, NULL) != 0)
+      commit_running = 0;
+  }
+  return 0;
+}
+
+// Commits what is pending, writes everything home and empties the log.
+void journal_destroy(void) {
+  if (!enabled) return;
+  if (commit_running) {
+    pthread_mutex_lock(&commit_thread_lock);
+    commit_running = 0;
+    pthread_cond_signal(&commit_thread_cond);
+    pthread_mutex_unlock(&commit_thread_lock);
+    pthread_join(commit_thread, NULL);
+  }
+
+  journal_commit();
+  pthread_mutex_lock(&commit_lock);
+  checkpoint(running->seq);
+  pthread_mutex_unlock(&commit_lock);
+
+  enabled = 0;
+  set_free(&txns[0].blocks);
+  set_free(&txns[1].blocks);
+  set_free(&committed);
+}
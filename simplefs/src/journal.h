@@ -0,0 +1,21 @@
+#ifndef SIMPLEFS_JOURNAL_H
+#define SIMPLEFS_JOURNAL_H
+
+#include <stdint.h>
+
+#include "def.h"
+
+#define JOURNAL_DEFAULT_COMMIT_MS 1000
+
+int journal_init(unsigned commit_ms);
+void journal_destroy(void);
+int journal_enabled(void);
+void journal_begin(void);
+void journal_end(void);
+int journal_write(BlockID id, const void *data);
+int journal_read(BlockID id, void *data);
+int journal_has(BlockID id);
+int journal_commit(void);
+uint64_t journal_running_seq(void);
+
+#endif  // SIMPLEFS_JOURNAL_H
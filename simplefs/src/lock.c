@@ -0,0 +1,24 @@
+#include "lock.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "def.h"
+
+// A fixed table of locks indexed by a hash of the head block, so no
+// per-inode state has to be allocated or freed. Two inodes may share a
+// lock, which only costs concurrency since no thread holds two.
+#define INODE_LOCKS 1024
+
+static pthread_rwlock_t locks[INODE_LOCKS] = {
+    [0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER};
+
+static pthread_rwlock_t *lock_of(BlockID id) {
+  return &locks[((uint64_t)id * 0x9e3779b97f4a7c15ULL) >> 54];
+}
+
+void inode_lock_shared(BlockID id) { pthread_rwlock_rdlock(lock_of(id)); }
+
+void inode_lock_exclusive(BlockID id) { pthread_rwlock_wrlock(lock_of(id)); }
+
+void inode_unlock(BlockID id) { pthread_rwlock_unlock(lock_of(id)); }
@@ -0,0 +1,14 @@
+#ifndef SIMPLEFS_LOCK_H
+#define SIMPLEFS_LOCK_H
+
+#include "def.h"
+
+// Reader/writer locks on files and directories, keyed by head block.
+// Readers of a file's or directory's tree take it shared, anything that
+// changes the tree or the head takes it exclusive. A thread holds at most
+// one inode lock at a time; the allocator and cache locks nest inside.
+void inode_lock_shared(BlockID id);
+void inode_lock_exclusive(BlockID id);
+void inode_unlock(BlockID id);
+
+#endif  // SIMPLEFS_LOCK_H
@@ -0,0 +1,440 @@
+#include "lowlevel.h"
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "def.h"
+#include "dir.h"
+#include "handle.h"
+#include "helper.h"
+#include "lock.h"
+#include "orphan.h"
+#include "operator/operator.h"
+#include "stats.h"
+
+// The FUSE low-level frontend. A node's inode number is its head block, so
+// the kernel looks each name up once and then addresses the node directly:
+// no operation here parses a path. The root is FUSE_ROOT_ID, and the stats
+// file, which is in no directory, is one past the last block.
+//
+// Each entry replied pins its node until the kernel forgets it, so a
+// removed node the kernel still knows stays whole until then.
+
+// How long the kernel may trust names and attributes. Every change goes
+// through the kernel, which keeps its caches current itself.
+#define ENTRY_TIMEOUT 60.0
+#define ATTR_TIMEOUT 60.0
+
+static BlockID block_of(fuse_ino_t ino) {
+  return ino == FUSE_ROOT_ID ? sb.root : (BlockID)ino;
+}
+
+static fuse_ino_t ino_of(BlockID id) {
+  return id == sb.root ? FUSE_ROOT_ID : (fuse_ino_t)id;
+}
+
+static fuse_ino_t stats_ino(void) { return sb.block_count; }
+
+static int is_stats_name(fuse_ino_t parent, const char *name) {
+  return parent == FUSE_ROOT_ID && strcmp(name, STATS_PATH + 1) == 0;
+}
+
+static void stats_attr(struct stat *st) {
+  stats_file_attr(st);
+  st->st_ino = stats_ino();
+}
+
+static int fill_entry(BlockID id, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  int ret = node_getattr(id, &e->attr);
+  if (ret != 0) return ret;
+  e->ino = ino_of(id);
+  e->attr.st_ino = e->ino;
+  e->attr_timeout = ATTR_TIMEOUT;
+  e->entry_timeout = ENTRY_TIMEOUT;
+  return 0;
+}
+
+// Pins the node of `e`, then replies with it; a lookup the kernel does not
+// get is not forgotten either.
+static void pin_and_reply(fuse_req_t req, BlockID id,
+                          const struct fuse_entry_param *e) {
+  int ret = orphan_pin(id);
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else if (fuse_reply_entry(req, e) != 0)
+    orphan_unpin(id, 1);
+}
+
+static void reply_entry(fuse_req_t req, BlockID id) {
+  struct fuse_entry_param e;
+  int ret = fill_entry(id, &e);
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else
+    pin_and_reply(req, id, &e);
+}
+
+static void ll_destroy(void *userdata) { timed_destroy(userdata); }
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  if (is_stats_name(parent, name)) {
+    struct fuse_entry_param e = {.ino = stats_ino()};
+    stats_attr(&e.attr);
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  uint64_t start = stats_now();
+  BlockID dir_id = block_of(parent);
+  inode_lock_shared(dir_id);
+  BlockID id = dir_lookup(dir_id, name, NULL);
+  inode_unlock(dir_id);
+  // Absent, this is a negative entry: the kernel remembers that too.
+  struct fuse_entry_param e = {.ino = 0, .entry_timeout = ENTRY_TIMEOUT};
+  int ret = id == -1 ? 0 : fill_entry(id, &e);
+  stats_record(STAT_LOOKUP, start, id == -1 ? -ENOENT : ret);
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else if (id == -1)
+    fuse_reply_entry(req, &e);
+  else
+    pin_and_reply(req, id, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  if (ino != stats_ino()) orphan_unpin(block_of(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  (void)fi;
+  struct stat st;
+  if (ino == stats_ino()) {
+    stats_attr(&st);
+    fuse_reply_attr(req, &st, 0);
+    return;
+  }
+  uint64_t start = stats_now();
+  int ret = node_getattr(block_of(ino), &st);
+  stats_record(STAT_GETATTR, start, ret);
+  if (ret != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void make_node(fuse_req_t req, StatOp op, fuse_ino_t parent,
+                      const char *name, mode_t mode) {
+  if (is_stats_name(parent, name)) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  uint64_t start = stats_now();
+  BlockID id;
+  int ret = create_at(block_of(parent), name, mode, &id);
+  stats_record(op, start, ret);
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else
+    reply_entry(req, id);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, dev_t rdev) {
+  (void)rdev;
+  // Only regular files exist here; any other type is created as one.
+  make_node(req, STAT_MKNOD, parent, name, S_IFREG | (mode & ~S_IFMT));
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode) {
+  make_node(req, STAT_MKDIR, parent, name, S_IFDIR | mode);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi) {
+  if (is_stats_name(parent, name)) {
+    fuse_reply_err(req, EEXIST);
+    return;
+  }
+  uint64_t start = stats_now();
+  BlockID id;
+  int ret = create_at(block_of(parent), name, S_IFREG | mode, &id);
+  if (ret == 0) ret = handle_open(id, fi);
+  stats_record(STAT_CREATE, start, ret);
+  if (ret != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  struct fuse_entry_param e;
+  ret = fill_entry(id, &e);
+  if (ret == 0) ret = orphan_pin(id);
+  if (ret != 0) {
+    handle_close(fi);
+    fuse_reply_err(req, -ret);
+  } else if (fuse_reply_create(req, &e, fi) != 0) {
+    // The request was interrupted, so no release or forget will follow.
+    handle_close(fi);
+    orphan_unpin(id, 1);
+  }
+}
+
+static void remove_entry(fuse_req_t req, StatOp op, fuse_ino_t parent,
+                         const char *name, int is_dir) {
+  if (is_stats_name(parent, name)) {
+    fuse_reply_err(req, is_dir ? ENOTDIR : EACCES);
+    return;
+  }
+  uint64_t start = stats_now();
+  int ret = remove_at(block_of(parent), name, is_dir);
+  stats_record(op, start, ret);
+  fuse_reply_err(req, -ret);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  remove_entry(req, STAT_UNLINK, parent, name, 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  remove_entry(req, STAT_RMDIR, parent, name, 1);
+}
+
+// Only the size can change; nodes keep no mode, owner or times to set.
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi) {
+  (void)fi;
+  if (ino == stats_ino()) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  BlockID id = block_of(ino);
+  int ret = 0;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    uint64_t start = stats_now();
+    ret = node_truncate(id, attr->st_size);
+    stats_record(STAT_TRUNCATE, start, ret);
+  }
+  struct stat st;
+  if (ret == 0) ret = node_getattr(id, &st);
+  if (ret != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+  int ret;
+  if (ino == stats_ino()) {
+    ret = stats_file_open(fi);
+  } else {
+    uint64_t start = stats_now();
+    ret = node_open(block_of(ino), fi);
+    stats_record(STAT_OPEN, start, ret);
+  }
+  if (ret != 0) {
+    fuse_reply_err(req, -ret);
+  } else if (fuse_reply_open(req, fi) != 0) {
+    if (ino == stats_ino())
+      stats_file_release(fi);
+    else
+      handle_close(fi);
+  }
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi) {
+  if (ino == stats_ino()) {
+    const char *data;
+    size = stats_file_read(fi, size, off, &data);
+    fuse_reply_buf(req, data, size);
+    return;
+  }
+  char *buf = malloc(size);
+  if (!buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  uint64_t start = stats_now();
+  int ret = node_read(block_of(ino), buf, size, off, fi);
+  stats_record(STAT_READ, start, ret);
+  if (ret < 0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_buf(req, buf, ret);
+  free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off, struct fuse_file_info *fi) {
+  if (ino == stats_ino()) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  uint64_t start = stats_now();
+  int ret = node_write(block_of(ino), buf, size, off, fi);
+  stats_record(STAT_WRITE, start, ret);
+  if (ret < 0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_write(req, ret);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  if (ino == stats_ino()) {
+    stats_file_release(fi);
+    fuse_reply_err(req, 0);
+    return;
+  }
+  uint64_t start = stats_now();
+  int ret = myfs_release(NULL, fi);
+  stats_record(STAT_RELEASE, start, ret);
+  fuse_reply_err(req, -ret);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi) {
+  (void)datasync;
+  (void)fi;
+  if (ino == stats_ino()) {
+    fuse_reply_err(req, 0);
+    return;
+  }
+  uint64_t start = stats_now();
+  int ret = node_fsync(block_of(ino));
+  stats_record(STAT_FSYNC, start, ret);
+  fuse_reply_err(req, -ret);
+}
+
+static void ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                               struct fuse_file_info *fi_in,
+                               fuse_ino_t ino_out, off_t off_out,
+                               struct fuse_file_info *fi_out, size_t len,
+                               int flags) {
+  // The kernel copies the stats file through read() and write() instead.
+  if (ino_in == stats_ino() || ino_out == stats_ino()) {
+    fuse_reply_err(req, EOPNOTSUPP);
+    return;
+  }
+  uint64_t start = stats_now();
+  ssize_t ret = node_copy_file_range(block_of(ino_in), fi_in, off_in,
+                                     block_of(ino_out), fi_out, off_out, len,
+                                     flags);
+  stats_record(STAT_COPY, start, ret);
+  if (ret < 0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_write(req, ret);
+}
+
+typedef struct {
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+} DirBuffer;
+
+static int add_direntry(void *arg, const char *name, const struct stat *st,
+                        off_t off, enum fuse_fill_dir_flags flags) {
+  (void)flags;
+  DirBuffer *dir = arg;
+  struct stat none = {0};
+  size_t room = dir->size - dir->used;
+  size_t len = fuse_add_direntry(dir->req, dir->buf + dir->used, room, name,
+                                 st ? st : &none, off);
+  if (len > room) return 1;
+  dir->used += len;
+  return 0;
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t off, struct fuse_file_info *fi) {
+  (void)fi;
+  DirBuffer dir = {req, malloc(size), size, 0};
+  if (!dir.buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  uint64_t start = stats_now();
+  int ret = node_readdir(block_of(ino), &dir, add_direntry, off);
+  stats_record(STAT_READDIR, start, ret);
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_buf(req, dir.buf, dir.used);
+  free(dir.buf);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  (void)ino;
+  struct statvfs st;
+  uint64_t start = stats_now();
+  int ret = myfs_statfs(NULL, &st);
+  stats_record(STAT_STATFS, start, ret);
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops lowlevel_oper = {
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mknod = ll_mknod,
+    .mkdir = ll_mkdir,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .create = ll_create,
+    .open = ll_open,
+    .read = ll_read,
+    .write = ll_write,
+    .release = ll_release,
+    .fsync = ll_fsync,
+    .copy_file_range = ll_copy_file_range,
+    .readdir = ll_readdir,
+    .statfs = ll_statfs,
+};
+
+// Mounts at `mount_point` and serves requests in the foreground until
+// unmounted, from one thread if `threads` is 1, or else from as many as are
+// busy, up to `threads` (0 leaves the limit to FUSE).
+int lowlevel_main(const char *prog, const char *mount_point,
+                  unsigned threads) {
+  char *argv[] = {(char *)prog};
+  struct fuse_args args = FUSE_ARGS_INIT(1, argv);
+  struct fuse_session *se =
+      fuse_session_new(&args, &lowlevel_oper, sizeof(lowlevel_oper), NULL);
+  if (!se) return 1;
+
+  int ret = 1;
+  if (fuse_set_signal_handlers(se) == 0) {
+    if (fuse_session_mount(se, mount_point) == 0) {
+      if (threads == 1) {
+        ret = fuse_session_loop(se);
+      } else {
+        struct fuse_loop_config *cfg = fuse_loop_cfg_create();
+        if (cfg) {
+          if (threads > 1) fuse_loop_cfg_set_max_threads(cfg, threads);
+          ret = fuse_session_loop_mt(se, cfg);
+          fuse_loop_cfg_destroy(cfg);
+        }
+      }
+      fuse_session_unmount(se);
+    }
+    fuse_remove_signal_handlers(se);
+  }
+  fuse_session_destroy(se);
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,7 @@
+#ifndef SIMPLEFS_LOWLEVEL_H
+#define SIMPLEFS_LOWLEVEL_H
+
+int lowlevel_main(const char *prog, const char *mount_point,
+                  unsigned threads);
+
+#endif  // SIMPLEFS_LOWLEVEL_H
@@ -0,0 +1,161 @@
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "def.h"
+
+// The LZ4 block format, compressed greedily with a single-probe hash table.
+// A block is a series of sequences: a token whose high nibble is the
+// literal count and low nibble the match length minus MIN_MATCH (15 in
+// either means more length bytes follow, each adding up to 255), the
+// literals, then the match as a 16-bit little-endian distance back into
+// the output. The last sequence is literals only. Decoders may copy in
+// words, so the last LAST_LITERALS bytes are always literals and no match
+// starts within MATCH_LIMIT bytes of the end.
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_DISTANCE 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const Byte *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes the bytes that continue a length which did not fit its nibble.
+static Byte *put_length(Byte *op, size_t len) {
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+// Appends the literals [anchor, anchor + literals) and, unless `match_len`
+// is 0, a match `distance` back. Returns the new end of the output, or
+// NULL if the sequence does not fit before `out_end`.
+static Byte *put_sequence(Byte *op, const Byte *out_end, const Byte *anchor,
+                          size_t literals, size_t distance,
+                          size_t match_len) {
+  size_t worst = 1 + literals / 255 + 1 + literals + 2 + match_len / 255 + 1;
+  if (worst > (size_t)(out_end - op)) return NULL;
+
+  Byte *token = op++;
+  if (literals >= 15) {
+    *token = 15 << 4;
+    op = put_length(op, literals - 15);
+  } else {
+    *token = literals << 4;
+  }
+  memcpy(op, anchor, literals);
+  op += literals;
+  if (match_len == 0) return op;
+
+  *op++ = distance & 0xff;
+  *op++ = distance >> 8;
+  size_t len = match_len - MIN_MATCH;
+  if (len >= 15) {
+    *token |= 15;
+    op = put_length(op, len - 15);
+  } else {
+    *token |= len;
+  }
+  return op;
+}
+
+// Compresses `size` bytes into at most `capacity`. Returns the compressed
+// size, or 0 if it does not fit.
+size_t lz4_compress(const void *src, size_t size, void *dst,
+                    size_t capacity) {
+  const Byte *base = src, *ip = base, *anchor = base, *end = base + size;
+  Byte *op = dst, *out_end = op + capacity;
+  uint32_t table[1 << HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  while (size >= MATCH_LIMIT && ip <= end - MATCH_LIMIT) {
+    uint32_t h = hash(read32(ip));
+    const Byte *ref = base + table[h];
+    table[h] = ip - base;
+    if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip)) {
+      ip++;
+      continue;
+    }
+
+    const Byte *match_end = end - LAST_LITERALS;
+    size_t len = MIN_MATCH;
+    while (ip + len < match_end && ref[len] == ip[len]) len++;
+    while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+      len++;
+    }
+
+    op = put_sequence(op, out_end, anchor, ip - anchor, ip - ref, len);
+    if (!op) return 0;
+    ip += len;
+    anchor = ip;
+    table[hash(read32(ip - 2))] = ip - 2 - base;
+  }
+
+  op = put_sequence(op, out_end, anchor, end - anchor, 0, 0);
+  return op ? (size_t)(op - (Byte *)dst) : 0;
+}
+
+// Reads a length continued past its nibble. Returns 0 if the input ends
+// first.
+static int get_length(const Byte **ip, const Byte *end, size_t *len) {
+  Byte b;
+  do {
+    if (*ip >= end) return 0;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 1;
+}
+
+// Decompresses `size` bytes into at most `capacity`. Returns the
+// decompressed size, or -1 if the input is malformed or does not fit.
+ssize_t lz4_decompress(const void *src, size_t size, void *dst,
+                       size_t capacity) {
+  const Byte *ip = src, *end = ip + size;
+  Byte *out = dst, *op = out, *out_end = out + capacity;
+
+  while (ip < end) {
+    Byte token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !get_length(&ip, end, &literals)) return -1;
+    if (literals > (size_t)(end - ip) || literals > (size_t)(out_end - op))
+      return -1;
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+    if (ip == end) break;
+
+    if (end - ip < 2) return -1;
+    size_t distance = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && !get_length(&ip, end, &len)) return -1;
+    len += MIN_MATCH;
+    if (distance == 0 || distance > (size_t)(op - out) ||
+        len > (size_t)(out_end - op))
+      return -1;
+
+    const Byte *ref = op - distance;
+    if (distance >= len) {
+      memcpy(op, ref, len);
+      op += len;
+    } else {
+      // The match overlaps what it produces: a repeating pattern.
+      while (len--) *op++ = *ref++;
+    }
+  }
+  return op - out;
+}
@@ -0,0 +1,11 @@
+#ifndef SIMPLEFS_LZ4_H
+#define SIMPLEFS_LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+size_t lz4_compress(const void *src, size_t size, void *dst, size_t capacity);
+ssize_t lz4_decompress(const void *src, size_t size, void *dst,
+                       size_t capacity);
+
+#endif  // SIMPLEFS_LZ4_H
@@ -11,64 +11,173 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "alloc.h"
+#include "cache.h"
+#include "cluster.h"
 #include "def.h"
+#include "format.h"
 #include "helper.h"
+#include "io.h"
+#include "journal.h"
+#include "lowlevel.h"
+#include "orphan.h"
+#include "readahead.h"
 #include "operator/operator.h"
 
-int disk_fd = -1;
-
 static const struct fuse_operations myfs_oper = {
-    .getattr = myfs_getattr,
-    .readdir = myfs_readdir,
-    .mkdir = myfs_mkdir,
-    .mknod = myfs_mknod,
-    .write = myfs_write,
-    .read = myfs_read,
+    .getattr = timed_getattr,
+    .readdir = timed_readdir,
+    .mkdir = timed_mkdir,
+    .mknod = timed_mknod,
+    .unlink = timed_unlink,
+    .rmdir = timed_rmdir,
+    .truncate = timed_truncate,
+    .write = timed_write,
+    .read = timed_read,
+    .open = timed_open,
+    .create = timed_create,
+    .release = timed_release,
+    .statfs = timed_statfs,
+    .fsync = timed_fsync,
+    .copy_file_range = timed_copy_file_range,
+    .destroy = timed_destroy,
 };
 
-void format_disk(const char *filename) {
-  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
-  if (fd < 0) {
-    perror("Open failed");
-    exit(1);
-  }
-
-  Block empty = {0};
-  for (int i = 0; i < MAX_BLOCKS; i++) {
-    write(fd, &empty, sizeof(Block));
+// Parses a byte count with an optional K, M or G suffix. Returns 0 on
+// malformed input.
+static uint64_t parse_size(const char *arg) {
+  char *end;
+  uint64_t size = strtoull(arg, &end, 10);
+  switch (*end) {
+    case 'G':
+    case 'g':
+      size <<= 10;
+      // fall through
+    case 'M':
+    case 'm':
+      size <<= 10;
+      // fall through
+    case 'K':
+    case 'k':
+      size <<= 10;
+      end++;
+      break;
   }
-
-  Block root = {0};
-  root.id = 0;
-  root.type = _DIRECTORY;
-  strcpy(root.name, "/");
-  pwrite(fd, &root, sizeof(Block), 0);
-
-  printf("Disk formatted: %s (Size: %d bytes)\n", filename,
-         MAX_BLOCKS * BLOCK_SIZE);
-  close(fd);
+  return *end == '\0' ? size : 0;
 }
 
 int main(int argc, char *argv[]) {
   int opt;
   int is_format = 0;
   char *disk_file = NULL;
+  uint32_t cache_blocks = CACHE_DEFAULT_BLOCKS;
+  unsigned writeback_sec = CACHE_DEFAULT_WRITEBACK_SEC;
+  unsigned threads = 0;
+  int high_level = 0;
+  int compress = 0;
+  const char *io_spec = IO_DEFAULT_BACKEND;
+  uint64_t readahead_max = READAHEAD_DEFAULT_MAX;
+  uint64_t block_size = DEFAULT_BLOCK_SIZE;
+  uint64_t disk_size = DEFAULT_DISK_SIZE;
+  int64_t journal_blocks = -1;
+  int preallocate = 0;
+  unsigned commit_ms = JOURNAL_DEFAULT_COMMIT_MS;
 
   // Getopt: -n <diskfile> for formatting
-  while ((opt = getopt(argc, argv, "n:")) != -1) {
+  //         -b <bytes> block size when formatting (power of two, 512-64K)
+  //         -s <bytes> disk size when formatting (K, M or G suffix)
+  //         -j <blocks> journal size when formatting (0: no journal)
+  //         -P allocate the image's space when formatting (default: sparse)
+  //         -c <blocks> block cache size (0 disables the cache)
+  //         -w <seconds> dirty block writeback interval (0: fsync/unmount only)
+  //         -i <ms> journal commit interval (0: commit every operation)
+  //         -t <threads> FUSE worker threads (1: single-threaded, 0: default)
+  //         -H serve the path-based FUSE API instead of the inode-based one
+  //         -z compress file data as it is written
+  //         -r <bytes> largest readahead window (K or M suffix, 0: none)
+  //         -I <backend> I/O backend: pread, uring or mmap, optionally
+  //            followed by ,direct (O_DIRECT) and ,fixed (registered buffers)
+  while ((opt = getopt(argc, argv, "n:b:s:j:Pc:w:i:t:Hzr:I:")) != -1) {
     switch (opt) {
       case 'n':
         is_format = 1;
         disk_file = optarg;
         break;
+      case 'b':
+        block_size = parse_size(optarg);
+        break;
+      case 's':
+        disk_size = parse_size(optarg);
+        break;
+      case 'j':
+        journal_blocks = strtoll(optarg, NULL, 10);
+        break;
+      case 'P':
+        preallocate = 1;
+        break;
+      case 'c':
+        cache_blocks = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        writeback_sec = strtoul(optarg, NULL, 10);
+        break;
+      case 'i':
+        commit_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        threads = strtoul(optarg, NULL, 10);
+        break;
+      case 'H':
+        high_level = 1;
+        break;
+      case 'z':
+        compress = 1;
+        break;
+      case 'r':
+        readahead_max = parse_size(optarg);
+        break;
+      case 'I':
+        io_spec = optarg;
+        break;
       default:
-        fprintf(stderr, "Usage: %s [-n diskfile] [mountpoint]\n", argv[0]);
+        fprintf(stderr,
+                "Usage: %s [-n diskfile [-b block_size] [-s size] "
+                "[-j journal_blocks] [-P]] [-c cache_blocks] [-w seconds] "
+                "[-i commit_ms] [-t threads] [-H] [-z] [-r readahead] "
+                "[-I backend[,direct][,fixed]] "
+                "[disk_image mountpoint]\n",
+                argv[0]);
         return 1;
     }
   }
 
   if (is_format) {
-    format_disk(disk_file);
+    if (!valid_block_size(block_size)) {
+      fprintf(stderr, "Block size must be a power of two from %d to %d\n",
+              MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+      return 1;
+    }
+    // Room for the superblock, one bitmap block and the root at least.
+    if (disk_size / block_size < 3) {
+      fprintf(stderr, "Disk size must be at least %llu bytes\n",
+              (unsigned long long)(3 * block_size));
+      return 1;
+    }
+    uint64_t block_count = disk_size / block_size;
+    if (journal_blocks < 0) {
+      journal_blocks = default_journal_blocks(block_count);
+    } else if (journal_blocks == 1 ||
+               (uint64_t)journal_blocks > block_count / 2) {
+      // The header takes a block, so a one block journal holds nothing.
+      fprintf(stderr, "Journal must be 0 or 2 to %llu blocks\n",
+              (unsigned long long)(block_count / 2));
+      return 1;
+    }
+    format_disk(disk_file, block_size, block_count, journal_blocks,
+                preallocate);
+    printf("Disk formatted: %s (Size: %llu bytes, %u byte blocks)\n",
+           disk_file, (unsigned long long)(block_count * block_size),
+           (unsigned)block_size);
     return 0;
   }
 
@@ -86,9 +195,62 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  char *fuse_argv[] = {argv[0], mount_point, "-f", NULL};  // -f: foreground
-  int fuse_argc = 3;
+  if (load_superblock() != 0) {
+    // Older versions laid blocks out differently; such images have to be
+    // reformatted.
+    fprintf(stderr, "%s: not a simplefs v%d image (format it with -n)\n",
+            disk_file, SIMPLEFS_VERSION);
+    return 1;
+  }
+  int ret = io_init(io_spec);
+  if (ret != 0) {
+    fprintf(stderr, "%s: cannot use I/O backend \"%s\": %s\n", disk_file,
+            io_spec, strerror(-ret));
+    return 1;
+  }
+  // Replays committed transactions before anything reads the image.
+  if (journal_init(commit_ms) != 0) {
+    fprintf(stderr, "%s: failed to recover journal\n", disk_file);
+    return 1;
+  }
+  if (alloc_init() != 0) {
+    fprintf(stderr, "%s: failed to load allocation bitmap\n", disk_file);
+    return 1;
+  }
+  // A mapped image is cached by the kernel, and views into the mapping
+  // are only current with no block cache in front of it.
+  if (io_map(0, BLOCK_SIZE)) cache_blocks = 0;
+  if (cache_init(cache_blocks, writeback_sec) != 0) {
+    fprintf(stderr, "Failed to allocate a %u block cache\n", cache_blocks);
+    return 1;
+  }
+
+  // Goes on reclaiming what was removed before the last unmount or crash.
+  if (orphan_init() != 0) {
+    fprintf(stderr, "%s: failed to start the reclaimer\n", disk_file);
+    return 1;
+  }
+
+  readahead_set_max(readahead_max);
+  cluster_set_compress(compress);
 
   printf("Mounting %s to %s...\n", disk_file, mount_point);
+  if (!high_level) return lowlevel_main(argv[0], mount_point, threads);
+
+  // -f: foreground. FUSE dispatches requests from several threads unless
+  // told otherwise with -s; every operator is safe to run concurrently.
+  // hard_remove: an open file is unlinked like any other, rather than
+  // renamed out of the way, and keeps its blocks until released.
+  char *fuse_argv[8] = {argv[0], mount_point, "-f", "-o", "hard_remove"};
+  int fuse_argc = 5;
+  char threads_opt[32];
+  if (threads == 1) {
+    fuse_argv[fuse_argc++] = "-s";
+  } else if (threads > 1) {
+    snprintf(threads_opt, sizeof(threads_opt), "max_threads=%u", threads);
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = threads_opt;
+  }
+
   return fuse_main(fuse_argc, fuse_argv, &myfs_oper, NULL);
 }
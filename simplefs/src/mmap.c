@@ -0,0 +1,92 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "def.h"
+#include "io.h"
+
+// Memory-mapped backend: the whole image is mapped shared and requests are
+// plain copies to and from the mapping, with the kernel's page cache doing
+// the caching. io_map() hands out pointers into the mapping, which is what
+// lets read-only metadata lookups skip copying altogether.
+
+static Byte *image = NULL;
+static size_t image_size = 0;
+
+static int in_image(off_t offset, size_t size) {
+  return offset >= 0 && (uint64_t)offset <= image_size &&
+         size <= image_size - offset;
+}
+
+static int mmap_submit(const IoRequest *reqs, unsigned count) {
+  int ret = 0;
+  for (unsigned i = 0; i < count; i++) {
+    const IoRequest *req = &reqs[i];
+    Byte *p = image + req->offset;
+    size_t size = 0;
+    for (int j = 0; j < req->iovcnt; j++) size += req->iov[j].iov_len;
+    if (!in_image(req->offset, size)) {
+      ret = -EIO;
+      continue;
+    }
+    for (int j = 0; j < req->iovcnt; j++) {
+      if (req->write)
+        memcpy(p, req->iov[j].iov_base, req->iov[j].iov_len);
+      else
+        memcpy(req->iov[j].iov_base, p, req->iov[j].iov_len);
+      p += req->iov[j].iov_len;
+    }
+  }
+  return ret;
+}
+
+static int mmap_sync(void) {
+  return msync(image, image_size, MS_SYNC) == 0 ? 0 : -errno;
+}
+
+static void mmap_prefetch(off_t offset, size_t size) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  if (!in_image(offset, size)) return;
+  uintptr_t start = (uintptr_t)(image + offset) & ~(page - 1);
+  madvise((void *)start, (uintptr_t)(image + offset + size) - start,
+          MADV_WILLNEED);
+}
+
+static void *mmap_map(off_t offset, size_t size) {
+  return in_image(offset, size) ? image + offset : NULL;
+}
+
+// The mapping covers the image as the superblock describes it; a shorter
+// file would fault past its end. O_DIRECT makes no sense for it.
+static int mmap_init(unsigned flags) {
+  if (flags & IO_DIRECT) return -EINVAL;
+  struct stat st;
+  if (fstat(disk_fd, &st) != 0) return -errno;
+  image_size = sb.block_count * BLOCK_SIZE;
+  if ((uint64_t)st.st_size < image_size) return -EINVAL;
+  void *p = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 disk_fd, 0);
+  if (p == MAP_FAILED) return -errno;
+  image = p;
+  return 0;
+}
+
+static void mmap_destroy(void) {
+  if (!image) return;
+  msync(image, image_size, MS_SYNC);
+  munmap(image, image_size);
+  image = NULL;
+}
+
+const IoBackend mmap_backend = {
+    .name = "mmap",
+    .init = mmap_init,
+    .destroy = mmap_destroy,
+    .submit = mmap_submit,
+    .sync = mmap_sync,
+    .map = mmap_map,
+    .prefetch = mmap_prefetch,
+};
@@ -0,0 +1,71 @@
+#include <errno.h>
+#include <fuse.h>
+#include <stdlib.h>
+
+#include "../def.h"
+#include "../handle.h"
+#include "operator.h"
+
+// Data moves through a buffer of this size, never through the kernel.
+#define COPY_CHUNK (1 << 20)
+
+ssize_t myfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                             off_t offset_in, const char *path_out,
+                             struct fuse_file_info *fi_out, off_t offset_out,
+                             size_t size, int flags) {
+  BlockID in = handle_resolve(path_in, fi_in);
+  if (in == -1) return -ENOENT;
+  BlockID out = handle_resolve(path_out, fi_out);
+  if (out == -1) {
+    handle_unresolve(in, fi_in);
+    return -ENOENT;
+  }
+  ssize_t ret = node_copy_file_range(in, fi_in, offset_in, out, fi_out,
+                                     offset_out, size, flags);
+  handle_unresolve(out, fi_out);
+  handle_unresolve(in, fi_in);
+  return ret;
+}
+
+// Copies up to `size` bytes, stopping early at the end of the source, and
+// returns how many were copied. Each chunk is read under the source's lock
+// and written under the destination's, so like read() and write() the copy
+// is only atomic chunk by chunk.
+ssize_t node_copy_file_range(BlockID in, struct fuse_file_info *fi_in,
+                             off_t offset_in, BlockID out,
+                             struct fuse_file_info *fi_out, off_t offset_out,
+                             size_t size, int flags) {
+  if (flags != 0 || offset_in < 0 || offset_out < 0) return -EINVAL;
+  if (in == out && offset_in < offset_out + (off_t)size &&
+      offset_out < offset_in + (off_t)size)
+    return -EINVAL;
+
+  size_t chunk = size < COPY_CHUNK ? size : COPY_CHUNK;
+  char *buf = malloc(chunk ? chunk : 1);
+  if (!buf) return -ENOMEM;
+
+  ssize_t total = 0;
+  int err = 0;
+  while (size > 0) {
+    size_t want = size < chunk ? size : chunk;
+    int n = node_read(in, buf, want, offset_in, fi_in);
+    if (n <= 0) {
+      err = n;
+      break;
+    }
+    int written = node_write(out, buf, n, offset_out, fi_out);
+    if (written <= 0) {
+      err = written;
+      break;
+    }
+    offset_in += written;
+    offset_out += written;
+    size -= written;
+    total += written;
+    if (written < n) break;
+  }
+  free(buf);
+
+  if (total == 0 && err != 0) return err;
+  return total;
+}
@@ -0,0 +1,14 @@
+#include <errno.h>
+#include <fuse.h>
+
+#include "../def.h"
+#include "../handle.h"
+#include "../helper.h"
+#include "operator.h"
+
+int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  BlockID id;
+  int ret = create_node(path, S_IFREG | mode, &id);
+  if (ret != 0) return ret;
+  return handle_open(id, fi);
+}
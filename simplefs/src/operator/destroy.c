@@ -0,0 +1,32 @@
+#include <fuse.h>
+#include <stdio.h>
+
+#include "../alloc.h"
+#include "../cache.h"
+#include "../def.h"
+#include "../delalloc.h"
+#include "../io.h"
+#include "../journal.h"
+#include "../orphan.h"
+#include "operator.h"
+
+void myfs_destroy(void *private_data) {
+  (void)private_data;
+
+  CacheStats stats;
+  cache_get_stats(&stats);
+  // Whatever is left to reclaim stays listed for the next mount.
+  orphan_destroy();
+  delalloc_flush_all();
+  journal_destroy();
+  cache_destroy();
+  io_sync();
+  alloc_destroy();
+  io_destroy();
+
+  fprintf(stderr,
+          "cache: %u blocks, %lu hits, %lu misses, %lu evictions, "
+          "%lu writebacks\n",
+          stats.capacity, stats.hits, stats.misses, stats.evictions,
+          stats.writebacks);
+}
@@ -0,0 +1,33 @@
+#include <errno.h>
+#include <fuse.h>
+
+#include "../cache.h"
+#include "../def.h"
+#include "../delalloc.h"
+#include "../handle.h"
+#include "../helper.h"
+#include "../io.h"
+#include "../journal.h"
+#include "operator.h"
+
+int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  (void)datasync;
+
+  BlockID id = handle_resolve(path, fi);
+  if (id == -1) return -ENOENT;
+  int ret = node_fsync(id);
+  handle_unresolve(id, fi);
+  return ret;
+}
+
+int node_fsync(BlockID id) {
+  int ret = delalloc_flush_file(id);
+  if (ret != 0) return ret;
+
+  // Committing makes every metadata change so far durable, this file's
+  // included. Data is written in place, so it still needs the sync even
+  // when there was nothing to commit.
+  ret = journal_enabled() ? journal_commit() : cache_flush();
+  if (ret != 0) return ret;
+  return io_sync();
+}
@@ -3,28 +3,41 @@
 #include <string.h>
 
 #include "../def.h"
+#include "../delalloc.h"
+#include "../handle.h"
 #include "../helper.h"
+#include "../lock.h"
+#include "../orphan.h"
 #include "operator.h"
 
 int myfs_getattr(const char *path, struct stat *stbuf,
                  struct fuse_file_info *fi) {
-  (void)fi;
-  memset(stbuf, 0, sizeof(struct stat));
-
-  BlockID id = resolve_path(path);
+  BlockID id = handle_resolve(path, fi);
   if (id == -1) return -ENOENT;
+  int ret = node_getattr(id, stbuf);
+  handle_unresolve(id, fi);
+  return ret;
+}
 
-  Block block;
-  read_block(id, &block);
+int node_getattr(BlockID id, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = id;
 
-  if (block.type == _DIRECTORY) {
+  // A removed node lives on while open, with no links left.
+  int unlinked = orphan_unlinked(id);
+  BLOCK_BUFFER(buf);
+  inode_lock_shared(id);
+  const Block *block = view_block(id, buf);
+  if (block->type == _DIRECTORY) {
     stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
-  } else if (block.type == _FILE) {
+    stbuf->st_nlink = unlinked ? 0 : 2;
+  } else if (block->type == _FILE) {
     stbuf->st_mode = S_IFREG | 0644;
-    stbuf->st_nlink = 1;
-    stbuf->st_size = block.size;
+    stbuf->st_nlink = unlinked ? 0 : 1;
+    off_t buffered = delalloc_size(id);
+    stbuf->st_size = block->size > buffered ? block->size : buffered;
   }
+  inode_unlock(id);
 
   return 0;
 }
\ No newline at end of file
@@ -7,5 +7,5 @@
 #include "operator.h"
 
 int myfs_mkdir(const char *path, mode_t mode) {
-  return create_node(path, S_IFDIR | mode);
+  return create_node(path, S_IFDIR | mode, NULL);
 }
\ No newline at end of file
@@ -7,5 +7,5 @@
 #include "operator.h"
 
 int myfs_mknod(const char *path, mode_t mode, dev_t rdev) {
-  return create_node(path, S_IFREG | mode);
+  return create_node(path, S_IFREG | mode, NULL);
 }
\ No newline at end of file
@@ -0,0 +1,27 @@
+#include <errno.h>
+#include <fuse.h>
+
+#include "../def.h"
+#include "../handle.h"
+#include "../helper.h"
+#include "../lock.h"
+#include "../orphan.h"
+#include "operator.h"
+
+int myfs_open(const char *path, struct fuse_file_info *fi) {
+  BlockID id = resolve_pinned(path);
+  if (id == -1) return -ENOENT;
+  int ret = node_open(id, fi);
+  orphan_unpin(id, 1);
+  return ret;
+}
+
+int node_open(BlockID id, struct fuse_file_info *fi) {
+  BLOCK_BUFFER(buf);
+  inode_lock_shared(id);
+  int is_file = view_block(id, buf)->type == _FILE;
+  inode_unlock(id);
+  if (!is_file) return -EISDIR;
+
+  return handle_open(id, fi);
+}
@@ -3,17 +3,77 @@
 
 #include <fuse.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
+#include "../def.h"
+
+ssize_t myfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                             off_t offset_in, const char *path_out,
+                             struct fuse_file_info *fi_out, off_t offset_out,
+                             size_t size, int flags);
+int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+void myfs_destroy(void *private_data);
+int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
 int myfs_mknod(const char *path, mode_t mode, dev_t rdev);
 int myfs_getattr(const char *path, struct stat *stbuf,
                  struct fuse_file_info *fi);
 int myfs_mkdir(const char *path, mode_t mode);
+int myfs_open(const char *path, struct fuse_file_info *fi);
 int myfs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi);
 int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi,
                  enum fuse_readdir_flags flags);
+int myfs_release(const char *path, struct fuse_file_info *fi);
+int myfs_rmdir(const char *path);
+int myfs_statfs(const char *path, struct statvfs *stbuf);
+int myfs_truncate(const char *path, off_t size, struct fuse_file_info *fi);
+int myfs_unlink(const char *path);
 int myfs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi);
 
+// The operators that take a path, on the head block it resolves to.
+ssize_t node_copy_file_range(BlockID in, struct fuse_file_info *fi_in,
+                             off_t offset_in, BlockID out,
+                             struct fuse_file_info *fi_out, off_t offset_out,
+                             size_t size, int flags);
+int node_fsync(BlockID id);
+int node_getattr(BlockID id, struct stat *stbuf);
+int node_open(BlockID id, struct fuse_file_info *fi);
+int node_read(BlockID id, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi);
+int node_readdir(BlockID id, void *buf, fuse_fill_dir_t filler,
+                 off_t offset);
+int node_truncate(BlockID id, off_t size);
+int node_write(BlockID id, const char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi);
+
+// The path operators, timed into the operation stats, with STATS_PATH
+// served from them; these are what the high-level FUSE API calls.
+ssize_t timed_copy_file_range(const char *path_in,
+                              struct fuse_file_info *fi_in, off_t offset_in,
+                              const char *path_out,
+                              struct fuse_file_info *fi_out, off_t offset_out,
+                              size_t size, int flags);
+int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+void timed_destroy(void *private_data);
+int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int timed_mknod(const char *path, mode_t mode, dev_t rdev);
+int timed_getattr(const char *path, struct stat *stbuf,
+                  struct fuse_file_info *fi);
+int timed_mkdir(const char *path, mode_t mode);
+int timed_open(const char *path, struct fuse_file_info *fi);
+int timed_read(const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi);
+int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info *fi,
+                  enum fuse_readdir_flags flags);
+int timed_release(const char *path, struct fuse_file_info *fi);
+int timed_rmdir(const char *path);
+int timed_statfs(const char *path, struct statvfs *stbuf);
+int timed_truncate(const char *path, off_t size, struct fuse_file_info *fi);
+int timed_unlink(const char *path);
+int timed_write(const char *path, const char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi);
+
 #endif  // SIMPLEFS_OPERATOR_H
\ No newline at end of file
@@ -2,59 +2,132 @@
 #include <fuse.h>
 #include <string.h>
 
+#include "../cluster.h"
 #include "../def.h"
+#include "../delalloc.h"
+#include "../extent.h"
+#include "../handle.h"
 #include "../helper.h"
+#include "../io.h"
+#include "../lock.h"
 #include "operator.h"
 
-int myfs_read(const char *path, char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi) {
-  BlockID head_id = resolve_path(path);
-  if (head_id == -1) return -ENOENT;
+// Starts bringing the part of [offset, offset + len) inside the file into
+// memory, extent by extent; holes have nothing to fetch.
+static void prefetch(FileHandle *handle, const Block *head, off_t offset,
+                     size_t len) {
+  if (offset >= head->size) return;
+  if ((uint64_t)offset + len > (uint64_t)head->size) len = head->size - offset;
 
-  Block head_block;
-  read_block(head_id, &head_block);
-
-  if (offset >= head_block.size) return 0;
-  if (offset + size > head_block.size) {
-    size = head_block.size - offset;
+  uint32_t logical = offset / BLOCK_SIZE;
+  uint32_t end = ((uint64_t)offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  while (logical < end) {
+    Extent ext;
+    int mapped = handle_map(handle, head, logical, &ext);
+    uint32_t skip = logical - ext.logical;
+    uint32_t n = ext.length - skip < end - logical ? ext.length - skip
+                                                   : end - logical;
+    if (mapped && ext.stored)
+      io_prefetch((off_t)ext.start * BLOCK_SIZE,
+                  (size_t)ext.stored * BLOCK_SIZE);
+    else if (mapped)
+      io_prefetch((off_t)(ext.start + skip) * BLOCK_SIZE,
+                  (size_t)n * BLOCK_SIZE);
+    logical += n;
   }
+}
 
-  BlockID curr_id = head_id;
-  Block curr_block = head_block;
+// Holes read back as zeros, except where data is buffered for them.
+static void read_hole(BlockID head_id, int buffered, char *buf, size_t size,
+                      off_t offset) {
+  if (!buffered) {
+    memset(buf, 0, size);
+    return;
+  }
+  while (size > 0) {
+    uint32_t block_offset = offset % BLOCK_SIZE;
+    size_t n = BLOCK_SIZE - block_offset < size ? BLOCK_SIZE - block_offset
+                                                : size;
+    const Byte *data = delalloc_block(head_id, offset / BLOCK_SIZE);
+    if (data)
+      memcpy(buf, data + block_offset, n);
+    else
+      memset(buf, 0, n);
+    buf += n;
+    offset += n;
+    size -= n;
+  }
+}
 
-  int32_t block_idx = offset / MAX_FILE_DATA_SIZE;
-  int32_t block_offset = offset % MAX_FILE_DATA_SIZE;
+// Caller holds the file shared.
+static int read_file(FileHandle *handle, BlockID head_id, char *buf,
+                     size_t size, off_t offset) {
+  BLOCK_BUFFER(head_buf);
+  const Block *head_block = view_block(head_id, head_buf);
+  if (head_block->type != _FILE) return -EISDIR;
 
-  for (int i = 0; i < block_idx; i++) {
-    if (curr_block.next_block == 0) {
-      return 0;
-    }
-    curr_id = curr_block.next_block;
-    read_block(curr_id, &curr_block);
-  }
+  off_t buffered_size = delalloc_size(head_id);
+  off_t file_size = head_block->size > buffered_size ? head_block->size
+                                                     : buffered_size;
+  if (offset >= file_size) return 0;
+  if ((uint64_t)offset + size > (uint64_t)file_size) size = file_size - offset;
 
+  // Extents are read as one batch; adjacent ones merge into one request.
+  IoBatch batch = {.nreqs = 0, .niov = 0, .err = 0};
+  off_t start = offset;
   size_t total_read = 0;
 
   while (size > 0) {
-    int32_t data_in_block = MAX_FILE_DATA_SIZE - block_offset;
-    int32_t read_size = (size < data_in_block) ? size : data_in_block;
-
-    Byte *data_ptr = get_data_ptr(&curr_block);
-    memcpy(buf, data_ptr + block_offset, read_size);
-
-    buf += read_size;
-    size -= read_size;
-    total_read += read_size;
-    block_offset = 0;
-
-    if (size > 0) {
-      if (curr_block.next_block == 0) {
-        break;
-      }
-      curr_id = curr_block.next_block;
-      read_block(curr_id, &curr_block);
+    uint32_t logical = offset / BLOCK_SIZE;
+    uint32_t block_offset = offset % BLOCK_SIZE;
+
+    Extent ext;
+    size_t n;
+    int mapped = handle_map(handle, head_block, logical, &ext);
+    if (mapped && ext.stored) {
+      ssize_t got = cluster_read(&ext, logical, block_offset, buf, size);
+      if (got < 0) return got;
+      n = got;
+    } else if (mapped) {
+      uint32_t skip = logical - ext.logical;
+      n = extent_read(&batch, ext.start + skip, ext.length - skip,
+                      block_offset, buf, size);
+    } else {
+      uint64_t hole = (uint64_t)ext.length * BLOCK_SIZE - block_offset;
+      n = size < hole ? size : hole;
+      read_hole(head_id, buffered_size > 0, buf, n, offset);
     }
+
+    buf += n;
+    offset += n;
+    size -= n;
+    total_read += n;
   }
+  if (io_batch_submit(&batch) != 0) return -EIO;
+
+  off_t from;
+  size_t len;
+  if (handle_readahead(handle, start, total_read, &from, &len))
+    prefetch(handle, head_block, from, len);
 
+  handle_set_offset(handle, offset);
   return total_read;
-}
\ No newline at end of file
+}
+
+int myfs_read(const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi) {
+  BlockID head_id = handle_resolve(path, fi);
+  if (head_id == -1) return -ENOENT;
+  int ret = node_read(head_id, buf, size, offset, fi);
+  handle_unresolve(head_id, fi);
+  return ret;
+}
+
+int node_read(BlockID head_id, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi) {
+  FileHandle *handle = handle_get(fi);
+  inode_lock_shared(head_id);
+  int ret = read_file(handle, head_id, buf, size, offset);
+  inode_unlock(head_id);
+  return ret;
+}
@@ -3,35 +3,52 @@
 #include <string.h>
 
 #include "../def.h"
+#include "../dir.h"
 #include "../helper.h"
+#include "../lock.h"
+#include "../orphan.h"
 #include "operator.h"
 
+// Offsets 1 and 2 belong to "." and ".."; an entry's offset is its key plus
+// DOT_ENTRIES + 1, i.e. where a listing resumes right after it.
+#define DOT_ENTRIES 2
+
+typedef struct {
+  void *buf;
+  fuse_fill_dir_t filler;
+} FillContext;
+
+static int fill_entry(const DirEntry *entry, void *arg) {
+  FillContext *ctx = arg;
+  struct stat st = {0};
+  st.st_ino = entry->id;
+  st.st_mode = entry->type == _DIRECTORY ? S_IFDIR : S_IFREG;
+  off_t next = dir_entry_key(entry) + DOT_ENTRIES + 1;
+  return ctx->filler(ctx->buf, entry->name, &st, next, 0);
+}
+
 int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi,
                  enum fuse_readdir_flags flags) {
-  (void)offset;
   (void)fi;
   (void)flags;
 
-  BlockID id = resolve_path(path);
+  BlockID id = resolve_pinned(path);
   if (id == -1) return -ENOENT;
-
-  Block dir;
-  read_block(id, &dir);
-
-  if (dir.type != _DIRECTORY) return -ENOTDIR;
-
-  filler(buf, ".", NULL, 0, 0);
-  filler(buf, "..", NULL, 0, 0);
-
-  for (int i = 0; i < MAX_CHILDREN; i++) {
-    BlockID child_id = dir.content.dir.children[i];
-    if (child_id != 0) {
-      Block child;
-      read_block(child_id, &child);
-      filler(buf, child.name, NULL, 0, 0);
-    }
-  }
-
-  return 0;
-}
\ No newline at end of file
+  int ret = node_readdir(id, buf, filler, offset);
+  orphan_unpin(id, 1);
+  return ret;
+}
+
+int node_readdir(BlockID id, void *buf, fuse_fill_dir_t filler,
+                 off_t offset) {
+  if (offset < 1 && filler(buf, ".", NULL, 1, 0)) return 0;
+  if (offset < 2 && filler(buf, "..", NULL, 2, 0)) return 0;
+
+  uint64_t start = offset > DOT_ENTRIES ? offset - DOT_ENTRIES : 0;
+  FillContext ctx = {buf, filler};
+  inode_lock_shared(id);
+  int ret = dir_iterate(id, start, fill_entry, &ctx);
+  inode_unlock(id);
+  return ret < 0 ? ret : 0;
+}
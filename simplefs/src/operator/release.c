@@ -0,0 +1,15 @@
+#include <fuse.h>
+
+#include "../delalloc.h"
+#include "../handle.h"
+#include "operator.h"
+
+// Closing a file gives its buffered data blocks; with nothing buffered the
+// flush costs a table lookup.
+int myfs_release(const char *path, struct fuse_file_info *fi) {
+  (void)path;
+  FileHandle *handle = handle_get(fi);
+  int ret = handle ? delalloc_flush_file(handle->head) : 0;
+  handle_close(fi);
+  return ret;
+}
@@ -0,0 +1,26 @@
+#include <errno.h>
+#include <fuse.h>
+#include <string.h>
+#include <sys/statvfs.h>
+
+#include "../alloc.h"
+#include "../def.h"
+#include "../helper.h"
+#include "operator.h"
+
+int myfs_statfs(const char *path, struct statvfs *stbuf) {
+  (void)path;
+  memset(stbuf, 0, sizeof(struct statvfs));
+
+  stbuf->f_bsize = BLOCK_SIZE;
+  stbuf->f_frsize = BLOCK_SIZE;
+  stbuf->f_blocks = sb.block_count;
+  stbuf->f_bfree = free_block_count();
+  stbuf->f_bavail = stbuf->f_bfree;
+  // Every file and directory takes a block of its own.
+  stbuf->f_files = sb.block_count;
+  stbuf->f_ffree = stbuf->f_bfree;
+  stbuf->f_namemax = MAX_FILENAME_LEN - 1;
+
+  return 0;
+}
@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../stats.h"
+#include "operator.h"
+
+// The operators as FUSE calls them: each call is timed into its stats, and
+// STATS_PATH, which no directory lists, reads back a snapshot of them.
+
+static int is_stats(const char *path) {
+  return path && strcmp(path, STATS_PATH) == 0;
+}
+
+static int stats_read(char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+  const char *data;
+  size = stats_file_read(fi, size, offset, &data);
+  memcpy(buf, data, size);
+  return size;
+}
+
+int timed_getattr(const char *path, struct stat *stbuf,
+                  struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    stats_file_attr(stbuf);
+    return 0;
+  }
+  uint64_t start = stats_now();
+  int ret = myfs_getattr(path, stbuf, fi);
+  stats_record(STAT_GETATTR, start, ret);
+  return ret;
+}
+
+int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info *fi,
+                  enum fuse_readdir_flags flags) {
+  uint64_t start = stats_now();
+  int ret = myfs_readdir(path, buf, filler, offset, fi, flags);
+  stats_record(STAT_READDIR, start, ret);
+  return ret;
+}
+
+int timed_mkdir(const char *path, mode_t mode) {
+  if (is_stats(path)) return -EEXIST;
+  uint64_t start = stats_now();
+  int ret = myfs_mkdir(path, mode);
+  stats_record(STAT_MKDIR, start, ret);
+  return ret;
+}
+
+int timed_mknod(const char *path, mode_t mode, dev_t rdev) {
+  if (is_stats(path)) return -EEXIST;
+  uint64_t start = stats_now();
+  int ret = myfs_mknod(path, mode, rdev);
+  stats_record(STAT_MKNOD, start, ret);
+  return ret;
+}
+
+int timed_write(const char *path, const char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi) {
+  if (is_stats(path)) return -EACCES;
+  uint64_t start = stats_now();
+  int ret = myfs_write(path, buf, size, offset, fi);
+  stats_record(STAT_WRITE, start, ret);
+  return ret;
+}
+
+int timed_read(const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+  if (is_stats(path)) return stats_read(buf, size, offset, fi);
+  uint64_t start = stats_now();
+  int ret = myfs_read(path, buf, size, offset, fi);
+  stats_record(STAT_READ, start, ret);
+  return ret;
+}
+
+int timed_open(const char *path, struct fuse_file_info *fi) {
+  if (is_stats(path)) return stats_file_open(fi);
+  uint64_t start = stats_now();
+  int ret = myfs_open(path, fi);
+  stats_record(STAT_OPEN, start, ret);
+  return ret;
+}
+
+int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  if (is_stats(path)) return -EEXIST;
+  uint64_t start = stats_now();
+  int ret = myfs_create(path, mode, fi);
+  stats_record(STAT_CREATE, start, ret);
+  return ret;
+}
+
+int timed_release(const char *path, struct fuse_file_info *fi) {
+  if (is_stats(path)) {
+    stats_file_release(fi);
+    return 0;
+  }
+  uint64_t start = stats_now();
+  int ret = myfs_release(path, fi);
+  stats_record(STAT_RELEASE, start, ret);
+  return ret;
+}
+
+int timed_statfs(const char *path, struct statvfs *stbuf) {
+  uint64_t start = stats_now();
+  int ret = myfs_statfs(path, stbuf);
+  stats_record(STAT_STATFS, start, ret);
+  return ret;
+}
+
+int timed_unlink(const char *path) {
+  if (is_stats(path)) return -EACCES;
+  uint64_t start = stats_now();
+  int ret = myfs_unlink(path);
+  stats_record(STAT_UNLINK, start, ret);
+  return ret;
+}
+
+int timed_rmdir(const char *path) {
+  if (is_stats(path)) return -ENOTDIR;
+  uint64_t start = stats_now();
+  int ret = myfs_rmdir(path);
+  stats_record(STAT_RMDIR, start, ret);
+  return ret;
+}
+
+int timed_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  if (is_stats(path)) return -EACCES;
+  uint64_t start = stats_now();
+  int ret = myfs_truncate(path, size, fi);
+  stats_record(STAT_TRUNCATE, start, ret);
+  return ret;
+}
+
+int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (is_stats(path)) return 0;
+  uint64_t start = stats_now();
+  int ret = myfs_fsync(path, datasync, fi);
+  stats_record(STAT_FSYNC, start, ret);
+  return ret;
+}
+
+// The snapshot is not a file of ours; -EOPNOTSUPP has the kernel copy it
+// through read() and write() instead.
+ssize_t timed_copy_file_range(const char *path_in,
+                              struct fuse_file_info *fi_in, off_t offset_in,
+                              const char *path_out,
+                              struct fuse_file_info *fi_out, off_t offset_out,
+                              size_t size, int flags) {
+  if (is_stats(path_in) || is_stats(path_out)) return -EOPNOTSUPP;
+  uint64_t start = stats_now();
+  ssize_t ret = myfs_copy_file_range(path_in, fi_in, offset_in, path_out,
+                                     fi_out, offset_out, size, flags);
+  stats_record(STAT_COPY, start, ret);
+  return ret;
+}
+
+void timed_destroy(void *private_data) {
+  myfs_destroy(private_data);
+  fprintf(stderr, "operation stats:\n");
+  stats_dump(stderr);
+}
@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <fuse.h>
+#include <stdlib.h>
+
+#include "../cluster.h"
+#include "../def.h"
+#include "../delalloc.h"
+#include "../extent.h"
+#include "../handle.h"
+#include "../helper.h"
+#include "../journal.h"
+#include "../lock.h"
+#include "operator.h"
+
+int myfs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  BlockID id = handle_resolve(path, fi);
+  if (id == -1) return -ENOENT;
+  int ret = node_truncate(id, size);
+  handle_unresolve(id, fi);
+  return ret;
+}
+
+// Zeroes the file from byte `size` to the end of the block it falls in, or
+// of its compressed cluster, which stays mapped whole, so the bytes read
+// back as zeros if the file grows again. Buffered blocks are left to
+// delalloc_truncate().
+static int zero_tail(Block *head, off_t size) {
+  uint32_t logical = size / BLOCK_SIZE;
+  uint32_t offset = size % BLOCK_SIZE;
+  Extent ext;
+  if (!extent_lookup(head, logical, &ext)) return 0;
+  // Nothing of the block, or of the cluster, is kept.
+  if (offset == 0 && (!ext.stored || logical == ext.logical)) return 0;
+
+  char *zeros = calloc(1, ext.stored ? CLUSTER_SIZE : BLOCK_SIZE);
+  if (!zeros) return -ENOMEM;
+  ssize_t n;
+  if (ext.stored) {
+    size_t len = (size_t)(ext.logical + ext.length) * BLOCK_SIZE - size;
+    n = cluster_write(head, &ext, logical, offset, zeros, len);
+  } else {
+    n = extent_write(ext.start + (logical - ext.logical), 1, offset, zeros,
+                     BLOCK_SIZE - offset);
+  }
+  free(zeros);
+  return n < 0 ? n : 0;
+}
+
+// Shrinking unmaps the blocks past the new end in the same journal
+// operation that sets the size, so a crash never leaves a file shorter
+// than the blocks it maps. The blocks are not reused before that operation
+// commits, so a crash that brings the old size back finds their data
+// intact. Caller holds the file exclusive.
+static int truncate_file(BlockID id, off_t size) {
+  BLOCK_BUFFER(head);
+  read_block(id, head);
+  if (head->type != _FILE) return -EISDIR;
+
+  off_t buffered = delalloc_size(id);
+  off_t old_size = head->size > buffered ? head->size : buffered;
+  if (size < old_size) {
+    int err = zero_tail(head, size);
+    if (err != 0) return err;
+    delalloc_truncate(id, size);
+    extent_truncate(head, ((uint64_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    handle_invalidate();
+  }
+  head->size = size;
+  write_block(id, head);
+  return 0;
+}
+
+int node_truncate(BlockID id, off_t size) {
+  if (size < 0) return -EINVAL;
+  // Extents address file blocks with 32 bits.
+  if ((uint64_t)size / BLOCK_SIZE >= EXTENT_HOLE_MAX) return -EFBIG;
+
+  journal_begin();
+  inode_lock_exclusive(id);
+  int ret = truncate_file(id, size);
+  inode_unlock(id);
+  journal_end();
+  return ret;
+}
@@ -0,0 +1,8 @@
+#include <errno.h>
+#include <fuse.h>
+
+#include "../def.h"
+#include "../helper.h"
+#include "operator.h"
+
+int myfs_unlink(const char *path) { return remove_node(path, 0); }
@@ -2,81 +2,93 @@
 #include <fuse.h>
 #include <string.h>
 
+#include "../cluster.h"
 #include "../def.h"
+#include "../delalloc.h"
+#include "../extent.h"
+#include "../handle.h"
 #include "../helper.h"
+#include "../journal.h"
+#include "../lock.h"
 #include "operator.h"
 
-int myfs_write(const char *path, const char *buf, size_t size, off_t offset,
-               struct fuse_file_info *fi) {
-  BlockID head_id = resolve_path(path);
-  if (head_id == -1) return -ENOENT;
-
-  Block head_block;
-  read_block(head_id, &head_block);
-
-  BlockID curr_id = head_id;
-  Block curr_block = head_block;
-
-  int32_t block_idx = offset / MAX_FILE_DATA_SIZE;
-  int32_t block_offset = offset % MAX_FILE_DATA_SIZE;
-  
-  for (int i = 0; i < block_idx; i++) {
-    if (curr_block.next_block == 0) {
-      BlockID new_id = find_free_block();
-      if (new_id == -1) return -ENOSPC;
-
-      Block new_block = {0};
-      new_block.id = new_id;
-      new_block.type = _DATA_BLOCK;
-      write_block(new_id, &new_block);
-
-      curr_block.next_block = new_id;
-      write_block(curr_id, &curr_block);
-    }
-
-    curr_id = curr_block.next_block;
-    read_block(curr_id, &curr_block);
-  }
+// Blocks the file already has are written in place, except compressed
+// clusters, which move; data for the rest is buffered until the file is
+// flushed, which allocates it in runs. The head is only written here when
+// a write grows the file or changes its extents, or a flush happens.
+// Caller holds the file exclusive.
+static int write_file(FileHandle *handle, BlockID head_id, const char *buf,
+                      size_t size, off_t offset) {
+  BLOCK_BUFFER(head_block);
+  read_block(head_id, head_block);
+  if (head_block->type != _FILE) return -EISDIR;
+  // Extents address file blocks with 32 bits.
+  if (((uint64_t)offset + size) / BLOCK_SIZE >= EXTENT_HOLE_MAX)
+    return -EFBIG;
 
   size_t total_written = 0;
-  size_t original_request_size = size;
+  int head_dirty = 0;
+  int err = 0;
 
   while (size > 0) {
-    int32_t space_in_block = MAX_FILE_DATA_SIZE - block_offset;
-    int32_t write_size = (size < space_in_block) ? size : space_in_block;
-
-    Byte *data_ptr = get_data_ptr(&curr_block);
-    memcpy(data_ptr + block_offset, buf, write_size);
-    write_block(curr_id, &curr_block);
-
-    buf += write_size;
-    size -= write_size;
-    total_written += write_size;
-    block_offset = 0;
-
-    if (size > 0) {
-      if (curr_block.next_block == 0) {
-        BlockID new_id = find_free_block();
-        if (new_id == -1) break;
-
-        Block new_block = {0};
-        new_block.id = new_id;
-        new_block.type = _DATA_BLOCK;
-        write_block(new_id, &new_block);
-
-        curr_block.next_block = new_id;
-        write_block(curr_id, &curr_block);
+    uint32_t logical = offset / BLOCK_SIZE;
+    uint32_t block_offset = offset % BLOCK_SIZE;
+
+    Extent ext;
+    ssize_t n;
+    if (handle_map(handle, head_block, logical, &ext)) {
+      uint32_t skip = logical - ext.logical;
+      if (ext.stored) {
+        n = cluster_write(head_block, &ext, logical, block_offset, buf, size);
+        if (n > 0) head_dirty = 1;
+      } else {
+        n = extent_write(ext.start + skip, ext.length - skip, block_offset,
+                         buf, size);
+      }
+      if (n > 0 && offset + n > head_block->size) {
+        head_block->size = offset + n;
+        head_dirty = 1;
       }
-      curr_id = curr_block.next_block;
-      read_block(curr_id, &curr_block);
+    } else {
+      n = delalloc_write(head_id, logical, block_offset, buf, size);
+    }
+    if (n < 0) {
+      err = n;
+      break;
     }
-  }
 
-  read_block(head_id, &head_block);
-  if (offset + total_written > head_block.size) {
-    head_block.size = offset + total_written;
-    write_block(head_id, &head_block);
+    buf += n;
+    offset += n;
+    size -= n;
+    total_written += n;
   }
 
+  // A failed flush leaves the data buffered for the next one.
+  if (delalloc_full(head_id) && delalloc_flush(head_block) > 0)
+    head_dirty = 1;
+  if (head_dirty) write_block(head_id, head_block);
+  handle_set_offset(handle, offset);
+
+  if (total_written == 0 && err != 0) return err;
   return total_written;
-}
\ No newline at end of file
+}
+
+int myfs_write(const char *path, const char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+  BlockID head_id = handle_resolve(path, fi);
+  if (head_id == -1) return -ENOENT;
+  int ret = node_write(head_id, buf, size, offset, fi);
+  handle_unresolve(head_id, fi);
+  return ret;
+}
+
+int node_write(BlockID head_id, const char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+  FileHandle *handle = handle_get(fi);
+  journal_begin();
+  inode_lock_exclusive(head_id);
+  int ret = write_file(handle, head_id, buf, size, offset);
+  inode_unlock(head_id);
+  journal_end();
+  return ret;
+}
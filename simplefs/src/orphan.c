@@ -0,0 +1,329 @@
+#include "orphan.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "def.h"
+#include "delalloc.h"
+#include "dir.h"
+#include "extent.h"
+#include "helper.h"
+#include "journal.h"
+#include "lock.h"
+#include "stats.h"
+
+// Removed files and directories. Removing a name unlinks it and puts the
+// node's head on the orphan list in one journal operation; a background
+// thread frees the node's blocks later, a batch per operation, so removal
+// costs the same whatever the file's size. The list runs from sb.orphans
+// through the heads' next_block and is on disk, so after a crash every
+// node is either still named or still listed, and the next mount goes on
+// where the thread stopped.
+//
+// A node is pinned while a handle has it open or the kernel remembers it,
+// and is reclaimed only once unpinned: a removed file stays readable for
+// as long as it is open. The pin table also marks removed nodes, for their
+// link count.
+//
+// New orphans are pushed at the front of the list; only the reclaimer
+// takes them off or changes a next_block once set. list_lock guards
+// sb.orphans and nests inside inode locks.
+
+#define PIN_BUCKETS 256
+#define RECLAIM_BATCH 16384  // File blocks freed per journal operation
+
+typedef struct Pin {
+  BlockID id;
+  uint64_t count;
+  int unlinked;
+  struct Pin *next;
+} Pin;
+
+typedef struct {
+  pthread_mutex_t lock;
+  Pin *pins;
+} PinBucket;
+
+static PinBucket buckets[PIN_BUCKETS] = {
+    [0 ... PIN_BUCKETS - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL}};
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaimer;
+static int running = 0;
+static int pending = 0;  // An orphan may have become reclaimable
+
+static PinBucket *bucket_of(BlockID id) {
+  return &buckets[((uint64_t)id * 0x9e3779b97f4a7c15ULL) >> 56];
+}
+
+// The link to the entry for `id`, or to the NULL ending the chain. Caller
+// holds the bucket.
+static Pin **find(PinBucket *b, BlockID id) {
+  Pin **p = &b->pins;
+  while (*p && (*p)->id != id) p = &(*p)->next;
+  return p;
+}
+
+static void kick(void) {
+  pthread_mutex_lock(&list_lock);
+  pending = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&list_lock);
+}
+
+static int stopping(void) {
+  return !__atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+int orphan_pin(BlockID id) {
+  PinBucket *b = bucket_of(id);
+  pthread_mutex_lock(&b->lock);
+  Pin **p = find(b, id);
+  if (!*p) *p = calloc(1, sizeof(Pin));
+  if (*p) {
+    (*p)->id = id;
+    (*p)->count++;
+  }
+  int ret = *p ? 0 : -ENOMEM;
+  pthread_mutex_unlock(&b->lock);
+  return ret;
+}
+
+void orphan_unpin(BlockID id, uint64_t count) {
+  PinBucket *b = bucket_of(id);
+  int reclaimable = 0;
+  pthread_mutex_lock(&b->lock);
+  Pin **p = find(b, id);
+  Pin *pin = *p;
+  if (pin) {
+    pin->count -= count < pin->count ? count : pin->count;
+    if (pin->count == 0 && pin->unlinked) {
+      reclaimable = 1;
+    } else if (pin->count == 0) {
+      *p = pin->next;
+      free(pin);
+    }
+  }
+  pthread_mutex_unlock(&b->lock);
+  if (reclaimable) kick();
+}
+
+static int pinned(BlockID id) {
+  PinBucket *b = bucket_of(id);
+  pthread_mutex_lock(&b->lock);
+  Pin *pin = *find(b, id);
+  int ret = pin && pin->count > 0;
+  pthread_mutex_unlock(&b->lock);
+  return ret;
+}
+
+// Whether `id` was removed and is waiting to be reclaimed.
+int orphan_unlinked(BlockID id) {
+  PinBucket *b = bucket_of(id);
+  pthread_mutex_lock(&b->lock);
+  Pin *pin = *find(b, id);
+  int ret = pin && pin->unlinked;
+  pthread_mutex_unlock(&b->lock);
+  return ret;
+}
+
+static void forget_pin(BlockID id) {
+  PinBucket *b = bucket_of(id);
+  pthread_mutex_lock(&b->lock);
+  Pin **p = find(b, id);
+  Pin *pin = *p;
+  if (pin) {
+    *p = pin->next;
+    free(pin);
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+// The superblock goes through the journal like the heads it links, so the
+// list head moves in the same transaction. Caller holds list_lock.
+static void write_list_head(void) {
+  BLOCK_BUFFER(block);
+  memset(block, 0, BLOCK_SIZE);
+  memcpy(block, &sb, sizeof(SuperBlock));
+  write_block(SUPERBLOCK_ID, block);
+}
+
+// Puts the node in `head`, whose name was just removed, on the orphan
+// list. Caller holds it exclusive inside the journal operation that
+// removed the name, and writes `head` back.
+void orphan_add(Block *head) {
+  PinBucket *b = bucket_of(head->id);
+  pthread_mutex_lock(&b->lock);
+  Pin **p = find(b, head->id);
+  if (!*p) *p = calloc(1, sizeof(Pin));
+  // Without memory for the mark the link count is merely wrong.
+  if (*p) {
+    (*p)->id = head->id;
+    (*p)->unlinked = 1;
+  }
+  pthread_mutex_unlock(&b->lock);
+
+  pthread_mutex_lock(&list_lock);
+  head->next_block = sb.orphans;
+  sb.orphans = head->id;
+  write_list_head();
+  pending = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&list_lock);
+}
+
+static BlockID next_of(BlockID id) {
+  BLOCK_BUFFER(buf);
+  inode_lock_shared(id);
+  BlockID next = view_block(id, buf)->next_block;
+  inode_unlock(id);
+  return next;
+}
+
+// Frees the blocks under the orphan `id`, a batch per journal operation,
+// leaving just its head. Returns the file size it had, or -1 if stopped
+// before the end.
+static off_t free_tree(BlockID id) {
+  off_t size = 0;
+  for (int done = 0; !done;) {
+    if (stopping()) return -1;
+    journal_begin();
+    inode_lock_exclusive(id);
+    BLOCK_BUFFER(head);
+    read_block(id, head);
+    done = 1;
+    if (head->type == _FILE) {
+      delalloc_truncate(id, 0);
+      uint32_t end = extent_end(head);
+      extent_truncate(head, end > RECLAIM_BATCH ? end - RECLAIM_BATCH : 0);
+      done = end <= RECLAIM_BATCH;
+      if (head->size > size) size = head->size;
+    } else if (head->type == _DIRECTORY) {
+      dir_release(head);
+    }
+    write_block(id, head);
+    inode_unlock(id);
+    journal_end();
+  }
+  return size;
+}
+
+// Takes the reclaimed orphan `id` off the list and frees its head. `prev`
+// is the orphan before it, 0 if it was first when the pass began; newer
+// orphans may have been pushed in front of it since.
+static void drop_orphan(BlockID id, BlockID prev, BlockID next) {
+  journal_begin();
+  while (prev == 0) {
+    pthread_mutex_lock(&list_lock);
+    BlockID first = sb.orphans;
+    if (first == id) {
+      sb.orphans = next;
+      write_list_head();
+    }
+    pthread_mutex_unlock(&list_lock);
+    if (first == id) break;
+
+    prev = first;
+    for (BlockID n; prev != 0 && (n = next_of(prev)) != id;) prev = n;
+    // Only a corrupt list loses it; leave the head where it is.
+    if (prev == 0) {
+      journal_end();
+      return;
+    }
+  }
+  if (prev != 0) {
+    BLOCK_BUFFER(block);
+    inode_lock_exclusive(prev);
+    read_block(prev, block);
+    block->next_block = next;
+    write_block(prev, block);
+    inode_unlock(prev);
+  }
+  free_metadata(id);
+  journal_end();
+  forget_pin(id);
+}
+
+// One walk down the list, reclaiming every orphan nothing pins.
+static void reclaim_all(void) {
+  pthread_mutex_lock(&list_lock);
+  BlockID id = sb.orphans;
+  pthread_mutex_unlock(&list_lock);
+
+  BlockID prev = 0;
+  while (id != 0 && !stopping()) {
+    BlockID next = next_of(id);
+    if (pinned(id)) {
+      prev = id;
+    } else {
+      uint64_t start = stats_now();
+      off_t size = free_tree(id);
+      if (size < 0) return;
+      drop_orphan(id, prev, next);
+      stats_record(STAT_RECLAIM, start, size);
+    }
+    id = next;
+  }
+}
+
+static void *reclaim_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&list_lock);
+  while (!stopping()) {
+    if (!pending) {
+      pthread_cond_wait(&wake, &list_lock);
+      continue;
+    }
+    pending = 0;
+    pthread_mutex_unlock(&list_lock);
+    reclaim_all();
+    pthread_mutex_lock(&list_lock);
+  }
+  pthread_mutex_unlock(&list_lock);
+  return NULL;
+}
+
+// Starts the reclaimer, which first goes through whatever the list held at
+// the last unmount or crash. Runs once the journal is replayed, the block
+// cache is up and the allocator is loaded.
+int orphan_init(void) {
+  // Replay may have moved the list head since the superblock was loaded.
+  BLOCK_BUFFER(block);
+  read_block(SUPERBLOCK_ID, block);
+  sb.orphans = ((const SuperBlock *)block)->orphans;
+
+  pending = sb.orphans != 0;
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&reclaimer, NULL, reclaim_main, NULL) != 0) {
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    return -EAGAIN;
+  }
+  return 0;
+}
+
+// Stops the reclaimer after the batch it is on; the rest waits on the list
+// for the next mount. Forgets every pin.
+void orphan_destroy(void) {
+  pthread_mutex_lock(&list_lock);
+  int was_running = !stopping();
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&list_lock);
+  if (was_running) pthread_join(reclaimer, NULL);
+
+  for (int i = 0; i < PIN_BUCKETS; i++) {
+    PinBucket *b = &buckets[i];
+    pthread_mutex_lock(&b->lock);
+    while (b->pins) {
+      Pin *pin = b->pins;
+      b->pins = pin->next;
+      free(pin);
+    }
+    pthread_mutex_unlock(&b->lock);
+  }
+}
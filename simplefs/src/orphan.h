@@ -0,0 +1,15 @@
+#ifndef SIMPLEFS_ORPHAN_H
+#define SIMPLEFS_ORPHAN_H
+
+#include <stdint.h>
+
+#include "def.h"
+
+int orphan_init(void);
+void orphan_destroy(void);
+void orphan_add(Block *head);
+int orphan_unlinked(BlockID id);
+int orphan_pin(BlockID id);
+void orphan_unpin(BlockID id, uint64_t count);
+
+#endif  // SIMPLEFS_ORPHAN_H
@@ -0,0 +1,60 @@
+#include "readahead.h"
+
+#include <stdint.h>
+#include <time.h>
+
+// Readahead keeps a window of a file prefetched past a sequential reader.
+// A read that starts where the previous one ended, or at the start of the
+// file, continues the stream; any other read ends it and prefetching stops
+// until the reader is sequential again. The window is sized to what the
+// reader consumes in HORIZON_MS at its observed throughput, within
+// [READAHEAD_MIN, max_window], and is topped up once half of it is used.
+
+#define HORIZON_MS 100
+
+static size_t max_window = READAHEAD_DEFAULT_MAX;
+
+// Largest window in bytes; 0 turns readahead off.
+void readahead_set_max(size_t bytes) { max_window = bytes; }
+
+static double seconds_since(const struct timespec *then,
+                            const struct timespec *now) {
+  return (now->tv_sec - then->tv_sec) + (now->tv_nsec - then->tv_nsec) / 1e9;
+}
+
+// Records a read of `size` bytes at `offset`. Returns 1 and sets [*from,
+// *from + *len) to the file range to prefetch now, or returns 0.
+int readahead_plan(Readahead *ra, off_t offset, size_t size, off_t *from,
+                   size_t *len) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  off_t end = offset + size;
+
+  int sequential = size > 0 && (offset == 0 || offset == ra->next);
+  if (!sequential || max_window == 0) {
+    ra->window = 0;
+    ra->ahead = 0;
+    ra->rate = 0;
+  } else if (ra->window == 0) {
+    ra->window = READAHEAD_MIN < max_window ? READAHEAD_MIN : max_window;
+  } else {
+    double dt = seconds_since(&ra->last, &now);
+    double rate = size / (dt > 1e-6 ? dt : 1e-6);
+    ra->rate = ra->rate > 0 ? (3 * ra->rate + rate) / 4 : rate;
+    uint64_t window = ra->rate * HORIZON_MS / 1000;
+    if (window < READAHEAD_MIN) window = READAHEAD_MIN;
+    if (window > max_window) window = max_window;
+    ra->window = window;
+  }
+  ra->next = end;
+  ra->last = now;
+
+  if (ra->window == 0) return 0;
+  if (ra->ahead < end) ra->ahead = end;
+  if ((uint64_t)(ra->ahead - end) >= ra->window / 2) return 0;
+
+  *from = ra->ahead;
+  *len = end + ra->window - ra->ahead;
+  ra->ahead = end + ra->window;
+  return 1;
+}
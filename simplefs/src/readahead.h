@@ -0,0 +1,25 @@
+#ifndef SIMPLEFS_READAHEAD_H
+#define SIMPLEFS_READAHEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define READAHEAD_MIN (128 << 10)
+#define READAHEAD_DEFAULT_MAX (2 << 20)
+
+// Sequential-read detection for one open file.
+typedef struct {
+  off_t next;            // Where a sequential read would start
+  off_t ahead;           // Prefetched up to here
+  uint64_t window;       // Bytes to keep prefetched past the reader
+  double rate;           // Smoothed read throughput, bytes per second
+  struct timespec last;  // When the previous read ended
+} Readahead;
+
+void readahead_set_max(size_t bytes);
+int readahead_plan(Readahead *ra, off_t offset, size_t size, off_t *from,
+                   size_t *len);
+
+#endif  // SIMPLEFS_READAHEAD_H
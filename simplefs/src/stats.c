@@ -0,0 +1,229 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Per-operation counters and latency histograms. Every thread records into
+// one of SHARDS copies with relaxed atomic adds, so recording takes no lock
+// and threads rarely share a cache line; reading sums the shards. Bucket i
+// counts latencies in [2^i, 2^(i + 1)) nanoseconds.
+
+#define SHARDS 16
+#define BUCKETS 40  // Up to 2^40 ns, about 18 minutes
+
+typedef struct {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[BUCKETS];
+} OpStats;
+
+typedef struct {
+  OpStats ops[STAT_OPS];
+} __attribute__((aligned(64))) Shard;
+
+static Shard shards[SHARDS];
+static unsigned next_shard = 0;
+static __thread Shard *shard = NULL;
+
+// Bytes of file data compression was tried on, and the bytes they took on
+// disk. Clusters are large, so one pair of counters keeps up.
+static uint64_t raw_bytes = 0;
+static uint64_t stored_bytes = 0;
+
+static const char *const names[STAT_OPS] = {
+    [STAT_LOOKUP] = "lookup",           [STAT_GETATTR] = "getattr",
+    [STAT_READDIR] = "readdir",
+    [STAT_MKDIR] = "mkdir",             [STAT_MKNOD] = "mknod",
+    [STAT_WRITE] = "write",             [STAT_READ] = "read",
+    [STAT_OPEN] = "open",               [STAT_CREATE] = "create",
+    [STAT_RELEASE] = "release",         [STAT_STATFS] = "statfs",
+    [STAT_FSYNC] = "fsync",             [STAT_COPY] = "copy_file_range",
+    [STAT_UNLINK] = "unlink",           [STAT_RMDIR] = "rmdir",
+    [STAT_TRUNCATE] = "truncate",       [STAT_RECLAIM] = "reclaim",
+    [STAT_COMPRESS] = "compress",       [STAT_DECOMPRESS] = "decompress",
+    [STAT_READ_BLOCK] = "read_block",   [STAT_WRITE_BLOCK] = "write_block",
+};
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned bucket_of(uint64_t ns) {
+  unsigned bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+  return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+// Records an operation that began at `start` (from stats_now()). A
+// negative `result` is an error; otherwise it is the bytes moved.
+void stats_record(StatOp op, uint64_t start, ssize_t result) {
+  uint64_t ns = stats_now() - start;
+  if (!shard) {
+    unsigned i = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+    shard = &shards[i % SHARDS];
+  }
+  OpStats *s = &shard->ops[op];
+  __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+  if (result < 0)
+    __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+  else if (result > 0)
+    __atomic_add_fetch(&s->bytes, result, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED)) {
+  }
+}
+
+void stats_compressed(uint64_t raw, uint64_t stored) {
+  __atomic_add_fetch(&raw_bytes, raw, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stored_bytes, stored, __ATOMIC_RELAXED);
+}
+
+static void sum_shards(StatOp op, OpStats *out) {
+  *out = (OpStats){0};
+  for (int i = 0; i < SHARDS; i++) {
+    const OpStats *s = &shards[i].ops[op];
+    out->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    out->errors += __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+    out->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    out->total_ns += __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    if (max > out->max_ns) out->max_ns = max;
+    for (int b = 0; b < BUCKETS; b++)
+      out->buckets[b] += __atomic_load_n(&s->buckets[b], __ATOMIC_RELAXED);
+  }
+}
+
+// Upper bound of the bucket holding the pct-th percentile, in nanoseconds.
+static uint64_t percentile_ns(const OpStats *s, unsigned pct) {
+  uint64_t rank = (s->count * pct + 99) / 100, seen = 0;
+  for (int b = 0; b < BUCKETS; b++) {
+    seen += s->buckets[b];
+    if (seen >= rank && seen > 0) return (uint64_t)2 << b;
+  }
+  return s->max_ns;
+}
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;  // Of everything emitted, whether it fit or not
+} Text;
+
+static void emit(Text *text, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void emit(Text *text, const char *fmt, ...) {
+  size_t room = text->len < text->size ? text->size - text->len : 0;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(room ? text->buf + text->len : NULL, room, fmt, ap);
+  va_end(ap);
+  if (n > 0) text->len += n;
+}
+
+// Writes a text snapshot into `buf` like snprintf(): returns the length of
+// the whole snapshot, even if that did not fit. Each operation that ran
+// has one line of totals and one of "<bucket floor ns>:<count>" pairs.
+// Compression, once used, adds a line with the ratio it achieved.
+size_t stats_render(char *buf, size_t size) {
+  Text text = {buf, size, 0};
+  for (int op = 0; op < STAT_OPS; op++) {
+    OpStats s;
+    sum_shards(op, &s);
+    if (s.count == 0) continue;
+    emit(&text,
+         "%s count=%llu errors=%llu bytes=%llu avg_ns=%llu p50_ns=%llu "
+         "p99_ns=%llu max_ns=%llu\n",
+         names[op], (unsigned long long)s.count,
+         (unsigned long long)s.errors, (unsigned long long)s.bytes,
+         (unsigned long long)(s.total_ns / s.count),
+         (unsigned long long)percentile_ns(&s, 50),
+         (unsigned long long)percentile_ns(&s, 99),
+         (unsigned long long)s.max_ns);
+    emit(&text, "%s histogram", names[op]);
+    for (int b = 0; b < BUCKETS; b++) {
+      if (s.buckets[b]) {
+        emit(&text, " %llu:%llu", 1ULL << b,
+             (unsigned long long)s.buckets[b]);
+      }
+    }
+    emit(&text, "\n");
+  }
+  uint64_t raw = __atomic_load_n(&raw_bytes, __ATOMIC_RELAXED);
+  uint64_t stored = __atomic_load_n(&stored_bytes, __ATOMIC_RELAXED);
+  if (raw > 0) {
+    emit(&text, "compression raw_bytes=%llu stored_bytes=%llu ratio=%.2f\n",
+         (unsigned long long)raw, (unsigned long long)stored,
+         stored ? (double)raw / stored : 0.0);
+  }
+  return text.len;
+}
+
+// Returns a malloc()ed snapshot, or NULL when out of memory.
+StatsSnapshot *stats_snapshot(void) {
+  size_t size = stats_render(NULL, 0);
+  StatsSnapshot *snap = malloc(sizeof(StatsSnapshot) + size + 1);
+  if (!snap) return NULL;
+  // Operations may have finished since; keep what fits.
+  snap->size = stats_render(snap->text, size + 1);
+  if (snap->size > size) snap->size = size;
+  return snap;
+}
+
+void stats_dump(FILE *out) {
+  StatsSnapshot *snap = stats_snapshot();
+  if (!snap) return;
+  fwrite(snap->text, 1, snap->size, out);
+  free(snap);
+}
+
+// STATS_PATH as both front ends serve it. Opening it takes a snapshot into
+// fi->fh, so a reader sees one consistent text.
+
+void stats_file_attr(struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_size = stats_render(NULL, 0);
+}
+
+int stats_file_open(struct fuse_file_info *fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+  StatsSnapshot *snap = stats_snapshot();
+  if (!snap) return -ENOMEM;
+  fi->fh = (uint64_t)(uintptr_t)snap;
+  // The size getattr reported is stale by now.
+  fi->direct_io = 1;
+  return 0;
+}
+
+// Points *data at up to `size` bytes of the snapshot from `offset` on and
+// returns how many there are.
+size_t stats_file_read(const struct fuse_file_info *fi, size_t size,
+                       off_t offset, const char **data) {
+  const StatsSnapshot *snap = (const StatsSnapshot *)(uintptr_t)fi->fh;
+  *data = snap->text;
+  if (offset < 0 || (size_t)offset >= snap->size) return 0;
+  *data += offset;
+  return size < snap->size - offset ? size : snap->size - offset;
+}
+
+void stats_file_release(struct fuse_file_info *fi) {
+  free((StatsSnapshot *)(uintptr_t)fi->fh);
+  fi->fh = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef SIMPLEFS_STATS_H
+#define SIMPLEFS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define STATS_PATH "/.simplefs_stats"
+
+typedef enum {
+  STAT_LOOKUP,
+  STAT_GETATTR,
+  STAT_READDIR,
+  STAT_MKDIR,
+  STAT_MKNOD,
+  STAT_WRITE,
+  STAT_READ,
+  STAT_OPEN,
+  STAT_CREATE,
+  STAT_RELEASE,
+  STAT_STATFS,
+  STAT_FSYNC,
+  STAT_COPY,
+  STAT_UNLINK,
+  STAT_RMDIR,
+  STAT_TRUNCATE,
+  STAT_RECLAIM,
+  STAT_COMPRESS,
+  STAT_DECOMPRESS,
+  STAT_READ_BLOCK,
+  STAT_WRITE_BLOCK,
+  STAT_OPS,
+} StatOp;
+
+// A text snapshot of the stats, as STATS_PATH reads back.
+typedef struct {
+  size_t size;
+  char text[];
+} StatsSnapshot;
+
+uint64_t stats_now(void);
+void stats_record(StatOp op, uint64_t start, ssize_t result);
+void stats_compressed(uint64_t raw, uint64_t stored);
+size_t stats_render(char *buf, size_t size);
+StatsSnapshot *stats_snapshot(void);
+void stats_dump(FILE *out);
+
+struct fuse_file_info;
+void stats_file_attr(struct stat *st);
+int stats_file_open(struct fuse_file_info *fi);
+size_t stats_file_read(const struct fuse_file_info *fi, size_t size,
+                       off_t offset, const char **data);
+void stats_file_release(struct fuse_file_info *fi);
+
+#endif  // SIMPLEFS_STATS_H
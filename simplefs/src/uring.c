@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// <linux/fs.h>, pulled in by io_uring.h, has its own BLOCK_SIZE.
+#undef BLOCK_SIZE
+
+#include "def.h"
+#include "io.h"
+
+// io_uring backend, on the raw system calls. Each thread that does I/O gets
+// its own ring on first use, so submissions never contend; a batch goes in
+// with one io_uring_enter() and the thread waits for its completions. With
+// IO_FIXED the thread's staging arena is registered with its ring and
+// staged transfers use the fixed-buffer opcodes.
+
+#define RING_ENTRIES 64
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;  // Same as sq_map with IORING_FEAT_SINGLE_MMAP
+  size_t cq_map_size;
+  size_t sqes_size;
+  const Byte *fixed;  // Registered buffer, NULL if none
+  size_t fixed_size;
+} Ring;
+
+static unsigned ring_flags = 0;
+static pthread_key_t ring_key;
+static __thread Ring *ring = NULL;
+
+static void ring_free(void *p) {
+  Ring *r = p;
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+  munmap(r->sq_map, r->sq_map_size);
+  close(r->fd);
+  free(r);
+}
+
+static Ring *ring_create(void) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (fd < 0) return NULL;
+
+  Ring *r = calloc(1, sizeof(Ring));
+  if (!r) {
+    close(fd);
+    return NULL;
+  }
+  r->fd = fd;
+  r->entries = p.sq_entries;
+  r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cq_map_size > r->sq_map_size)
+    r->sq_map_size = r->cq_map_size;
+
+  r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  r->cq_map = single ? r->sq_map
+                     : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED ||
+      r->sqes == MAP_FAILED) {
+    if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (!single && r->cq_map != MAP_FAILED) munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_map_size);
+    close(fd);
+    free(r);
+    return NULL;
+  }
+
+  Byte *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // Without the registration (say, RLIMIT_MEMLOCK is too low) staged
+  // transfers simply use the ordinary opcodes.
+  size_t size;
+  struct iovec iov;
+  if ((ring_flags & IO_FIXED) && (iov.iov_base = io_arena(&size))) {
+    iov.iov_len = size;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov,
+                1) == 0) {
+      r->fixed = iov.iov_base;
+      r->fixed_size = size;
+    }
+  }
+  return r;
+}
+
+static Ring *this_ring(void) {
+  if (!ring) {
+    ring = ring_create();
+    if (ring) pthread_setspecific(ring_key, ring);
+  }
+  return ring;
+}
+
+static void prepare(Ring *r, const IoRequest *req, unsigned index) {
+  unsigned tail = *r->sq_tail;
+  unsigned slot = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = disk_fd;
+  sqe->off = req->offset;
+  sqe->user_data = index;
+
+  const Byte *base = req->iov[0].iov_base;
+  if (req->iovcnt == 1 && r->fixed && base >= r->fixed &&
+      base + req->iov[0].iov_len <= r->fixed + r->fixed_size) {
+    sqe->opcode = req->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->addr = (uintptr_t)base;
+    sqe->len = req->iov[0].iov_len;
+    sqe->buf_index = 0;
+  } else {
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->addr = (uintptr_t)req->iov;
+    sqe->len = req->iovcnt;
+  }
+  r->sq_array[slot] = slot;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Consecutive failed io_uring_enter() calls after which a batch stops
+// being submitted.
+#define ENTER_RETRIES 16
+
+// Sleeps before the next io_uring_enter(), longer after each failure in a
+// row, up to a millisecond.
+static void backoff(unsigned failures) {
+  usleep(failures < 10 ? 1u << failures : 1000);
+}
+
+// Submits up to r->entries requests and waits for all of them. If the ring
+// keeps refusing them, waits only for those already in flight, since their
+// buffers stay busy until the kernel is done with them, and fails.
+static int submit_ring(Ring *r, const IoRequest *reqs, unsigned count) {
+  for (unsigned i = 0; i < count; i++) prepare(r, &reqs[i], i);
+
+  int ret = 0;
+  unsigned submitted = 0, done = 0, failures = 0;
+  int stopped = 0;
+  while (done < (stopped ? submitted : count)) {
+    int n = syscall(__NR_io_uring_enter, r->fd,
+                    stopped ? 0 : count - submitted, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n >= 0) {
+      submitted += n;
+      failures = 0;
+    } else if (!stopped && ((errno != EINTR && errno != EAGAIN &&
+                             errno != EBUSY) ||
+                            failures >= ENTER_RETRIES)) {
+      // Take back what the kernel never saw.
+      __atomic_store_n(r->sq_tail, *r->sq_tail - (count - submitted),
+                       __ATOMIC_RELEASE);
+      if (submitted == 0) return pread_backend.submit(reqs, count);
+      stopped = 1;
+      ret = -EIO;
+    } else {
+      // Completions may still arrive; EBUSY even asks for them to be
+      // reaped before anything more goes in.
+      backoff(failures++);
+    }
+
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, done++) {
+      const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      const IoRequest *req = &reqs[cqe->user_data];
+      size_t want = 0;
+      for (int j = 0; j < req->iovcnt; j++) want += req->iov[j].iov_len;
+      if (cqe->res < 0 || (size_t)cqe->res != want) ret = -EIO;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return ret;
+}
+
+static int uring_submit(const IoRequest *reqs, unsigned count) {
+  Ring *r = this_ring();
+  if (!r) return pread_backend.submit(reqs, count);
+
+  int ret = 0;
+  while (count > 0) {
+    unsigned n = count < r->entries ? count : r->entries;
+    int err = submit_ring(r, reqs, n);
+    if (err != 0 && ret == 0) ret = err;
+    reqs += n;
+    count -= n;
+  }
+  return ret;
+}
+
+// Sets up a ring for the calling thread, which also tells whether the
+// kernel has io_uring at all.
+static int uring_init(unsigned flags) {
+  ring_flags = flags;
+  if (pthread_key_create(&ring_key, ring_free) != 0) return -EAGAIN;
+  if (!this_ring()) {
+    int ret = -errno;
+    pthread_key_delete(ring_key);
+    return ret ? ret : -ENOSYS;
+  }
+  return 0;
+}
+
+static void uring_destroy(void) {
+  if (ring) {
+    pthread_setspecific(ring_key, NULL);
+    ring_free(ring);
+    ring = NULL;
+  }
+  pthread_key_delete(ring_key);
+}
+
+const IoBackend uring_backend = {
+    .name = "uring",
+    .init = uring_init,
+    .destroy = uring_destroy,
+    .submit = uring_submit,
+    .sync = pread_sync,
+    .prefetch = pread_prefetch,
+};